@@ -0,0 +1,88 @@
+// Compares RequestParser with the way ClientHandler used to read a request
+// head: a find() for the blank line over the whole buffer after every read,
+// an istringstream for the request line and a get_header_value() scan per
+// field looked up. Each round reads one browser-sized GET head, delivered in
+// reads of the given size, and looks up the fields a download consults.
+//
+//   cmake --build build --target request_parser_bench
+//   ./build/request_parser_bench [rounds]
+
+#include "request_parser.h"
+#include "server_utils.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+static const char* const kHead =
+    "GET /3f9c2a7e/file?dl=1 HTTP/1.1\r\n"
+    "Host: 192.168.1.20:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://192.168.1.20:8080/3f9c2a7e\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "If-None-Match: \"5e1f-18c2a9d04b0\"\r\n"
+    "If-Modified-Since: Fri, 16 Oct 2026 21:14:03 GMT\r\n"
+    "Range: bytes=1048576-\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n";
+
+static const char* const kFields[] = {"Connection", "Accept-Encoding", "Range", "If-Range",
+                                      "If-None-Match", "If-Modified-Since", "Content-Type"};
+
+// The sink keeps the lookups from being optimized away.
+static size_t sink = 0;
+
+static void old_path(const std::string& head, size_t read_size) {
+    std::string buf;
+    for (size_t pos = 0; buf.find("\r\n\r\n") == std::string::npos; pos += read_size) {
+        buf.append(head, pos, read_size);
+    }
+    std::istringstream rs(buf);
+    std::string method, path, ver;
+    rs >> method >> path >> ver;
+    sink += method.size() + path.size() + ver.size();
+    for (const char* name : kFields) sink += get_header_value(buf, name).size();
+    sink += extract_content_length(buf) + 1;
+}
+
+static void new_path(const std::string& head, size_t read_size) {
+    std::string buf;
+    RequestParser parser;
+    for (size_t pos = 0; parser.feed(buf) == RequestParser::Status::Incomplete; pos += read_size) {
+        buf.append(head, pos, read_size);
+    }
+    size_t head_size = parser.head_size();
+    parser.reset();
+    parser.parse(std::string_view(buf).substr(0, head_size));
+    sink += parser.method().size() + parser.target().size() + parser.version().size();
+    for (const char* name : kFields) sink += parser.header(name).size();
+    sink += parser.content_length() + 1;
+}
+
+template <typename F>
+static double time_ns(F run, const std::string& head, size_t read_size, long rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < rounds; ++i) run(head, read_size);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / rounds;
+}
+
+int main(int argc, char** argv) {
+    long rounds = argc > 1 ? std::atol(argv[1]) : 200000;
+    if (rounds <= 0) rounds = 200000;
+    std::string head = kHead;
+
+    std::printf("%zu-byte head, %ld rounds\n", head.size(), rounds);
+    std::printf("%-10s %14s %14s %8s\n", "read size", "old ns/req", "parser ns/req", "speedup");
+    for (size_t read_size : {head.size(), (size_t)128, (size_t)16}) {
+        double old_ns = time_ns(old_path, head, read_size, rounds);
+        double new_ns = time_ns(new_path, head, read_size, rounds);
+        std::printf("%-10zu %14.1f %14.1f %7.2fx\n", read_size, old_ns, new_ns, old_ns / new_ns);
+    }
+    return sink == 0;
+}
@@ -26,7 +26,7 @@ INSTALL_CMD=""
 
 if [[ "$OS" == "Linux" ]]; then
     if command -v apt &> /dev/null; then
-        BASE_PKGS="build-essential cmake zip unzip coreutils libarchive-dev libssl-dev"
+        BASE_PKGS="build-essential cmake zip unzip coreutils zlib1g-dev libssl-dev"
         QR_PKGS="libqrencode-dev"
         if [ "$INSTALL_QR" = "YES" ]; then
             INSTALL_CMD="sudo apt update && sudo apt install -y $BASE_PKGS $QR_PKGS"
@@ -34,7 +34,7 @@ if [[ "$OS" == "Linux" ]]; then
             INSTALL_CMD="sudo apt update && sudo apt install -y $BASE_PKGS"
         fi
     elif command -v dnf &> /dev/null; then
-        BASE_PKGS="cmake gcc-c++ make zip unzip coreutils libarchive-devel openssl-devel"
+        BASE_PKGS="cmake gcc-c++ make zip unzip coreutils zlib-devel openssl-devel"
         QR_PKGS="libqrencode-devel"
         if [ "$INSTALL_QR" = "YES" ]; then
             INSTALL_CMD="sudo dnf install -y $BASE_PKGS $QR_PKGS"
@@ -42,7 +42,7 @@ if [[ "$OS" == "Linux" ]]; then
             INSTALL_CMD="sudo dnf install -y $BASE_PKGS"
         fi
     elif command -v pacman &> /dev/null; then
-        BASE_PKGS="cmake base-devel zip unzip coreutils libarchive openssl"
+        BASE_PKGS="cmake base-devel zip unzip coreutils zlib openssl"
         QR_PKGS="libqrencode"
         if [ "$INSTALL_QR" = "YES" ]; then
             INSTALL_CMD="sudo pacman -Sy --noconfirm $BASE_PKGS $QR_PKGS"
@@ -51,7 +51,7 @@ if [[ "$OS" == "Linux" ]]; then
         fi
     fi
 elif [[ "$OS" == "Darwin" ]]; then
-    BASE_PKGS="cmake zip coreutils libarchive openssl"
+    BASE_PKGS="cmake zip coreutils zlib openssl"
     QR_PKGS="qrencode"
     if [ "$INSTALL_QR" = "YES" ]; then
         INSTALL_CMD="brew install $BASE_PKGS $QR_PKGS"
@@ -60,7 +60,7 @@ elif [[ "$OS" == "Darwin" ]]; then
     fi
 else
     echo "! Unsupported OS: $OS"
-    echo "You may need to manually install: cmake, g++, zip, coreutils, libarchive"
+    echo "You may need to manually install: cmake, g++, zip, coreutils, zlib"
     if [ "$INSTALL_QR" = "YES" ]; then
         echo "and optional: libqrencode"
     fi
@@ -15,6 +15,7 @@
 #include "cli.h"
 #include "server/server.h"
 #include "utils/archive_utils.h"
+#include "utils/zip_stream.h"
 #include "utils/utils.h"
 #include "utils/file_utils.h"
 #include "utils/network_utils.h"
@@ -50,7 +51,94 @@ static long long get_env_max_size_bytes() {
     }
 }
 
+// Serves until the download completes (true) or is cancelled. The port the
+// server ended up on is written back to `opt`.
+static bool serve_send(ServerOptions &opt){
+    SimpleHTTPServer srv(opt);
+
+    srv.on_log = [](const std::string &m){ std::cout << "[srv] " << m << "\n"; };
+    srv.on_client_done = [&](){
+        std::cout << "[srv] Transfer complete, shutting down.\n";
+        // Stop before signalling, so the port is free once serve_send() returns.
+        srv.stop();
+        server_finished = true;
+    };
+
+    if(!srv.start()){
+        std::cerr << "Failed to start server\n";
+        return false;
+    }
+    opt.port = srv.get_port();
+
+    std::string uri = srv.host_url();
+    std::cout << "Open this URL on the receiver device:\n";
+    print_qr_ascii(uri);
+    std::cout << "Waiting for client to download... Press Ctrl-C to cancel.\n";
+
+    while(!server_finished && !interrupted)
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    if (interrupted) {
+        interrupted = false;
+        std::cout << "[srv] Cancelled by user.\n";
+        srv.stop();
+        return false;
+    }
+    return true;
+}
+
+// Options of a server in `mode` for `path`, with the settings from the
+// environment.
+static ServerOptions server_options(const std::string &mode, const std::string &path){
+    ServerOptions opt;
+    opt.mode = mode;
+    opt.token = random_token(24);
+    opt.path = path;
+    opt.bind_address = get_default_bind_address();
+    opt.max_size = get_env_max_size_bytes();
+    opt.interrupted = &interrupted;
+    opt.socket_timeout_seconds = 60;
+    opt.event_loop_threads = get_event_loop_threads();
+    opt.io_engine = get_io_engine();
+    opt.keep_alive_timeout_seconds = get_keep_alive_timeout();
+    opt.keep_alive_max_requests = get_keep_alive_max_requests();
+    opt.sync_mode = get_sync_mode();
+    opt.compress = get_compression();
+    opt.rate_limit = get_rate_limit();
+    opt.conn_rate_limit = get_conn_rate_limit();
+    return opt;
+}
+
+// Offers the volumes of a split archive one after another, on the same URL:
+// the receiver reloads the page for the next volume once one is complete.
+static void run_send_volumes(const std::vector<std::string> &volumes){
+    std::string token = random_token(24);
+    int port = 0;
+    for (size_t i = 0; i < volumes.size(); ++i) {
+        std::cout << "[*] Volume " << (i + 1) << "/" << volumes.size() << ": " << volumes[i] << "\n";
+        ServerOptions opt = server_options("send", volumes[i]);
+        opt.token = token;
+        opt.port = port;
+        opt.working_dir = fs::absolute(volumes[i]).parent_path().string();
+
+        server_finished = false;
+        if (!serve_send(opt)) return;
+        port = opt.port;
+        if (i + 1 < volumes.size())
+            std::cout << "[*] Reload the page on the receiver device for the next volume.\n";
+    }
+    std::string name = fs::path(volumes[0]).filename().string();
+    name.resize(name.size() - 4);
+    std::cout << "[*] All " << volumes.size() << " volumes sent. Join them with: cat " << name << ".* > " << name << "\n";
+}
+
 void run_send(const std::string &filepath){
+    std::vector<std::string> volumes = find_split_volumes(filepath);
+    if (!volumes.empty()) {
+        run_send_volumes(volumes);
+        return;
+    }
+
     if(!file_exists(filepath)){
         std::cerr << "File not found: " << filepath << "\n";
         return;
@@ -63,14 +151,7 @@ void run_send(const std::string &filepath){
     }
     test_file.close();
 
-    ServerOptions opt;
-    opt.mode = "send";
-    opt.token = random_token(24);
-    opt.path = filepath;
-    opt.bind_address = get_default_bind_address();
-    opt.max_size = get_env_max_size_bytes();
-    opt.interrupted = &interrupted;
-    opt.socket_timeout_seconds = 60;
+    ServerOptions opt = server_options("send", filepath);
 
     char filepath_abs[PATH_MAX];
     if (realpath(filepath.c_str(), filepath_abs) != nullptr) {
@@ -96,45 +177,72 @@ void run_send(const std::string &filepath){
         }
     }
 
-    SimpleHTTPServer srv(opt);
+    serve_send(opt);
+}
 
-    srv.on_log = [](const std::string &m){ std::cout << "[srv] " << m << "\n"; };
-    srv.on_client_done = [&](){
-        std::cout << "[srv] Transfer complete, shutting down.\n";
-        server_finished = true;
-        srv.stop();
-    };
+// Parses a --level value: 0 (store) to 9, or "auto".
+static bool parse_zip_level(const std::string &s, int &level){
+    if (s == "auto") {
+        level = ZIP_LEVEL_AUTO;
+        return true;
+    }
+    if (s.size() == 1 && s[0] >= '0' && s[0] <= '9') {
+        level = s[0] - '0';
+        return true;
+    }
+    return false;
+}
 
-    if(!srv.start()){
-        std::cerr << "Failed to start server\n";
+void run_senddir(const std::string &dir, int level){
+    auto plan = std::make_shared<ZipPlan>();
+    std::cout << "[*] Scanning directory: " << dir << "\n";
+    if (!plan->scan(dir, level)) {
+        std::cerr << "Failed to read directory: " << dir << "\n";
         return;
     }
 
-    std::string uri = srv.host_url();
-    std::cout << "Open this URL on the receiver device:\n";
-    print_qr_ascii(uri);
-    std::cout << "Waiting for client to download... Press Ctrl-C to cancel.\n";
+    if (plan->stored()) {
+        std::cout << "[*] Streaming " << plan->name() << " (" << plan->entry_count() << " entries, "
+                  << plan->size() << " bytes, stored)\n";
+    } else {
+        std::cout << "[*] Streaming " << plan->name() << " (" << plan->entry_count() << " entries, deflate)\n";
+    }
 
-    while(!server_finished && !interrupted)
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ServerOptions opt = server_options("send", dir);
+    opt.archive = plan;
+    opt.working_dir = dir;
+    serve_send(opt);
+}
 
-    if (interrupted) {
-        interrupted = false;
-        std::cout << "[srv] Cancelled by user.\n";
-        srv.stop();
+// Serves the files under `dir` individually, with a listing of each
+// directory, until cancelled.
+void run_share(const std::string &dir){
+    char dir_abs[PATH_MAX];
+    if (!realpath(dir.c_str(), dir_abs) || !fs::is_directory(dir_abs)) {
+        std::cerr << "Not a directory: " << dir << "\n";
         return;
     }
+
+    ServerOptions opt = server_options("share", dir_abs);
+    opt.working_dir = dir_abs;
+
+    SimpleHTTPServer srv(opt);
+    srv.on_log = [](const std::string &m){ std::cout << "[srv] " << m << "\n"; };
+    if(!srv.start()){ std::cerr << "Failed to start server\n"; return; }
+    std::string uri = srv.host_url() + "/";
+    std::cout << "Sharing " << dir_abs << ". Open this URL on the receiver device:\n";
+    print_qr_ascii(uri);
+    std::cout << "Press Ctrl-C to stop sharing.\n";
+    while(!interrupted)
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    interrupted = false;
+    std::cout << "[srv] Sharing stopped.\n";
+    srv.stop();
 }
 
 void run_get(const std::string &outfile){
-    ServerOptions opt;
-    opt.mode = "get";
-    opt.token = random_token(24);
-    opt.path = outfile;
-    opt.bind_address = get_default_bind_address();
-    opt.max_size = get_env_max_size_bytes();
-    opt.interrupted = &interrupted;
-    opt.socket_timeout_seconds = 60;
+    ServerOptions opt = server_options("get", outfile);
 
     char cwd[1024];
     if (getcwd(cwd, sizeof(cwd))) {
@@ -167,7 +275,10 @@ void run_get(const std::string &outfile){
     }
 }
 
-void run_zip(const std::string &target, const std::string &split_arg = ""){
+// Smallest volume size accepted by `zip <target> <split>`.
+static const long long MIN_SPLIT_SIZE = 64 * 1024;
+
+void run_zip(const std::string &target, const std::string &split_arg = "", int level = ZIP_LEVEL_AUTO){
     fs::path p(target);
     if (!fs::exists(p)) {
         std::cerr << "zip failed: target does not exist: " << target << "\n";
@@ -189,18 +300,34 @@ void run_zip(const std::string &target, const std::string &split_arg = ""){
     }
     std::string out = std::string(cwd) + "/" + basename + ".zip";
 
+    long long split = 0;
+    if (!split_arg.empty()) {
+        split = parse_size_local(split_arg);
+        if (split < MIN_SPLIT_SIZE) {
+            std::cerr << "zip failed: invalid split size: " << split_arg << " (minimum 64kb)\n";
+            return;
+        }
+    }
+
     int rc = 1;
     if (fs::is_regular_file(p)) {
-        rc = create_zip_from_file(target, out);
+        rc = create_zip_from_file(target, out, level, split);
     } else if (fs::is_directory(p)) {
-        rc = create_zip_from_dir(target, out);
+        rc = create_zip_from_dir(target, out, level, split);
     } else {
         std::cerr << "zip failed: target is not a regular file or directory: " << target << "\n";
         return;
     }
 
     if(rc != 0){
-        std::cerr << "zip failed (libarchive returned " << rc << ")\n";
+        std::cerr << "zip failed (error " << rc << ")\n";
+        return;
+    }
+    if (split > 0) {
+        std::vector<std::string> volumes = find_split_volumes(out + ".001");
+        std::cout << "[zip] Created archive in " << volumes.size() << " volumes:\n";
+        for (const auto &v : volumes) std::cout << "  " << v << "\n";
+        std::cout << "[zip] Send them with: send " << out << "\n";
         return;
     }
     std::cout << "[zip] Created archive: " << out << "\n";
@@ -208,10 +335,18 @@ void run_zip(const std::string &target, const std::string &split_arg = ""){
 
 void print_help(){
     std::cout << "\nAvailable commands:\n"
-              << "  send <file>              — Send file over Wi-Fi.\n"
-              << "  senddir <dir>            — Send entire folder (auto zipped).\n"
-              << "  get <output_file>        — Receive file from another device.\n"
-              << "  zip <target>             — Archive.\n"
+              << "  send <file>              — Send file over Wi-Fi (the volumes of a split\n"
+              << "                             zip one after another).\n"
+              << "  senddir [--level <0-9|auto>] <dir>\n"
+              << "                           — Send entire folder as a zip streamed on the fly\n"
+              << "                             (--store = --level 0: exact size, resumable).\n"
+              << "  share <dir>              — Share a folder: browse it and download single\n"
+              << "                             files, until Ctrl-C.\n"
+              << "  get [output_file|dir]    — Receive files from another device.\n"
+              << "  zip [--level <0-9|auto>] <target> [split_size<kb/mb/gb>]\n"
+              << "                           — Archive (default level: auto), optionally as\n"
+              << "                             volumes <name>.zip.001, .002, ... of split_size.\n"
+
               << "  help                     — Show this help message.\n"
               << "  exit                     — Quit program.\n"
               << std::endl;
@@ -235,6 +370,11 @@ void repl(){
             server_finished = false;
             interrupted = false;
         }
+        else if(line.rfind("share ", 0) == 0){
+            run_share(line.substr(6));
+            server_finished = false;
+            interrupted = false;
+        }
         else if(line == "get"){
             run_get("");
             server_finished = false;
@@ -249,48 +389,47 @@ void repl(){
 
         else if(line.rfind("zip ", 0) == 0){
             std::istringstream ss(line);
-            std::string cmd, target, size;
-            ss >> cmd >> target >> size;
-            if(target.empty()){
-                std::cout << "Usage: zip <target> [split_size<kb/mb/gb>]\n";
+            std::string cmd, word, target, size;
+            int level = ZIP_LEVEL_AUTO;
+            bool bad_level = false;
+            ss >> cmd;
+            while (ss >> word) {
+                if (word == "--level") {
+                    std::string v;
+                    ss >> v;
+                    bad_level = !parse_zip_level(v, level);
+                } else if (word == "--store") {
+                    level = 0;
+                } else if (target.empty()) {
+                    target = word;
+                } else {
+                    size = word;
+                }
+            }
+            if(target.empty() || bad_level){
+                std::cout << "Usage: zip [--level <0-9|auto>] <target> [split_size<kb/mb/gb>]\n";
                 continue;
             }
-            run_zip(target, size);
+            run_zip(target, size, level);
             interrupted = false;
         }
         else if(line.rfind("senddir ", 0) == 0){
             std::string d = line.substr(8);
-            char cwd[1024];
-            if (!getcwd(cwd, sizeof(cwd))) {
-                std::cerr << "senddir failed: cannot get current working directory\n";
-                continue;
+            int level = ZIP_LEVEL_AUTO;
+            bool bad_level = false;
+            if (d.rfind("--store ", 0) == 0) {
+                level = 0;
+                d = d.substr(8);
+            } else if (d.rfind("--level ", 0) == 0) {
+                size_t end = d.find(' ', 8);
+                bad_level = end == std::string::npos || !parse_zip_level(d.substr(8, end - 8), level);
+                d = end == std::string::npos ? "" : d.substr(end + 1);
             }
-
-            fs::path p(d);
-            std::string basename = p.filename().string();
-            if (basename.empty()) {
-                basename = p.parent_path().filename().string();
-                if (basename.empty()) {
-                    basename = "archive";
-                }
-            }
-            std::string temp_zip = std::string(cwd) + "/" + basename + ".zip";
-            std::cout << "[*] Archiving directory: " << d << " to " << temp_zip << "\n";
-
-            if (create_zip_from_dir(d, temp_zip) != 0) {
-                std::cerr << "Failed to create zip for directory: " << d << "\n";
-            } else {
-                std::string original_cwd = cwd;
-                run_send(temp_zip);
-                if (chdir(original_cwd.c_str()) != 0) {
-                    std::cerr << "Warning: could not return to original directory\n";
-                }
-                if (std::remove(temp_zip.c_str()) == 0) {
-                    std::cout << "[*] Temporary archive removed: " << temp_zip << "\n";
-                } else {
-                    std::cerr << "Warning: could not remove temporary archive: " << temp_zip << "\n";
-                }
+            if (d.empty() || bad_level) {
+                std::cout << "Usage: senddir [--store | --level <0-9|auto>] <dir>\n";
+                continue;
             }
+            run_senddir(d, level);
 
             server_finished = false;
             interrupted = false;
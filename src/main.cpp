@@ -5,6 +5,7 @@
 #include <csignal>
 #include "utils/utils.h"
 #include "utils/network_utils.h"
+#include "utils/archive_utils.h"
 #include "cli/cli.h"
 
 static const std::string VERSION = "2.0";
@@ -29,6 +30,17 @@ void print_global_help() {
     "  --help                  Show this help message and exit\n"
     "  --version               Show program version and exit\n"
     "  --tls <cert> <key>      Enable TLS (HTTPS) using the provided certificate and private key files\n"
+    "  --event-loop <threads>  Serve clients from <threads> epoll event-loop threads instead of one thread per connection\n"
+    "  --io-engine <engine>    File I/O engine: sync (default), uring, or auto (io_uring when the kernel supports it)\n"
+    "  --keep-alive <seconds>  Idle timeout for persistent HTTP connections (default 5, 0 closes after each response)\n"
+    "  --max-requests <n>      Maximum requests served over one persistent connection (default 100)\n"
+    "  --zip-threads <n>       Threads used to compress archives (default: one per CPU core)\n"
+    "  --sync <policy>         When uploads are flushed to disk: none (default), end (fdatasync before the file\n"
+    "                          appears), or periodic (steady writeback during the upload, then as end)\n"
+    "  --no-compress           Never gzip/brotli-compress downloads, even for clients that accept it\n"
+    "  --rate-limit <rate>     Limit all transfers together to <rate> bytes per second (e.g., 10MB)\n"
+    "  --conn-rate-limit <rate>\n"
+    "                          Limit each connection to <rate> bytes per second (e.g., 1MB)\n"
     << std::endl;
 }
 
@@ -45,6 +57,16 @@ int main(int argc, char **argv) {
     std::string tls_key_arg;
     bool tls_enabled_arg = false;
 
+    int event_loop_threads = 0;
+    std::string io_engine = "sync";
+    int keep_alive_timeout = 5;
+    int keep_alive_max_requests = 100;
+    int zip_threads = 0;
+    std::string sync_mode = "none";
+    bool compress = true;
+    long long rate_limit = 0;
+    long long conn_rate_limit = 0;
+
     if (argc > 1) {
         std::vector<std::string> args(argv + 1, argv + argc);
 
@@ -99,6 +121,129 @@ int main(int argc, char **argv) {
                 tls_enabled_arg = true;
                 vlog("TLS enabled with cert: " + tls_cert_arg + " key: " + tls_key_arg);
             }
+            else if (a == "--event-loop") {
+                if (i + 1 >= args.size()) {
+                    elog("--event-loop requires a thread count (e.g., 2)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                std::string s = args[++i];
+                int v = 0;
+                try {
+                    v = std::stoi(s);
+                } catch (...) {
+                    v = -1;
+                }
+                if (v < 0) {
+                    elog("Invalid --event-loop value: " + s);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                event_loop_threads = v;
+                vlog("Event loop threads set to " + std::to_string(event_loop_threads));
+            }
+            else if (a == "--io-engine") {
+                if (i + 1 >= args.size()) {
+                    elog("--io-engine requires an argument (sync, uring or auto)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                io_engine = args[++i];
+                if (io_engine != "sync" && io_engine != "uring" && io_engine != "auto") {
+                    elog("Invalid --io-engine value: " + io_engine);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                vlog("I/O engine set to " + io_engine);
+            }
+            else if (a == "--keep-alive") {
+                if (i + 1 >= args.size()) {
+                    elog("--keep-alive requires a timeout in seconds (e.g., 5)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                std::string s = args[++i];
+                int v = 0;
+                try {
+                    v = std::stoi(s);
+                } catch (...) {
+                    v = -1;
+                }
+                if (v < 0) {
+                    elog("Invalid --keep-alive value: " + s);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                keep_alive_timeout = v;
+                vlog("Keep-alive timeout set to " + std::to_string(keep_alive_timeout) + "s");
+            }
+            else if (a == "--max-requests") {
+                if (i + 1 >= args.size()) {
+                    elog("--max-requests requires a number (e.g., 100)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                std::string s = args[++i];
+                int v = 0;
+                try {
+                    v = std::stoi(s);
+                } catch (...) {
+                    v = 0;
+                }
+                if (v <= 0) {
+                    elog("Invalid --max-requests value: " + s);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                keep_alive_max_requests = v;
+                vlog("Max requests per connection set to " + std::to_string(keep_alive_max_requests));
+            }
+            else if (a == "--zip-threads") {
+                if (i + 1 >= args.size()) {
+                    elog("--zip-threads requires a thread count (e.g., 8)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                std::string s = args[++i];
+                int v = 0;
+                try {
+                    v = std::stoi(s);
+                } catch (...) {
+                    v = 0;
+                }
+                if (v <= 0) {
+                    elog("Invalid --zip-threads value: " + s);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                zip_threads = v;
+                vlog("Archive compression threads set to " + std::to_string(zip_threads));
+            }
+            else if (a == "--sync") {
+                if (i + 1 >= args.size()) {
+                    elog("--sync requires a policy (none, end or periodic)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                sync_mode = args[++i];
+                if (sync_mode != "none" && sync_mode != "end" && sync_mode != "periodic") {
+                    elog("Invalid --sync value: " + sync_mode);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                vlog("Upload sync policy set to " + sync_mode);
+            }
+            else if (a == "--no-compress") {
+                compress = false;
+                vlog("Download compression disabled");
+            }
+            else if (a == "--rate-limit" || a == "--conn-rate-limit") {
+                if (i + 1 >= args.size()) {
+                    elog(a + " requires a rate in bytes per second (e.g., 10MB)");
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                std::string s = args[++i];
+                long long v = parse_size(s);
+                if (v <= 0) {
+                    elog("Invalid " + a + " value: " + s);
+                    return EXIT_INVALID_ARGUMENT;
+                }
+                if (a == "--rate-limit") {
+                    rate_limit = v;
+                    vlog("Total bandwidth limited to " + std::to_string(v) + " bytes/s");
+                } else {
+                    conn_rate_limit = v;
+                    vlog("Per-connection bandwidth limited to " + std::to_string(v) + " bytes/s");
+                }
+            }
             else if (a.rfind("--", 0) == 0) {
                 elog("Unknown option: " + a);
                 std::cerr << "Use --help for usage information." << std::endl;
@@ -117,6 +262,13 @@ int main(int argc, char **argv) {
     }
 
     set_default_bind_address(bind_address);
+    set_event_loop_threads(event_loop_threads);
+    set_io_engine(io_engine);
+    set_keep_alive(keep_alive_timeout, keep_alive_max_requests);
+    set_archive_threads(zip_threads);
+    set_sync_mode(sync_mode);
+    set_compression(compress);
+    set_rate_limit(rate_limit, conn_rate_limit);
 
     if (tls_enabled_arg) {
         set_tls_enabled(true);
@@ -0,0 +1,85 @@
+#include "boundary_scanner.h"
+#include <cstring>
+#include <algorithm>
+
+BoundaryScanner::BoundaryScanner(const std::string& delimiter) : delim_(delimiter) {
+    size_t m = delim_.size();
+    for (size_t& s : skip_) s = m;
+    for (size_t i = 0; i + 1 < m; ++i) skip_[(unsigned char)delim_[i]] = m - 1 - i;
+}
+
+void BoundaryScanner::reset() {
+    carry_.clear();
+    found_ = false;
+}
+
+size_t BoundaryScanner::find(const char* data, size_t len) const {
+    size_t m = delim_.size();
+    if (m == 0 || len < m) return len;
+
+    const char last = delim_[m - 1];
+    const char* end = data + len;
+    const char* p = data + m - 1;
+    while (p < end) {
+        p = (const char*)memchr(p, last, end - p);
+        if (!p) break;
+        const char* start = p - (m - 1);
+        if (memcmp(start, delim_.data(), m - 1) == 0) return start - data;
+        p += skip_[(unsigned char)last];
+    }
+    return len;
+}
+
+size_t BoundaryScanner::partial_suffix(const char* data, size_t len) const {
+    size_t k = std::min(len, delim_.size() - 1);
+    for (; k > 0; --k) {
+        if (data[len - k] == delim_[0] && memcmp(data + len - k, delim_.data(), k) == 0) break;
+    }
+    return k;
+}
+
+size_t BoundaryScanner::feed(const char* data, size_t len, const Output& out) {
+    if (found_) return 0;
+    size_t m = delim_.size();
+
+    if (!carry_.empty()) {
+        // A delimiter that starts in the held-back bytes ends within the next
+        // m - 1 bytes, so only that much of the chunk has to be joined to it.
+        size_t held = carry_.size();
+        size_t take = std::min(len, m - 1);
+        carry_.append(data, take);
+
+        size_t pos = find(carry_.data(), carry_.size());
+        if (pos < held) {
+            if (pos > 0) out(carry_.data(), pos);
+            carry_.clear();
+            found_ = true;
+            return pos + m - held;
+        }
+        if (take == len) {
+            size_t keep = partial_suffix(carry_.data(), carry_.size());
+            if (carry_.size() > keep) out(carry_.data(), carry_.size() - keep);
+            carry_.erase(0, carry_.size() - keep);
+            return len;
+        }
+        out(carry_.data(), held);
+        carry_.clear();
+    }
+
+    size_t pos = find(data, len);
+    if (pos < len) {
+        if (pos > 0) out(data, pos);
+        found_ = true;
+        return pos + m;
+    }
+
+    size_t keep = partial_suffix(data, len);
+    if (len > keep) out(data, len - keep);
+    carry_.assign(data + len - keep, keep);
+    return len;
+}
+
+void BoundaryScanner::flush(const Output& out) {
+    if (!carry_.empty()) out(carry_.data(), carry_.size());
+    carry_.clear();
+}
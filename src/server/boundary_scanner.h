@@ -0,0 +1,43 @@
+#ifndef BOUNDARY_SCANNER_H
+#define BOUNDARY_SCANNER_H
+
+#include <string>
+#include <functional>
+#include <cstddef>
+
+// Streaming search for a multipart delimiter in a body that arrives in
+// chunks. Data in front of the delimiter is handed out straight from the
+// caller's buffer; only a possible partial delimiter at the end of a chunk
+// (shorter than the delimiter) is held back until the next one.
+class BoundaryScanner {
+public:
+    using Output = std::function<void(const char* data, size_t len)>;
+
+    explicit BoundaryScanner(const std::string& delimiter);
+
+    // Passes the bytes of `data` that precede the delimiter to `out`.
+    // Returns how many bytes of `data` were used: `len` while the delimiter
+    // has not been seen, otherwise the count up to and including it.
+    size_t feed(const char* data, size_t len, const Output& out);
+
+    // Flushes a held-back partial match (the body ended without a delimiter).
+    void flush(const Output& out);
+
+    bool found() const { return found_; }
+    // Looks for the next delimiter.
+    void reset();
+
+    // Horspool search with a memchr prefilter on the delimiter's last byte.
+    // Returns the offset of the first full match, or `len`.
+    size_t find(const char* data, size_t len) const;
+
+private:
+    std::string delim_;
+    size_t skip_[256];
+    std::string carry_;
+    bool found_ = false;
+
+    size_t partial_suffix(const char* data, size_t len) const;
+};
+
+#endif
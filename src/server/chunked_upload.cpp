@@ -0,0 +1,179 @@
+#include "chunked_upload.h"
+#include "file_transfer.h"
+#include "../utils/utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+const long long UPLOAD_CHUNK_SIZE = 8 * 1024 * 1024;
+
+ChunkedUpload::ChunkedUpload(const std::string& path, long long size)
+    : path_(path), size_(size),
+      have_((size_t)((size + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE), 0) {}
+
+bool ChunkedUpload::open(SyncMode sync, bool replace, bool& out_of_space) {
+    out_of_space = false;
+    if (!sink_.open(path_, false, sync, replace)) {
+        vlog("Failed to create file " + path_ + ": " + strerror(errno));
+        return false;
+    }
+    if (!sink_.reserve(size_)) {
+        vlog("Not enough disk space for " + path_ + " (" + format_size(size_) + "): " + strerror(errno));
+        out_of_space = true;
+        sink_.discard();
+        return false;
+    }
+    vlog("Receiving " + path_ + " in " + std::to_string(have_.size()) + " chunks");
+    return true;
+}
+
+long long ChunkedUpload::chunk_length(size_t i) const {
+    return std::min(UPLOAD_CHUNK_SIZE, size_ - (long long)i * UPLOAD_CHUNK_SIZE);
+}
+
+bool ChunkedUpload::accepts(long long offset) {
+    if (offset < 0 || offset >= size_) return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t i = (size_t)(offset / UPLOAD_CHUNK_SIZE);
+    return offset % UPLOAD_CHUNK_SIZE <= have_[i];
+}
+
+long long ChunkedUpload::offset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    long long off = 0;
+    for (size_t i = 0; i < have_.size(); ++i) {
+        off += have_[i];
+        if (have_[i] < chunk_length(i)) break;
+    }
+    return off;
+}
+
+// Counts [offset, offset + len) as received where it extends what each
+// chunk already has. Bytes past a gap are written but not counted; they
+// will be sent again.
+void ChunkedUpload::record(long long offset, long long len) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (len > 0) {
+        size_t i = (size_t)(offset / UPLOAD_CHUNK_SIZE);
+        long long pos = offset % UPLOAD_CHUNK_SIZE;
+        long long n = std::min(len, chunk_length(i) - pos);
+        last_active_ = std::chrono::steady_clock::now();
+        if (pos <= have_[i] && pos + n > have_[i]) {
+            have_[i] = pos + n;
+            if (have_[i] == chunk_length(i)) {
+                ++done_count_;
+                vlog("Chunk " + std::to_string(i + 1) + "/" + std::to_string(have_.size()) + " of " + path_ +
+                     " received (" + std::to_string(done_count_) + " done)");
+            }
+        }
+        offset += n;
+        len -= n;
+    }
+}
+
+bool ChunkedUpload::write_at(off_t offset, const char* data, size_t len) {
+    std::shared_lock<std::shared_mutex> lock(io_mutex_);
+    if (closed_ || !sink_.write_at(offset, data, len)) return false;
+    record(offset, (long long)len);
+    return true;
+}
+
+bool ChunkedUpload::splice_at(int pipe_fd, off_t offset, size_t len) {
+    std::shared_lock<std::shared_mutex> lock(io_mutex_);
+    if (closed_ || !sink_.splice_at(pipe_fd, offset, len)) return false;
+    record(offset, (long long)len);
+    return true;
+}
+
+bool ChunkedUpload::take_complete() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (taken_ || done_count_ < have_.size()) return false;
+    taken_ = true;
+    return true;
+}
+
+bool ChunkedUpload::commit() {
+    std::unique_lock<std::shared_mutex> lock(io_mutex_);
+    closed_ = true;
+    bool ok = sink_.commit();
+    path_ = sink_.path();
+    return ok;
+}
+
+void ChunkedUpload::discard() {
+    std::unique_lock<std::shared_mutex> lock(io_mutex_);
+    closed_ = true;
+    sink_.discard();
+}
+
+std::chrono::steady_clock::time_point ChunkedUpload::last_active() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_active_;
+}
+
+std::shared_ptr<ChunkedUpload> UploadRegistry::find_or_create(const std::string& id, long long size,
+                                                              const Factory& create, Status& status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    expire_locked();
+    auto it = uploads_.find(id);
+    if (it != uploads_.end()) {
+        status = it->second->size() == size ? Status::Ok : Status::Conflict;
+        return status == Status::Ok ? it->second : nullptr;
+    }
+
+    // Checked before create() reserves the space.
+    if (max_size_ > 0 && size > max_size_) {
+        status = Status::TooLarge;
+        return nullptr;
+    }
+    if (uploads_.size() >= MAX_UPLOADS) {
+        status = Status::TooMany;
+        return nullptr;
+    }
+    auto upload = create();
+    status = upload ? Status::Ok : Status::Failed;
+    if (upload) uploads_[id] = upload;
+    return upload;
+}
+
+std::shared_ptr<ChunkedUpload> UploadRegistry::find(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    expire_locked();
+    auto it = uploads_.find(id);
+    return it == uploads_.end() ? nullptr : it->second;
+}
+
+void UploadRegistry::remove(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploads_.erase(id);
+}
+
+void UploadRegistry::expire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    expire_locked();
+}
+
+// An upload still held by a connection is in use however long it waits for
+// data; the connection's own timeout ends that.
+void UploadRegistry::expire_locked() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = uploads_.begin(); it != uploads_.end();) {
+        const auto& upload = it->second;
+        if (upload.use_count() == 1 && now - upload->last_active() > std::chrono::seconds(IDLE_TIMEOUT_SECONDS)) {
+            vlog("Upload " + it->first + " of " + upload->path() + " expired after " +
+                 std::to_string(IDLE_TIMEOUT_SECONDS) + " s without data");
+            upload->discard();
+            it = uploads_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool valid_upload_id(const std::string& id) {
+    if (id.empty() || id.size() > 64) return false;
+    for (char c : id) {
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_') return false;
+    }
+    return true;
+}
@@ -0,0 +1,116 @@
+#ifndef CHUNKED_UPLOAD_H
+#define CHUNKED_UPLOAD_H
+
+#include "file_io.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <chrono>
+#include <sys/types.h>
+
+// Size of every chunk of a chunked upload but the last.
+extern const long long UPLOAD_CHUNK_SIZE;
+
+// A file sent in pieces, possibly over several connections at once, and
+// resumable after any of them breaks. Each request body covers a byte range
+// of the file and is written at its offset into one preallocated file. For
+// every chunk [i * UPLOAD_CHUNK_SIZE, (i + 1) * UPLOAD_CHUNK_SIZE) the bytes
+// received from its start are counted, so a body may start anywhere up to
+// that point; the file is published once every chunk is complete.
+class ChunkedUpload {
+public:
+    ChunkedUpload(const std::string& path, long long size);
+
+    ChunkedUpload(const ChunkedUpload&) = delete;
+    ChunkedUpload& operator=(const ChunkedUpload&) = delete;
+
+    // Creates the file and reserves its space; `out_of_space` is set when it
+    // does not fit. An existing file at the path is only replaced with
+    // `replace`.
+    bool open(SyncMode sync, bool replace, bool& out_of_space);
+
+    // After commit(), the name the file was published under.
+    const std::string& path() const { return path_; }
+    long long size() const { return size_; }
+
+    // Whether a body starting at `offset` continues what has been received.
+    bool accepts(long long offset);
+    // End of the data received without gaps from the start of the file.
+    long long offset();
+
+    // Body data; callable from any number of connections at once.
+    bool write_at(off_t offset, const char* data, size_t len);
+    bool splice_at(int pipe_fd, off_t offset, size_t len);
+
+    // True, once, when every chunk is complete; the caller must then
+    // commit() the file.
+    bool take_complete();
+    bool commit();
+    // Drops the file, temporary name and all.
+    void discard();
+    // When body data last arrived, or the upload was created.
+    std::chrono::steady_clock::time_point last_active();
+
+private:
+    std::string path_;
+    long long size_;
+
+    // Shared by writes, exclusive for closing the file.
+    std::shared_mutex io_mutex_;
+    FileSink sink_;
+    bool closed_ = false;
+
+    std::mutex mutex_;
+    std::vector<long long> have_;  // per chunk, bytes received from its start
+    size_t done_count_ = 0;
+    bool taken_ = false;
+    std::chrono::steady_clock::time_point last_active_ = std::chrono::steady_clock::now();
+
+    long long chunk_length(size_t i) const;
+    void record(long long offset, long long len);
+};
+
+// Chunked uploads in progress, by client-chosen upload id. Shared by every
+// connection of a server. Each one holds disk space for its whole file, so
+// at most MAX_UPLOADS run at once, none larger than the server's max size,
+// and one that no connection has touched for IDLE_TIMEOUT_SECONDS is
+// dropped together with its file.
+class UploadRegistry {
+public:
+    using Factory = std::function<std::shared_ptr<ChunkedUpload>()>;
+
+    static constexpr size_t MAX_UPLOADS = 16;
+    static constexpr int IDLE_TIMEOUT_SECONDS = 10 * 60;
+
+    enum class Status { Ok, Conflict, TooLarge, TooMany, Failed };
+
+    // `max_size` of 0 leaves the size of an upload unlimited.
+    explicit UploadRegistry(long long max_size = 0) : max_size_(max_size) {}
+
+    // The upload `id`, made with `create` if it is not known yet. Null, with
+    // `status` saying why, when `id` is in use for a file of another size,
+    // `size` is over the max size, MAX_UPLOADS are in progress or `create`
+    // fails.
+    std::shared_ptr<ChunkedUpload> find_or_create(const std::string& id, long long size, const Factory& create,
+                                                  Status& status);
+    std::shared_ptr<ChunkedUpload> find(const std::string& id);
+    void remove(const std::string& id);
+    // Drops the uploads that have been idle too long.
+    void expire();
+
+private:
+    long long max_size_;
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<ChunkedUpload>> uploads_;
+
+    void expire_locked();
+};
+
+// Upload ids are 1-64 characters of [A-Za-z0-9_-].
+bool valid_upload_id(const std::string& id);
+
+#endif
@@ -4,269 +4,694 @@
 #include "../utils/utils.h"
 #include "../utils/file_utils.h"
 #include "../utils/server_utils.h"
+#include "../utils/zip_stream.h"
+#include "../utils/digest_utils.h"
 #include <sstream>
+#include <algorithm>
 #include <poll.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <cstring>
+#include <strings.h>
+#include <filesystem>
+#include <thread>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+namespace fs = std::filesystem;
+
 ClientHandler::ClientHandler(const ServerOptions& opts, int fd, SSL* ssl)
     : opts_(opts), fd_(fd)
 {
     ssl_ = ssl;
+    client_ip_ = get_client_ip(fd_);
+    state_start_ = std::chrono::steady_clock::now();
+    if (ssl_) state_ = State::Handshake;
+    if (opts_.conn_rate_limit > 0) {
+        conn_bucket_ = std::make_shared<TokenBucket>(opts_.conn_rate_limit, rate_burst(opts_.conn_rate_limit));
+    }
 }
 
-bool ClientHandler::read_headers(std::string& headers) {
-    char chunk[4096];
-    ssize_t r;
-    bool headers_complete = false;
+ClientHandler::~ClientHandler() {
+    close_connection();
+}
 
-    struct pollfd client_fd;
-    client_fd.fd = fd_;
-    client_fd.events = POLLIN;
-    
-    auto start_time = std::chrono::steady_clock::now();
-    
-    while (true) {
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - start_time);
-        if (elapsed.count() > opts_.socket_timeout_seconds) {
-            if (on_log) on_log("Header read timeout from " + get_client_ip(fd_));
-            return false;
-        }
-        
-        if (opts_.interrupted && *opts_.interrupted) {
-            return false;
-        }
-        
-        int poll_res = poll(&client_fd, 1, 100);
-        if (poll_res < 0) {
-            if (errno == EINTR) continue;
-            return false;
-        }
-        if (poll_res == 0) continue;
-        
-        if (ssl_) {
-            int rr = SSL_read(ssl_, chunk, sizeof(chunk));
-            if (rr > 0) {
-                headers.append(chunk, rr);
-                if (headers.find("\r\n\r\n") != std::string::npos) {
+void ClientHandler::close_connection() {
+    if (fd_ < 0) return;
+
+    sender_.reset();
+    receiver_.reset();
+    if (ssl_) {
+        SSL_shutdown(ssl_);
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+    }
+    close(fd_);
+    fd_ = -1;
+    state_ = State::Closed;
+    if (on_log) on_log("Client connection closed: " + client_ip_);
+}
+
+bool ClientHandler::timed_out(std::chrono::steady_clock::time_point now) {
+    bool expired = false;
+    switch (state_) {
+        case State::SendFile:
+            expired = sender_ && sender_->stalled(now, opts_.socket_timeout_seconds);
+            break;
+        case State::SendContinue:
+        case State::ReceiveBody:
+            expired = receiver_ && receiver_->stalled(now, opts_.socket_timeout_seconds);
+            break;
+        case State::Handshake:
+        case State::ReadHeaders:
+        case State::SendResponse: {
+            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - state_start_);
+            if (state_ == State::ReadHeaders && requests_served_ > 0 && pending().empty()) {
+                if (elapsed.count() >= opts_.keep_alive_timeout_seconds) {
+                    vlog("Keep-alive idle timeout for " + client_ip_);
                     return true;
                 }
-                continue;
-            } else {
-                int err = SSL_get_error(ssl_, rr);
-                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                    continue;
-                }
                 return false;
             }
+            expired = elapsed.count() > opts_.socket_timeout_seconds;
+            break;
         }
+        case State::Closed:
+            break;
+    }
 
-        r = recv(fd_, chunk, sizeof(chunk), 0);
-        if (r > 0) {
-            headers.append(chunk, r);
-            if (headers.find("\r\n\r\n") != std::string::npos) {
-                return true;
+    if (expired && on_log) on_log("Connection timeout from " + client_ip_);
+    return expired;
+}
+
+IoStatus ClientHandler::handshake() {
+    int r = SSL_accept(ssl_);
+    if (r == 1) return IoStatus::Done;
+
+    int err = SSL_get_error(ssl_, r);
+    if (err == SSL_ERROR_WANT_READ) return IoStatus::WantRead;
+    if (err == SSL_ERROR_WANT_WRITE) return IoStatus::WantWrite;
+    ERR_clear_error();
+    return IoStatus::Error;
+}
+
+IoStatus ClientHandler::read_headers() {
+    char chunk[4096];
+
+    while (request_.feed(pending()) == RequestParser::Status::Incomplete) {
+        IoStatus st;
+        ssize_t r = sock_read(fd_, ssl_, chunk, sizeof(chunk), st);
+        if (r == 0) return IoStatus::Error;
+        if (r < 0) return st;
+        // The requests served so far are dropped before the buffer grows.
+        if (in_off_ > 0) {
+            in_buf_.erase(0, in_off_);
+            in_off_ = 0;
+        }
+        in_buf_.append(chunk, r);
+    }
+    return IoStatus::Done;
+}
+
+IoStatus ClientHandler::flush_response() {
+    // A page goes out as its prebuilt head, the connection headers in
+    // out_buf_, then the rest of the page; out_sent_ counts across all three.
+    while (true) {
+        struct iovec iov[3];
+        int n = 0;
+        size_t skip = out_sent_;
+        auto add = [&](const char* data, size_t len) {
+            if (skip >= len) {
+                skip -= len;
+                return;
             }
-        } else if (r == 0) {
-            return false;
+            iov[n].iov_base = const_cast<char*>(data + skip);
+            iov[n].iov_len = len - skip;
+            skip = 0;
+            ++n;
+        };
+        if (page_) {
+            add(page_->data.data(), page_->head_size);
+            add(out_buf_.data(), out_buf_.size());
+            add(page_->data.data() + page_->head_size, page_->data.size() - page_->head_size);
         } else {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                return false;
-            }
+            add(out_buf_.data(), out_buf_.size());
         }
+        if (n == 0) break;
+
+        IoStatus st;
+        ssize_t w = sock_writev(fd_, ssl_, iov, n, st);
+        if (w < 0) return st;
+        out_sent_ += w;
     }
+    page_.reset();
+    out_buf_.clear();
+    out_sent_ = 0;
+    return IoStatus::Done;
+}
+
+// Whether a comma-separated header value lists `token` (case-insensitive).
+static bool has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (item.size() == token.size() && strncasecmp(item.data(), token.data(), token.size()) == 0) return true;
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+bool ClientHandler::wants_keep_alive() const {
+    std::string_view method = request_.method();
+    if (opts_.keep_alive_timeout_seconds <= 0) return false;
+    if (requests_served_ >= opts_.keep_alive_max_requests) return false;
+    // Bodiless requests, and the bodies of a chunked upload, which a client
+    // sends one after another and resumes with HEAD. Other uploads are the
+    // last request of the session.
+    bool chunk = method == "PUT" && request_.content_length() >= 0 && !header("Upload-Id").empty();
+    if (!chunk && ((method != "GET" && method != "HEAD") || request_.content_length() > 0)) return false;
+
+    std::string_view conn = header("Connection");
+    if (request_.version() == "HTTP/1.1") return !has_token(conn, "close");
+    return has_token(conn, "keep-alive");
+}
+
+std::string ClientHandler::keep_alive_params() const {
+    return "timeout=" + std::to_string(opts_.keep_alive_timeout_seconds) +
+           ", max=" + std::to_string(opts_.keep_alive_max_requests - requests_served_);
+}
+
+void ClientHandler::add_connection_headers(FileSender& sender) const {
+    sender.add_header("Connection", keep_alive_ ? "keep-alive" : "close");
+    if (keep_alive_) sender.add_header("Keep-Alive", keep_alive_params());
+}
+
+// Compresses the response when the client accepts a coding and the file is
+// worth it. A body compressed on the fly has no length up front, so the
+// connection then ends with it.
+void ClientHandler::select_coding(FileSender& sender, const CachedFile& file) {
+    if (!opts_.compress || !file.compressible) return;
+    sender.add_header("Vary", "Accept-Encoding");
+    if (!sender.set_coding(negotiate_coding(header("Accept-Encoding")))) keep_alive_ = false;
+}
+
+std::string ClientHandler::connection_headers() const {
+    return keep_alive_ ? "Connection: keep-alive\r\nKeep-Alive: " + keep_alive_params() + "\r\n"
+                       : "Connection: close\r\n";
 }
 
 void ClientHandler::send_response(const std::string& response) {
-    ssize_t sent = 0;
-    auto start_time = std::chrono::steady_clock::now();
-    
-    while (sent < (ssize_t)response.size()) {
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - start_time);
-        if (elapsed.count() > opts_.socket_timeout_seconds) {
-            break;
-        }
-        
-        if (opts_.interrupted && *opts_.interrupted) {
-            break;
-        }
-        
-        if (ssl_) {
-            int r = SSL_write(ssl_, response.c_str() + sent, response.size() - sent);
-            if (r > 0) {
-                sent += r;
-                continue;
-            } else {
-                int err = SSL_get_error(ssl_, r);
-                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                    usleep(10000);
-                    continue;
-                }
-                break;
-            }
-        }
+    // Unread body bytes would be taken for the next request.
+    if (!body_read_) keep_alive_ = false;
+    size_t header_end = response.find("\r\n\r\n");
+    if (header_end == std::string::npos) {
+        out_buf_ += response;
+    } else {
+        out_buf_.append(response, 0, header_end + 2);
+        out_buf_ += connection_headers();
+        out_buf_.append(response, header_end + 2, std::string::npos);
+    }
+    state_ = State::SendResponse;
+    state_start_ = std::chrono::steady_clock::now();
+}
 
-        ssize_t result = send(fd_, response.c_str() + sent, response.size() - sent, MSG_NOSIGNAL);
-        if (result > 0) {
-            sent += result;
-        } else if (result == 0) {
-            break;
-        } else {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(10000);
-                continue;
-            }
-            break;
-        }
+// Pages come prebuilt from the share's PageCache; only the connection
+// headers are added, and flush_response() sends all of it in one writev.
+void ClientHandler::send_page(const std::string& key, const std::function<std::string()>& build) {
+    auto page = opts_.pages->get(key, opts_.started, build);
+    if (not_modified(std::string(header("If-None-Match")), std::string(header("If-Modified-Since")),
+                     page->etag, page->last_modified)) {
+        send_response("HTTP/1.1 304 Not Modified\r\nETag: " + page->etag + "\r\nLast-Modified: " +
+                      http_date(page->last_modified) + "\r\nCache-Control: no-cache\r\n\r\n");
+        return;
     }
+    page_ = std::move(page);
+    out_buf_ = connection_headers();
+    out_sent_ = 0;
+    state_ = State::SendResponse;
+    state_start_ = std::chrono::steady_clock::now();
 }
 
 void ClientHandler::send_error(int code, const std::string& message) {
     std::ostringstream resp;
-    resp << "HTTP/1.1 " << code << " " << (code == 404 ? "Not Found" : 
+    resp << "HTTP/1.1 " << code << " " << (code == 400 ? "Bad Request" :
+                                           code == 404 ? "Not Found" : 
                                            code == 405 ? "Method Not Allowed" :
-                                           code == 413 ? "Payload Too Large" : "Error")
+                                           code == 409 ? "Conflict" :
+                                           code == 411 ? "Length Required" :
+                                           code == 413 ? "Payload Too Large" :
+                                           code == 431 ? "Request Header Fields Too Large" :
+                                           code == 500 ? "Internal Server Error" :
+                                           code == 503 ? "Service Unavailable" :
+                                           code == 507 ? "Insufficient Storage" : "Error")
          << "\r\nContent-Length: " << message.size() << "\r\n\r\n" << message;
     send_response(resp.str());
 }
 
-void ClientHandler::handle_get_request(const std::string& path, const std::string& headers) {
+// Small text files are shown on the download page, fetched from /raw.
+static bool can_preview_file(const CachedFile& file) {
+    return file.mime.rfind("text/", 0) == 0 && file.st.st_size <= 1024 * 1024;
+}
+
+void ClientHandler::handle_get_request(const std::string& path) {
+    if (opts_.mode == "share") {
+        handle_share_request(path);
+        return;
+    }
     if (path == "/" + opts_.token) {
         if (opts_.mode == "get") {
-            if (on_log) on_log("Serving upload page to " + get_client_ip(fd_));
-            auto html = html_upload_page(opts_.token);
-            std::ostringstream resp;
-            resp << "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: "
-                 << html.size() << "\r\n\r\n" << html;
-            send_response(resp.str());
+            if (on_log) on_log("Serving upload page to " + client_ip_);
+            send_page("upload", [this]() { return html_upload_page(opts_.token); });
         } else {
-            if (on_log) on_log("Serving download page to " + get_client_ip(fd_));
-            bool can_preview = false;
-            struct stat file_stat;
-            if (stat(opts_.path.c_str(), &file_stat) == 0) {
-                can_preview = (mime_type(opts_.path).rfind("text/", 0) == 0) &&
-                             (file_stat.st_size <= 1024 * 1024);
-            }
+            if (on_log) on_log("Serving download page to " + client_ip_);
+            auto file = opts_.archive ? nullptr : opts_.files->get(opts_.path);
+            bool can_preview = file && can_preview_file(*file);
 
-            auto html = html_download_page(opts_.token, file_basename(opts_.path), can_preview);
-            std::ostringstream resp;
-            resp << "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: "
-                 << html.size() << "\r\n\r\n" << html;
-            send_response(resp.str());
+            std::string filename = opts_.archive ? opts_.archive->name() : file_basename(opts_.path);
+            send_page(can_preview ? "download-preview" : "download",
+                      [&]() { return html_download_page(opts_.token, filename, can_preview); });
         }
     } else if (path == "/" + opts_.token + "/file" && opts_.mode == "send") {
-        if (on_log) on_log("Starting file download to " + get_client_ip(fd_));
+        if (on_log) on_log("Starting file download to " + client_ip_);
         
-        if (!file_exists(opts_.path)) {
+        std::shared_ptr<const CachedFile> file;
+        if (opts_.archive ? !file_exists(opts_.path) : !(file = opts_.files->get(opts_.path))) {
             if (on_log) on_log("File not found: " + opts_.path);
             send_error(404, "404 File Not Found");
             return;
         }
         
-        std::string filename = file_basename(opts_.path);
-        bool success = stream_file(fd_, opts_.path, mime_type(opts_.path), filename, true, 
-                                 opts_.interrupted, opts_.socket_timeout_seconds, ssl_);
-        if (success) {
-            if (on_log) on_log("File served to client: " + filename);
-            if (on_client_done) on_client_done();
+        std::string filename;
+        if (opts_.archive) {
+            filename = opts_.archive->name();
+            sender_.reset(new FileSender(fd_, ssl_, opts_.archive));
+            // A deflated archive is delimited by closing the connection.
+            if (opts_.archive->size() < 0) keep_alive_ = false;
         } else {
-            if (on_log) on_log("File download failed for " + get_client_ip(fd_));
+            filename = file_basename(opts_.path);
+            sender_.reset(new FileSender(fd_, ssl_, opts_.path, file->mime, filename, true,
+                                         opts_.io_engine == "uring"));
+            sender_->set_file(file);
+        }
+        sender_->set_range(header("Range"), header("If-Range"));
+        sender_->set_throttle(throttle());
+        sender_->set_conditional(header("If-None-Match"),
+                                 header("If-Modified-Since"));
+        if (file) select_coding(*sender_, *file);
+        add_connection_headers(*sender_);
+        if (file) sender_->set_digest(opts_.digest);
+        if (!sender_->open()) {
+            sender_.reset();
+            if (on_log) on_log("File download failed for " + client_ip_);
             send_error(404, "404 File Not Found");
+            return;
         }
+        state_ = State::SendFile;
+        report_served_ = true;
+        after_response_ = [this, filename]() {
+            if (on_log) on_log("File served to client: " + filename);
+        };
     } else if (path == "/" + opts_.token + "/raw" && opts_.mode == "send") {
-        if (on_log) on_log("Serving raw file to " + get_client_ip(fd_));
+        if (on_log) on_log("Serving raw file to " + client_ip_);
         
-        struct stat file_stat;
-        if (stat(opts_.path.c_str(), &file_stat) == 0 &&
-            file_stat.st_size <= 1024 * 1024 &&
-            mime_type(opts_.path).rfind("text/", 0) == 0) {
-
-            bool success = stream_file(fd_, opts_.path, "text/plain; charset=utf-8", "", false, 
-                                     opts_.interrupted, opts_.socket_timeout_seconds, ssl_);
-            if (!success) {
-                if (on_log) on_log("Raw file serve failed for " + get_client_ip(fd_));
+        auto file = opts_.archive ? nullptr : opts_.files->get(opts_.path);
+        if (file && can_preview_file(*file)) {
+            sender_.reset(new FileSender(fd_, ssl_, opts_.path, "text/plain; charset=utf-8", "", false,
+                                         opts_.io_engine == "uring"));
+            sender_->set_file(file);
+            sender_->set_conditional(header("If-None-Match"),
+                                     header("If-Modified-Since"));
+            sender_->set_throttle(throttle());
+            select_coding(*sender_, *file);
+            add_connection_headers(*sender_);
+            sender_->set_digest(opts_.digest);
+            if (!sender_->open()) {
+                sender_.reset();
+                if (on_log) on_log("Raw file serve failed for " + client_ip_);
                 send_error(404, "404 File Not Found");
+                return;
             }
+            state_ = State::SendFile;
         } else {
-            if (on_log) on_log("Raw file preview not available for " + get_client_ip(fd_));
+            if (on_log) on_log("Raw file preview not available for " + client_ip_);
             send_error(404, "Preview not available for this file");
         }
     } else {
-        if (on_log) on_log("404 Not Found: " + path + " from " + get_client_ip(fd_));
+        if (on_log) on_log("404 Not Found: " + path + " from " + client_ip_);
         send_error(404, "404 Not Found");
     }
 }
 
-void ClientHandler::handle_post_request(const std::string& path, const std::string& headers) {
+// Share mode: /<token>/<path> is a file in the shared directory, streamed
+// like /file, or a directory, listed when its URL ends in '/'.
+void ClientHandler::handle_share_request(const std::string& target) {
+    std::string path = target.substr(0, target.find('?'));
+    std::string prefix = "/" + opts_.token;
+    std::string rel;
+    std::string full;
+    std::shared_ptr<const CachedFile> file;
+    struct stat st;
+    if (path.compare(0, prefix.size(), prefix) != 0 || (path.size() > prefix.size() && path[prefix.size()] != '/') ||
+        !url_decode(path.substr(prefix.size()), rel) || !share_path(opts_.path, rel, full) ||
+        (!(file = opts_.files->get(full)) && (stat(full.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)))) {
+        if (on_log) on_log("404 Not Found: " + path + " from " + client_ip_);
+        send_error(404, "404 Not Found");
+        return;
+    }
+
+    if (!file) {
+        if (path.back() != '/') {
+            // Entries are linked relative to the directory.
+            send_response("HTTP/1.1 301 Moved Permanently\r\nLocation: " + path + "/\r\nContent-Length: 0\r\n\r\n");
+            return;
+        }
+        std::unique_ptr<DirListing> listing(new DirListing(full, rel.empty() ? "/" : rel));
+        if (!listing->open()) {
+            if (on_log) on_log("Cannot list " + full + " for " + client_ip_);
+            send_error(404, "404 Not Found");
+            return;
+        }
+        if (on_log) on_log("Serving listing of " + listing->path() + " to " + client_ip_);
+        sender_.reset(new FileSender(fd_, ssl_, std::move(listing)));
+        keep_alive_ = false;
+    } else {
+        if (on_log) on_log("Serving " + rel + " to " + client_ip_);
+        std::string filename = file_basename(full);
+        sender_.reset(new FileSender(fd_, ssl_, full, file->mime, filename, false, opts_.io_engine == "uring"));
+        sender_->set_file(file);
+        sender_->set_range(header("Range"), header("If-Range"));
+        sender_->set_conditional(header("If-None-Match"),
+                                 header("If-Modified-Since"));
+        select_coding(*sender_, *file);
+        after_response_ = [this, filename]() {
+            if (on_log) on_log("File served to client: " + filename);
+        };
+    }
+    sender_->set_throttle(throttle());
+    add_connection_headers(*sender_);
+    if (!sender_->open()) {
+        sender_.reset();
+        after_response_ = nullptr;
+        if (on_log) on_log("Share request failed for " + client_ip_);
+        send_error(404, "404 Not Found");
+        return;
+    }
+    state_ = State::SendFile;
+}
+
+void ClientHandler::handle_post_request(const std::string& path) {
     if (opts_.mode != "get") {
         send_error(405, "405 Method Not Allowed");
         return;
     }
+    // The upload page posts to itself, /<token>; older clients post below it.
+    std::string prefix = "/" + opts_.token;
+    std::string target = path.substr(0, path.find('?'));
+    if (target.compare(0, prefix.size(), prefix) != 0 ||
+        (target.size() > prefix.size() && target[prefix.size()] != '/')) {
+        if (on_log) on_log("404 Not Found: " + path + " from " + client_ip_);
+        send_error(404, "404 Not Found");
+        return;
+    }
+    // The body is only ever delimited by its length.
+    if (request_.content_length() < 0) {
+        send_error(411, "411 Length Required");
+        return;
+    }
 
-    if (on_log) on_log("Starting file upload from " + get_client_ip(fd_));
+    if (on_log) on_log("Starting file upload from " + client_ip_);
+
+    // Anything but a form upload is taken as the file itself.
+    std::string content_type(header("Content-Type"));
+    if (content_type.find("multipart/form-data") == std::string::npos) {
+        start_upload("");
+        return;
+    }
     
     std::string boundary;
-    auto content_type_pos = headers.find("Content-Type:");
-    if (content_type_pos != std::string::npos) {
-        auto boundary_pos = headers.find("boundary=", content_type_pos);
-        if (boundary_pos != std::string::npos) {
-            boundary_pos += 9; 
-            size_t boundary_end = headers.find("\r\n", boundary_pos);
-            if (boundary_end == std::string::npos) {
-                boundary_end = headers.size();
-            }
-            boundary = headers.substr(boundary_pos, boundary_end - boundary_pos);
-            if (boundary.size() >= 2 && boundary[0] == '"' && boundary[boundary.size()-1] == '"') {
-                boundary = boundary.substr(1, boundary.size() - 2);
-            }
-            if (on_log) on_log("Extracted boundary: " + boundary);
+    auto boundary_pos = content_type.find("boundary=");
+    if (boundary_pos != std::string::npos) {
+        boundary = content_type.substr(boundary_pos + 9);
+        size_t boundary_end = boundary.find(';');
+        if (boundary_end != std::string::npos) boundary.resize(boundary_end);
+        if (boundary.size() >= 2 && boundary[0] == '"' && boundary[boundary.size()-1] == '"') {
+            boundary = boundary.substr(1, boundary.size() - 2);
         }
+        if (on_log) on_log("Extracted boundary: " + boundary);
     }
     
     if (boundary.empty()) {
-        if (on_log) on_log("Warning: No boundary found in headers from " + get_client_ip(fd_));
-        size_t body_start = headers.find("\r\n\r\n");
-        if (body_start != std::string::npos) {
-            std::string body_part = headers.substr(body_start + 4, 200);
-            size_t boundary_pos = body_part.find("--");
-            if (boundary_pos != std::string::npos) {
-                size_t boundary_end = body_part.find("\r\n", boundary_pos);
-                if (boundary_end != std::string::npos) {
-                    boundary = body_part.substr(boundary_pos + 2, boundary_end - boundary_pos - 2);
-                    if (on_log) on_log("Extracted boundary from body: " + boundary);
-                }
+        if (on_log) on_log("Warning: No boundary found in headers from " + client_ip_);
+        std::string_view body_part = body_start_.substr(0, 200);
+        size_t boundary_pos = body_part.find("--");
+        if (boundary_pos != std::string_view::npos) {
+            size_t boundary_end = body_part.find("\r\n", boundary_pos);
+            if (boundary_end != std::string_view::npos) {
+                boundary = body_part.substr(boundary_pos + 2, boundary_end - boundary_pos - 2);
+                if (on_log) on_log("Extracted boundary from body: " + boundary);
             }
         }
     }
+    if (boundary.empty()) {
+        send_error(400, "400 Bad Request");
+        return;
+    }
+
+    start_upload(boundary);
+}
 
+void ClientHandler::handle_put_request(const std::string& path) {
+    if (opts_.mode != "get") {
+        send_error(405, "405 Method Not Allowed");
+        return;
+    }
+    if (path != "/" + opts_.token + "/file") {
+        if (on_log) on_log("404 Not Found: " + path + " from " + client_ip_);
+        send_error(404, "404 Not Found");
+        return;
+    }
+    if (request_.content_length() < 0) {
+        send_error(411, "411 Length Required");
+        return;
+    }
+
+    if (on_log) on_log("Starting raw file upload from " + client_ip_);
+    start_upload("");
+}
+
+// Progress of a chunked upload, for a client resuming it: Upload-Offset is
+// where the data received without gaps ends.
+void ClientHandler::handle_head_request(const std::string& path) {
+    if (opts_.mode != "get" || path != "/" + opts_.token + "/file") {
+        send_error(opts_.mode != "get" ? 405 : 404, "");
+        return;
+    }
+    auto upload = opts_.uploads->find(std::string(header("Upload-Id")));
+    if (!upload) {
+        send_error(404, "");
+        return;
+    }
+    std::ostringstream resp;
+    resp << "HTTP/1.1 200 OK\r\nUpload-Offset: " << upload->offset() << "\r\nUpload-Length: " << upload->size()
+         << "\r\nCache-Control: no-store\r\nContent-Length: 0\r\n\r\n";
+    send_response(resp.str());
+}
+
+void ClientHandler::start_upload(const std::string& boundary) {
+    // `get <file>` puts the first file there and any others next to it;
+    // `get` or `get <dir>` names every file after the sender's file name.
     std::string outname;
-    if (opts_.path.empty()) {
-        outname = "upload_" + random_token(8);
-    } else {
+    std::string out_dir = opts_.working_dir;
+    struct stat st;
+    if (!opts_.path.empty() && stat(opts_.path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        out_dir = opts_.path;
+    } else if (!opts_.path.empty()) {
         outname = opts_.path;
+        out_dir = fs::path(opts_.path).parent_path().string();
+        if (out_dir.empty()) out_dir = ".";
+    }
+
+    long long content_len = request_.content_length();
+    receiver_.reset(new FileReceiver(fd_, ssl_, content_len, boundary, outname, opts_.max_size,
+                                       opts_.io_engine == "uring"));
+    SyncMode sync = SyncMode::None;
+    parse_sync_mode(opts_.sync_mode, sync);
+    receiver_->set_sync(sync);
+    receiver_->set_output_dir(out_dir);
+    receiver_->set_throttle(throttle());
+    std::string filename;
+    if (boundary.empty() && content_disposition_filename(std::string(header("Content-Disposition")), filename)) {
+        receiver_->set_filename(filename);
+    }
+    std::string content_range(header("Content-Range"));
+    if (boundary.empty() && (!content_range.empty() || !header("Upload-Id").empty()) &&
+        !join_chunked_upload(content_range, outname, out_dir, filename)) {
+        receiver_.reset();
+        return;
+    }
+    std::string sha;
+    if (request_sha256(request_, sha)) {
+        // The digest is of the whole request body. A form holds more than
+        // the files it carries, so it could never be checked.
+        if (!boundary.empty()) {
+            if (on_log) on_log("Rejected multipart upload with a digest header from " + client_ip_);
+            receiver_.reset();
+            send_error(400, "400 Digest headers are only supported on single-file uploads");
+            return;
+        }
+        if (!chunk_) receiver_->set_expected_sha256(sha);
+    }
+    if (!receiver_->open()) {
+        if (receiver_->out_of_space()) {
+            receiver_.reset();
+            if (on_log) on_log("Not enough disk space for upload from " + client_ip_);
+            send_error(507, "507 Insufficient Storage");
+            return;
+        }
+        finish_upload(false);
+        return;
+    }
+
+    receiver_->prime(body_start_.data(), body_start_.size());
+    state_ = State::ReceiveBody;
+
+    // curl and others hold the body back until told to go ahead.
+    if (has_token(header("Expect"), "100-continue") && body_start_.empty()) {
+        out_buf_ = "HTTP/1.1 100 Continue\r\n\r\n";
+        out_sent_ = 0;
+        state_ = State::SendContinue;
+    }
+}
+
+// A body that belongs to a chunked upload: an Upload-Id, and the range of
+// the file it carries in Content-Range (the whole file without one). The
+// first body to arrive creates the upload, named like a single raw upload;
+// later ones may start anywhere up to the data already received.
+bool ClientHandler::join_chunked_upload(const std::string& content_range,
+                                        const std::string& outname, const std::string& out_dir,
+                                        const std::string& filename) {
+    long long content_len = request_.content_length();
+    long long first = 0, last = content_len - 1, total = content_len;
+    std::string id(header("Upload-Id"));
+    if ((content_range.empty() ? content_len <= 0 : !parse_content_range(content_range, first, last, total)) ||
+        !valid_upload_id(id) || content_len != last - first + 1) {
+        send_error(400, "400 Bad Request");
+        return false;
+    }
+
+    bool out_of_space = false;
+    UploadRegistry::Status status;
+    auto upload = opts_.uploads->find_or_create(id, total, [&]() -> std::shared_ptr<ChunkedUpload> {
+        std::string path = outname;
+        if (path.empty()) {
+            std::string name = sanitize_filename(filename);
+            if (name.empty()) name = "upload_" + random_token(8);
+            path = unique_path((fs::path(out_dir) / name).string());
+        }
+        SyncMode sync = SyncMode::None;
+        parse_sync_mode(opts_.sync_mode, sync);
+        auto created = std::make_shared<ChunkedUpload>(path, total);
+        if (!created->open(sync, !outname.empty(), out_of_space)) return nullptr;
+        if (on_log) on_log("Chunked upload " + id + " started from " + client_ip_ + ": " + path);
+        return created;
+    }, status);
+    if (status == UploadRegistry::Status::TooLarge) {
+        if (on_log) on_log("Content length exceeds max size from " + client_ip_);
+        send_error(413, "413 Payload Too Large");
+        return false;
+    }
+    if (status == UploadRegistry::Status::TooMany) {
+        if (on_log) on_log("Too many uploads in progress, refused upload from " + client_ip_);
+        send_error(503, "503 Service Unavailable");
+        return false;
+    }
+    if (status == UploadRegistry::Status::Conflict) {
+        if (on_log) on_log("Upload " + id + " is in progress with another size, refused upload from " + client_ip_);
+        send_error(409, "409 Conflict");
+        return false;
+    }
+    if (!upload) {
+        if (out_of_space) {
+            if (on_log) on_log("Not enough disk space for upload from " + client_ip_);
+            send_error(507, "507 Insufficient Storage");
+        } else {
+            if (on_log) on_log("Cannot create upload " + id + " from " + client_ip_);
+            send_error(500, "500 Internal Server Error");
+        }
+        return false;
+    }
+    if (!upload->accepts(first)) {
+        if (on_log) on_log("Upload " + id + " cannot continue at " + std::to_string(first) + " from " + client_ip_);
+        send_error(409, "409 Conflict");
+        return false;
+    }
+
+    chunk_ = upload;
+    chunk_id_ = id;
+    receiver_->set_chunk(upload, first);
+    return true;
+}
+
+void ClientHandler::finish_upload(bool success) {
+    std::vector<std::string> files;
+    std::vector<std::string> digests;
+    bool mismatch = false;
+    if (receiver_) {
+        files = receiver_->saved_files();
+        digests = receiver_->saved_digests();
+        mismatch = receiver_->digest_mismatch();
+    }
+    receiver_.reset();
+    // The receiver only succeeds once it has read the body to its end.
+    if (success) body_read_ = true;
+
+    if (chunk_) {
+        auto upload = std::move(chunk_);
+        chunk_.reset();
+        // Overlapping bodies can complete the file even from a failed one.
+        bool complete = upload->take_complete();
+        if (!complete && !success) {
+            if (on_log) on_log("Upload " + chunk_id_ + " interrupted at " + std::to_string(upload->offset()) +
+                               " bytes from " + client_ip_ + ", can be resumed");
+        } else if (!complete) {
+            send_response("HTTP/1.1 204 No Content\r\nUpload-Offset: " + std::to_string(upload->offset()) +
+                          "\r\n\r\n");
+            return;
+        } else {
+            opts_.uploads->remove(chunk_id_);
+            success = upload->commit();
+            if (success) {
+                files.push_back(upload->path());
+                digests.push_back("");
+            }
+        }
     }
 
-    long long content_len = extract_content_length(headers);
-    bool success = stream_receive_file(fd_, content_len, boundary, outname, opts_.max_size, 
-                                     opts_.interrupted, opts_.socket_timeout_seconds, ssl_);
     if (success) {
-        if (on_log) on_log("File uploaded from " + get_client_ip(fd_) + ": " + outname);
-        std::string success_msg = "<html><body><h2>Upload successful!</h2></body></html>";
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (on_log) on_log("File uploaded from " + client_ip_ + ": " + files[i] +
+                               (digests[i].empty() ? "" : " (SHA-256 " + digests[i] + ")"));
+        }
+        std::string success_msg = "<html><body><h2>Upload successful!</h2><p>" + std::to_string(files.size()) +
+                                  (files.size() == 1 ? " file" : " files") + " received.</p></body></html>";
         std::ostringstream resp;
         resp << "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: "
              << success_msg.size() << "\r\n\r\n" << success_msg;
         send_response(resp.str());
-        
-        if (on_client_done) on_client_done();
+
+        after_response_ = on_client_done;
+    } else if (mismatch) {
+        if (on_log) on_log("Upload from " + client_ip_ + " does not match its SHA-256, discarded");
+        send_error(400, "400 Bad Request: SHA-256 mismatch");
     } else {
-        if (on_log) on_log("File upload failed from " + get_client_ip(fd_));
+        if (on_log) on_log("File upload failed from " + client_ip_);
+        for (const auto& f : files) {
+            if (on_log) on_log("Kept file completed before the failure: " + f);
+        }
         std::string error_msg = "<html><body><h2>Upload failed!</h2></body></html>";
         std::ostringstream resp;
         resp << "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: "
@@ -275,51 +700,187 @@ void ClientHandler::handle_post_request(const std::string& path, const std::stri
     }
 }
 
-void ClientHandler::handle() {
-    std::string headers;
-    if (!read_headers(headers)) {
-        if (on_log) on_log("Failed to read headers from " + get_client_ip(fd_));
-        if (ssl_) {
-            SSL_shutdown(ssl_);
-            SSL_free(ssl_);
-            ssl_ = nullptr;
+void ClientHandler::dispatch_request() {
+    // The views of the parsed request point into in_buf_, which is left
+    // alone until the next request is read.
+    std::string_view input = pending();
+    RequestParser::Status ps = request_.feed(input);
+    size_t head_size = request_.head_size();
+    request_.reset();
+    if (ps == RequestParser::Status::Complete) ps = request_.parse(input.substr(0, head_size));
+    if (ps != RequestParser::Status::Complete) {
+        keep_alive_ = false;
+        in_buf_.clear();
+        in_off_ = 0;
+        if (on_log) on_log("Malformed request from " + client_ip_);
+        if (ps == RequestParser::Status::TooLarge) {
+            send_error(431, "431 Request Header Fields Too Large");
+        } else {
+            send_error(400, "400 Bad Request");
         }
-        close(fd_);
         return;
     }
 
-    std::istringstream rs(headers);
-    std::string method, path, ver;
-    rs >> method >> path >> ver;
+    std::string method(request_.method());
+    std::string path(request_.target());
 
-    if (on_log) on_log("Request from " + get_client_ip(fd_) + ": " + method + " " + path);
+    if (on_log) on_log("Request from " + client_ip_ + ": " + method + " " + path);
+
+    keep_alive_ = wants_keep_alive();
+    ++requests_served_;
+    report_served_ = false;
+    long long content_len = request_.content_length();
+    body_read_ = content_len <= 0;
+    if (keep_alive_) {
+        // Anything past this request's head and body is the next pipelined
+        // request.
+        body_start_ = input.substr(head_size, (size_t)std::max(content_len, 0LL));
+        in_off_ += head_size + body_start_.size();
+    } else {
+        body_start_ = input.substr(head_size);
+        in_off_ = in_buf_.size();
+    }
 
-    long long content_len = extract_content_length(headers);
     if (opts_.max_size > 0 && content_len > 0 && content_len > opts_.max_size) {
-        if (on_log) on_log("Content length exceeds max size from " + get_client_ip(fd_));
+        if (on_log) on_log("Content length exceeds max size from " + client_ip_);
         send_error(413, "413 Payload Too Large");
-        if (ssl_) {
-            SSL_shutdown(ssl_);
-            SSL_free(ssl_);
-            ssl_ = nullptr;
-        }
-        close(fd_);
         return;
     }
 
     if (method == "GET") {
-        handle_get_request(path, headers);
+        handle_get_request(path);
     } else if (method == "POST") {
-        handle_post_request(path, headers);
+        handle_post_request(path);
+    } else if (method == "PUT") {
+        handle_put_request(path);
+    } else if (method == "HEAD") {
+        handle_head_request(path);
     } else {
         send_error(405, "405 Method Not Allowed");
     }
+}
 
-    if (ssl_) {
-        SSL_shutdown(ssl_);
-        SSL_free(ssl_);
-        ssl_ = nullptr;
+IoStatus ClientHandler::drive() {
+    while (true) {
+        if (state_ != State::Closed && opts_.interrupted && *opts_.interrupted) {
+            return IoStatus::Error;
+        }
+
+        IoStatus st;
+        switch (state_) {
+            case State::Handshake:
+                st = handshake();
+                if (st == IoStatus::Error) {
+                    if (on_log) on_log("TLS handshake failed for " + client_ip_);
+                    SSL_free(ssl_);
+                    ssl_ = nullptr;
+                    return st;
+                }
+                if (st != IoStatus::Done) return st;
+                state_ = State::ReadHeaders;
+                state_start_ = std::chrono::steady_clock::now();
+                break;
+
+            case State::ReadHeaders:
+                st = read_headers();
+                if (st == IoStatus::Error && requests_served_ > 0 && pending().empty()) {
+                    // Peer closed an idle persistent connection.
+                    state_ = State::Closed;
+                    return IoStatus::Done;
+                }
+                if (st == IoStatus::Error) {
+                    if (on_log) on_log("Failed to read headers from " + client_ip_);
+                    return st;
+                }
+                if (st != IoStatus::Done) return st;
+                dispatch_request();
+                break;
+
+            case State::SendContinue:
+                st = flush_response();
+                if (st != IoStatus::Done) return st;
+                state_ = State::ReceiveBody;
+                break;
+
+            case State::ReceiveBody:
+                st = receiver_->pump();
+                if (st == IoStatus::WantRead || st == IoStatus::WantWrite) return st;
+                finish_upload(st == IoStatus::Done);
+                break;
+
+            case State::SendFile:
+            case State::SendResponse: {
+                st = (state_ == State::SendFile) ? sender_->pump() : flush_response();
+                if (st == IoStatus::WantRead || st == IoStatus::WantWrite) return st;
+                if (sender_ && report_served_ && on_file_served) {
+                    on_file_served(sender_->sent_ranges(), sender_->file_size(), st == IoStatus::Done);
+                }
+                sender_.reset();
+                state_ = State::Closed;
+                auto cb = std::move(after_response_);
+                after_response_ = nullptr;
+                if (st != IoStatus::Done) {
+                    if (on_log) on_log("Response send failed for " + client_ip_);
+                    return st;
+                }
+                if (cb) cb();
+                if (keep_alive_) {
+                    state_ = State::ReadHeaders;
+                    state_start_ = std::chrono::steady_clock::now();
+                }
+                break;
+            }
+
+            case State::Closed:
+                return IoStatus::Done;
+        }
+    }
+}
+
+// When timed_out() will next find the connection expired. Except for an
+// idle keep-alive connection it waits for more than the limit in whole
+// seconds, which is up to a second after the limit itself.
+std::chrono::steady_clock::time_point ClientHandler::deadline() const {
+    if (state_ == State::ReadHeaders && requests_served_ > 0 && pending().empty()) {
+        return state_start_ + std::chrono::seconds(opts_.keep_alive_timeout_seconds);
+    }
+    auto since = state_start_;
+    if (state_ == State::SendFile && sender_) {
+        since = sender_->last_progress();
+    } else if ((state_ == State::SendContinue || state_ == State::ReceiveBody) && receiver_) {
+        since = receiver_->last_progress();
+    }
+    return since + std::chrono::seconds(opts_.socket_timeout_seconds + 1);
+}
+
+Throttle ClientHandler::throttle() const {
+    return Throttle(opts_.rate_bucket, conn_bucket_);
+}
+
+bool ClientHandler::throttled(std::chrono::steady_clock::time_point& until) const {
+    if (state_ == State::SendFile && sender_) return sender_->throttled(until);
+    if (state_ == State::ReceiveBody && receiver_) return receiver_->throttled(until);
+    return false;
+}
+
+int ClientHandler::wait_fd() const {
+    return state_ == State::SendFile && sender_ ? sender_->wait_fd() : -1;
+}
+
+void ClientHandler::handle() {
+    IoStatus st;
+    while ((st = drive()) == IoStatus::WantRead || st == IoStatus::WantWrite) {
+        if (timed_out(std::chrono::steady_clock::now())) break;
+        std::chrono::steady_clock::time_point until;
+        if (throttled(until)) {
+            // The socket may well be ready; it is the rate limit that says when to go on.
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait_timeout_ms(until, INTERRUPT_CHECK_MS)));
+            continue;
+        }
+        // Readiness ends the wait at once; the cap only bounds how late an
+        // interrupt is noticed.
+        int other = wait_fd();
+        wait_for_io(other >= 0 ? other : fd_, other >= 0 ? IoStatus::WantRead : st,
+                    wait_timeout_ms(deadline(), INTERRUPT_CHECK_MS));
     }
-    close(fd_);
-    if (on_log) on_log("Client connection closed: " + get_client_ip(fd_));
 }
@@ -2,34 +2,113 @@
 #define CLIENT_HANDLER_H
 
 #include "server.h"
+#include "socket_io.h"
+#include "file_transfer.h"
+#include "http_handlers.h"
+#include "request_parser.h"
 #include <string>
+#include <memory>
+#include <vector>
+#include <chrono>
 
 
 #include <openssl/ssl.h>
 
 
+// One client connection, implemented as a non-blocking state machine.
+// handle() drives it to completion on the calling thread; an event loop
+// calls drive() on every readiness event instead. GET responses keep the
+// connection open (HTTP/1.1 keep-alive) and pipelined requests already in
+// the input buffer are served in order. The connection is closed when the
+// handler is destroyed.
 class ClientHandler {
 public:
 
     ClientHandler(const ServerOptions& opts, int fd, SSL* ssl = nullptr);
+    ~ClientHandler();
 
     void handle();
+    IoStatus drive();
+    bool timed_out(std::chrono::steady_clock::time_point now);
+    // After drive() returned WantRead/WantWrite: whether the transfer waits
+    // for its rate limit rather than the socket, and until when.
+    bool throttled(std::chrono::steady_clock::time_point& until) const;
+    // After drive() returned WantRead/WantWrite: a descriptor to wait on for
+    // readability instead of the socket, or -1.
+    int wait_fd() const;
+    int fd() const { return fd_; }
 
     std::function<void(const std::string&)> on_log;
     std::function<void()> on_client_done;
+    // Called when a /file response ends with the file ranges that reached the
+    // socket; `complete` is false if the transfer was cut short.
+    std::function<void(const std::vector<ByteRange>&, long long total, bool complete)> on_file_served;
 
 private:
+    enum class State { Handshake, ReadHeaders, SendResponse, SendFile, SendContinue, ReceiveBody, Closed };
+
     ServerOptions opts_;
     int fd_;
 
     SSL* ssl_;
 
-    
-    bool read_headers(std::string& headers);
-    void handle_get_request(const std::string& path, const std::string& headers);
-    void handle_post_request(const std::string& path, const std::string& headers);
+    State state_ = State::ReadHeaders;
+    std::string client_ip_;
+    std::chrono::steady_clock::time_point state_start_;
+
+    // Received bytes from in_off_ on are the next request; the request being
+    // served lies before it, parsed in place.
+    std::string in_buf_;
+    size_t in_off_ = 0;
+    RequestParser request_;
+    std::string_view body_start_;  // body bytes that came with the head
+    std::string out_buf_;
+    size_t out_sent_ = 0;
+    std::shared_ptr<const PageResponse> page_;  // sent around out_buf_ when set
+    std::function<void()> after_response_;
+    bool report_served_ = false;
+    bool keep_alive_ = false;
+    // Whether the request body, if any, has been read to its end; the
+    // connection can only carry another request once it has.
+    bool body_read_ = true;
+    int requests_served_ = 0;
+
+    std::unique_ptr<FileSender> sender_;
+    std::unique_ptr<FileReceiver> receiver_;
+    // The chunked upload the request body belongs to, if any.
+    std::shared_ptr<ChunkedUpload> chunk_;
+    std::string chunk_id_;
+    // This connection's share of --conn-rate-limit, if set.
+    std::shared_ptr<TokenBucket> conn_bucket_;
+
+    void close_connection();
+    IoStatus handshake();
+    IoStatus read_headers();
+    void dispatch_request();
+    void finish_upload(bool success);
+    IoStatus flush_response();
+    void handle_get_request(const std::string& path);
+    void handle_share_request(const std::string& target);
+    void handle_post_request(const std::string& path);
+    void handle_put_request(const std::string& path);
+    void handle_head_request(const std::string& path);
+    void start_upload(const std::string& boundary);
+    bool join_chunked_upload(const std::string& content_range,
+                             const std::string& outname, const std::string& out_dir, const std::string& filename);
     void send_response(const std::string& response);
     void send_error(int code, const std::string& message);
+    bool wants_keep_alive() const;
+    std::chrono::steady_clock::time_point deadline() const;
+    // Value of a field of the current request, a view into in_buf_; empty
+    // when it is missing.
+    std::string_view header(std::string_view name) const { return request_.header(name); }
+    std::string_view pending() const { return std::string_view(in_buf_).substr(in_off_); }
+    std::string keep_alive_params() const;
+    void add_connection_headers(FileSender& sender) const;
+    void select_coding(FileSender& sender, const CachedFile& file);
+    std::string connection_headers() const;
+    void send_page(const std::string& key, const std::function<std::string()>& build);
+    Throttle throttle() const;
 };
 
 #endif
@@ -0,0 +1,399 @@
+#include "compression.h"
+#include "../utils/utils.h"
+#include "../utils/zip_stream.h"
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#include <deque>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// Source bytes read per step, and coded chunks the worker may run ahead.
+static const size_t COMPRESS_READ_SIZE = 256 * 1024;
+static const size_t COMPRESS_QUEUE_CHUNKS = 4;
+static const int GZIP_LEVEL = 6;
+#ifdef HAVE_BROTLI
+// Quality 5 keeps brotli at gzip -6 speed while still compressing better.
+static const int BROTLI_QUALITY = 5;
+static const int BROTLI_WINDOW = 22;
+#endif
+
+static bool coding_available(ContentCoding coding) {
+#ifdef HAVE_BROTLI
+    const bool have_brotli = true;
+#else
+    const bool have_brotli = false;
+#endif
+    return have_brotli || coding != ContentCoding::Brotli;
+}
+
+ContentCoding negotiate_coding(std::string_view accept_encoding) {
+    // q-values per coding; -1 when not listed.
+    double q_gzip = -1, q_br = -1, q_any = -1;
+    size_t pos = 0;
+    while (pos < accept_encoding.size()) {
+        size_t comma = accept_encoding.find(',', pos);
+        if (comma == std::string_view::npos) comma = accept_encoding.size();
+        std::string_view item = accept_encoding.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        double q = 1;
+        size_t semi = item.find(';');
+        if (semi != std::string_view::npos) {
+            std::string param(item.substr(semi + 1));
+            item = item.substr(0, semi);
+            size_t eq = param.find('=');
+            if (eq != std::string::npos && param.find_first_not_of(" \t") < eq &&
+                tolower((unsigned char)param[param.find_first_not_of(" \t")]) == 'q') {
+                q = atof(param.c_str() + eq + 1);
+            }
+        }
+        size_t b = item.find_first_not_of(" \t");
+        size_t e = item.find_last_not_of(" \t");
+        if (b == std::string_view::npos) continue;
+        std::string name(item.substr(b, e - b + 1));
+
+        if (strcasecmp(name.c_str(), "gzip") == 0 || strcasecmp(name.c_str(), "x-gzip") == 0) q_gzip = q;
+        else if (strcasecmp(name.c_str(), "br") == 0) q_br = q;
+        else if (name == "*") q_any = q;
+    }
+    if (q_gzip < 0) q_gzip = q_any;
+    if (q_br < 0) q_br = q_any;
+    if (!coding_available(ContentCoding::Brotli)) q_br = -1;
+
+    if (q_br > 0 && q_br >= q_gzip) return ContentCoding::Brotli;
+    if (q_gzip > 0) return ContentCoding::Gzip;
+    return ContentCoding::Identity;
+}
+
+const char* coding_name(ContentCoding coding) {
+    switch (coding) {
+        case ContentCoding::Gzip: return "gzip";
+        case ContentCoding::Brotli: return "br";
+        default: return "";
+    }
+}
+
+bool worth_compressing(const std::string& path, const struct stat& st) {
+    ZipEntry e;
+    e.source = path;
+    size_t slash = path.find_last_of('/');
+    e.name = slash == std::string::npos ? path : path.substr(slash + 1);
+    e.mode = st.st_mode;
+    e.size = (uint64_t)st.st_size;
+    zip_choose_method(e, ZIP_LEVEL_AUTO);
+    return e.method == 8;
+}
+
+// One coder behind a common interface: feed input, collect output.
+class Encoder {
+public:
+    explicit Encoder(ContentCoding coding) : coding_(coding) {}
+    ~Encoder() {
+        if (gzip_ready_) deflateEnd(&z_);
+#ifdef HAVE_BROTLI
+        if (br_) BrotliEncoderDestroyInstance(br_);
+#endif
+    }
+
+    bool init() {
+        if (coding_ == ContentCoding::Gzip) {
+            memset(&z_, 0, sizeof(z_));
+            // windowBits + 16 selects the gzip wrapper.
+            gzip_ready_ = deflateInit2(&z_, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            return gzip_ready_;
+        }
+#ifdef HAVE_BROTLI
+        br_ = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        if (!br_) return false;
+        BrotliEncoderSetParameter(br_, BROTLI_PARAM_QUALITY, BROTLI_QUALITY);
+        BrotliEncoderSetParameter(br_, BROTLI_PARAM_LGWIN, BROTLI_WINDOW);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Appends the coded form of `data` to `out`; `finish` ends the stream.
+    bool encode(const char* data, size_t len, bool finish, std::string& out) {
+        char buf[64 * 1024];
+        if (coding_ == ContentCoding::Gzip) {
+            z_.next_in = (Bytef*)data;
+            z_.avail_in = (uInt)len;
+            int rc;
+            do {
+                z_.next_out = (Bytef*)buf;
+                z_.avail_out = sizeof(buf);
+                rc = deflate(&z_, finish ? Z_FINISH : Z_NO_FLUSH);
+                if (rc == Z_STREAM_ERROR) return false;
+                out.append(buf, sizeof(buf) - z_.avail_out);
+            } while (z_.avail_out == 0 || (finish && rc != Z_STREAM_END));
+            return true;
+        }
+#ifdef HAVE_BROTLI
+        const uint8_t* next_in = (const uint8_t*)data;
+        size_t avail_in = len;
+        BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        do {
+            uint8_t* next_out = (uint8_t*)buf;
+            size_t avail_out = sizeof(buf);
+            if (!BrotliEncoderCompressStream(br_, op, &avail_in, &next_in, &avail_out, &next_out, nullptr)) {
+                return false;
+            }
+            out.append(buf, sizeof(buf) - avail_out);
+        } while (avail_in > 0 || BrotliEncoderHasMoreOutput(br_) ||
+                 (finish && !BrotliEncoderIsFinished(br_)));
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+    ContentCoding coding_;
+    z_stream z_;
+    bool gzip_ready_ = false;
+#ifdef HAVE_BROTLI
+    BrotliEncoderState* br_ = nullptr;
+#endif
+};
+
+struct CompressStream::State {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> queue;
+    bool done = false;
+    bool failed = false;
+    bool stop = false;
+    int event_fd = -1;
+    std::thread worker;
+
+    void signal() {
+        if (event_fd < 0) return;
+        uint64_t one = 1;
+        ssize_t r = ::write(event_fd, &one, sizeof(one));
+        (void)r;
+    }
+};
+
+static bool write_all(int fd, const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t w = ::write(fd, data.data() + off, data.size() - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        off += (size_t)w;
+    }
+    return true;
+}
+
+CompressStream::CompressStream(const std::string& path, ContentCoding coding, const std::string& cache_key,
+                               const std::string& cache_path)
+    : state_(std::make_shared<State>())
+{
+    state_->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    state_->worker = std::thread(&CompressStream::run, state_, path, coding, cache_key, cache_path);
+}
+
+CompressStream::~CompressStream() {
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->stop = true;
+    }
+    state_->cv.notify_all();
+    if (state_->worker.joinable()) state_->worker.join();
+    if (state_->event_fd >= 0) ::close(state_->event_fd);
+}
+
+int CompressStream::ready_fd() const {
+    return state_->event_fd;
+}
+
+CompressStream::Chunk CompressStream::try_next(const char*& data, size_t& len) {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    auto ready = [&] { return !state_->queue.empty() || state_->done; };
+    if (state_->event_fd < 0) {
+        state_->cv.wait(lock, ready);
+    } else if (!ready()) {
+        // Clear the eventfd before looking again: output queued after that
+        // look signals it anew.
+        lock.unlock();
+        uint64_t count;
+        ssize_t r = ::read(state_->event_fd, &count, sizeof(count));
+        (void)r;
+        lock.lock();
+        if (!ready()) return Chunk::NotReady;
+    }
+    if (state_->queue.empty()) {
+        data = nullptr;
+        len = 0;
+        return state_->failed ? Chunk::Failed : Chunk::Ready;
+    }
+    current_ = std::move(state_->queue.front());
+    state_->queue.pop_front();
+    lock.unlock();
+    state_->cv.notify_all();
+
+    data = current_.data();
+    len = current_.size();
+    return Chunk::Ready;
+}
+
+void CompressStream::run(std::shared_ptr<State> state, std::string path, ContentCoding coding,
+                         std::string cache_key, std::string cache_path) {
+    auto push = [&](std::string& chunk) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait(lock, [&] { return state->queue.size() < COMPRESS_QUEUE_CHUNKS || state->stop; });
+        if (state->stop) return false;
+        state->queue.push_back(std::move(chunk));
+        lock.unlock();
+        state->cv.notify_all();
+        state->signal();
+        return true;
+    };
+
+    bool ok = false;
+    int cache_fd = -1;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    Encoder encoder(coding);
+    if (fd < 0) {
+        vlog("Cannot compress " + path + ": " + strerror(errno));
+    } else if (!encoder.init()) {
+        vlog("Cannot compress " + path + ": encoder setup failed");
+    } else {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (!cache_path.empty()) {
+            cache_fd = ::open(cache_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+
+        std::vector<char> buf(COMPRESS_READ_SIZE);
+        while (true) {
+            ssize_t r = ::read(fd, buf.data(), buf.size());
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                vlog("Cannot compress " + path + ": " + strerror(errno));
+                break;
+            }
+            std::string out;
+            if (!encoder.encode(buf.data(), (size_t)r, r == 0, out)) {
+                vlog("Cannot compress " + path + ": encoder failed");
+                break;
+            }
+            if (cache_fd >= 0 && !out.empty() && !write_all(cache_fd, out)) {
+                vlog("Dropping cached " + std::string(coding_name(coding)) + " copy of " + path + ": " + strerror(errno));
+                ::close(cache_fd);
+                cache_fd = -1;
+            }
+            if (!out.empty() && !push(out)) break;
+            if (r == 0) {
+                ok = true;
+                break;
+            }
+        }
+    }
+    if (fd >= 0) ::close(fd);
+
+    if (cache_fd >= 0 && ::close(cache_fd) != 0) ok = false;
+    if (!cache_path.empty()) CompressionCache::instance().release(cache_key, cache_path, ok && cache_fd >= 0);
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done = true;
+        state->failed = !ok;
+    }
+    state->cv.notify_all();
+    state->signal();
+}
+
+CompressionCache& CompressionCache::instance() {
+    static CompressionCache cache;
+    return cache;
+}
+
+CompressionCache::~CompressionCache() {
+    if (dir_.empty()) return;
+    for (const auto& entry : ready_) ::unlink(entry.second.path.c_str());
+    for (const auto& entry : building_) ::unlink(entry.second.c_str());
+    ::rmdir(dir_.c_str());
+}
+
+std::string CompressionCache::key(const std::string& path, const struct stat& st, ContentCoding coding) {
+    return path + "\n" + std::to_string((long long)st.st_size) + "\n" + std::to_string((long long)st.st_mtim.tv_sec) +
+           "." + std::to_string((long long)st.st_mtim.tv_nsec) + "\n" + coding_name(coding);
+}
+
+bool CompressionCache::find(const std::string& key, std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ready_.find(key);
+    if (it == ready_.end()) return false;
+    uses_.splice(uses_.begin(), uses_, it->second.use);
+    path = it->second.path;
+    return true;
+}
+
+// A sender that already opened the variant keeps reading it after the unlink.
+void CompressionCache::drop(std::map<std::string, Variant>::iterator it) {
+    ::unlink(it->second.path.c_str());
+    ready_bytes_ -= it->second.size;
+    uses_.erase(it->second.use);
+    ready_.erase(it);
+}
+
+std::string CompressionCache::claim(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ready_.count(key) || building_.count(key)) return "";
+    // Keys run path, size, mtime, coding: variants of the same path sort
+    // together, and those of another size or mtime are of an older version.
+    // Fields are counted from the end, as a path may hold a newline.
+    size_t coding_at = key.rfind('\n');
+    size_t size_at = key.rfind('\n', key.rfind('\n', coding_at - 1) - 1);
+    const std::string file = key.substr(0, size_at + 1);
+    const std::string version = key.substr(0, coding_at + 1);
+    for (auto it = ready_.lower_bound(file); it != ready_.end() && it->first.compare(0, file.size(), file) == 0;) {
+        if (it->first.compare(0, version.size(), version) == 0) {
+            ++it;
+        } else {
+            drop(it++);
+        }
+    }
+    if (dir_.empty()) {
+        if (dir_failed_) return "";
+        const char* tmp = getenv("TMPDIR");
+        std::string templ = std::string(tmp && *tmp ? tmp : "/tmp") + "/simplefilehost-XXXXXX";
+        std::vector<char> buf(templ.begin(), templ.end());
+        buf.push_back('\0');
+        if (!mkdtemp(buf.data())) {
+            vlog("Compression cache disabled: cannot create " + templ + ": " + strerror(errno));
+            dir_failed_ = true;
+            return "";
+        }
+        dir_ = buf.data();
+        vlog("Compression cache: " + dir_);
+    }
+    std::string path = dir_ + "/" + std::to_string(next_id_++) + "." + key.substr(key.rfind('\n') + 1);
+    building_[key] = path;
+    return path;
+}
+
+void CompressionCache::release(const std::string& key, const std::string& path, bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    building_.erase(key);
+    struct stat st;
+    if (!ok || ::stat(path.c_str(), &st) != 0 || st.st_size > MAX_BYTES) {
+        ::unlink(path.c_str());
+        return;
+    }
+    uses_.push_front(key);
+    ready_[key] = Variant{path, (long long)st.st_size, uses_.begin()};
+    ready_bytes_ += st.st_size;
+    while (ready_bytes_ > MAX_BYTES) drop(ready_.find(uses_.back()));
+}
@@ -0,0 +1,99 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <map>
+#include <list>
+#include <mutex>
+#include <sys/stat.h>
+
+// Content codings a response body can be sent with.
+enum class ContentCoding { Identity, Gzip, Brotli };
+
+// Best coding acceptable under an Accept-Encoding value: br (when built with
+// Brotli), then gzip, then identity; ties in q go to the smaller output.
+ContentCoding negotiate_coding(std::string_view accept_encoding);
+// Content-Encoding token ("gzip", "br"); empty for identity.
+const char* coding_name(ContentCoding coding);
+
+// Whether compressing the file pays off, by the same rules as zip's
+// --level auto: no media or already-compressed formats, and the first block
+// must shrink in a trial compression.
+bool worth_compressing(const std::string& path, const struct stat& st);
+
+// Compresses a file on a worker thread. try_next() returns the coded bytes
+// in order, len == 0 at the end; it does not wait for the worker when it is
+// behind but returns NotReady, and ready_fd() becomes readable once there
+// is more. With a `cache_path` the output is also written there, and the
+// variant is added to the CompressionCache once complete.
+class CompressStream {
+public:
+    CompressStream(const std::string& path, ContentCoding coding, const std::string& cache_key,
+                   const std::string& cache_path);
+    ~CompressStream();
+
+    CompressStream(const CompressStream&) = delete;
+    CompressStream& operator=(const CompressStream&) = delete;
+
+    enum class Chunk { Ready, NotReady, Failed };
+    Chunk try_next(const char*& data, size_t& len);
+    // Eventfd signalled whenever the worker queues output or finishes; -1
+    // if none could be created, in which case try_next() waits instead.
+    int ready_fd() const;
+
+private:
+    struct State;
+    std::shared_ptr<State> state_;
+    std::string current_;
+
+    static void run(std::shared_ptr<State> state, std::string path, ContentCoding coding, std::string cache_key,
+                    std::string cache_path);
+};
+
+// Compressed variants of served files, in a private temporary directory that
+// lives as long as the process. Keyed by path, size, mtime and coding, so a
+// changed file is compressed again; later receivers of an unchanged one get
+// the stored variant with sendfile(). Variants of a path's older versions
+// are deleted when a new one is claimed, and at most MAX_BYTES are kept, the
+// least recently used going first.
+class CompressionCache {
+public:
+    static CompressionCache& instance();
+    ~CompressionCache();
+
+    static const long long MAX_BYTES = 256LL * 1024 * 1024;
+
+    static std::string key(const std::string& path, const struct stat& st, ContentCoding coding);
+
+    // Path of the finished variant for `key`, if there is one.
+    bool find(const std::string& key, std::string& path);
+    // Reserves `key` for a new variant and returns the file to write it to;
+    // empty when it is already being built or no cache directory is usable.
+    std::string claim(const std::string& key);
+    // Ends a claim: the variant at `path` is complete (`ok`) or dropped.
+    void release(const std::string& key, const std::string& path, bool ok);
+
+private:
+    CompressionCache() = default;
+
+    struct Variant {
+        std::string path;
+        long long size;
+        std::list<std::string>::iterator use;
+    };
+
+    std::mutex mutex_;
+    std::string dir_;
+    bool dir_failed_ = false;
+    std::map<std::string, Variant> ready_;
+    std::list<std::string> uses_;  // keys of ready_, most recently used first
+    long long ready_bytes_ = 0;
+    std::map<std::string, std::string> building_;  // key -> file being written
+    unsigned long next_id_ = 0;
+
+    void drop(std::map<std::string, Variant>::iterator it);
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "dir_listing.h"
+#include "http_handlers.h"
+#include "file_transfer.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cerrno>
+
+// Rows generated per next(): about 100 bytes each.
+static const size_t LISTING_BATCH = 512;
+
+DirListing::DirListing(const std::string& dir, const std::string& path) : dir_(dir), path_(path) {}
+
+DirListing::~DirListing() {
+    if (handle_) closedir(handle_);
+}
+
+bool DirListing::open() {
+    handle_ = opendir(dir_.c_str());
+    return handle_ != nullptr;
+}
+
+bool DirListing::next(const char*& data, size_t& len) {
+    buf_.clear();
+    if (done_) {
+        data = buf_.data();
+        len = 0;
+        return true;
+    }
+    if (!handle_) return false;
+
+    if (!started_) {
+        buf_ = html_listing_head(path_);
+        started_ = true;
+    }
+    size_t rows = 0;
+    while (rows < LISTING_BATCH) {
+        errno = 0;
+        struct dirent* e = readdir(handle_);
+        if (!e) {
+            if (errno != 0) return false;
+            buf_ += html_listing_tail();
+            done_ = true;
+            break;
+        }
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+
+        struct stat st;
+        if (fstatat(dirfd(handle_), e->d_name, &st, 0) != 0) continue;
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) continue;
+        buf_ += html_listing_entry(e->d_name, S_ISDIR(st.st_mode), format_size(st.st_size), st.st_mtime);
+        ++rows;
+    }
+    data = buf_.data();
+    len = buf_.size();
+    return true;
+}
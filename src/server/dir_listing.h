@@ -0,0 +1,35 @@
+#ifndef DIR_LISTING_H
+#define DIR_LISTING_H
+
+#include <string>
+#include <ctime>
+#include <dirent.h>
+
+// HTML index of a shared directory, generated while it is sent. Entries are
+// read with readdir() and turned into rows a batch at a time, so a directory
+// of 100k entries neither holds up the first byte nor sits in memory; they
+// are listed in directory order.
+class DirListing {
+public:
+    // `path` is the directory's path in the share, "/" for its root.
+    DirListing(const std::string& dir, const std::string& path);
+    ~DirListing();
+
+    DirListing(const DirListing&) = delete;
+    DirListing& operator=(const DirListing&) = delete;
+
+    bool open();
+    const std::string& path() const { return path_; }
+    // Next piece of the page; `len` is 0 once it is complete.
+    bool next(const char*& data, size_t& len);
+
+private:
+    std::string dir_;
+    std::string path_;
+    DIR* handle_ = nullptr;
+    std::string buf_;
+    bool started_ = false;
+    bool done_ = false;
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "event_loop.h"
+#include "client_handler.h"
+#include "../utils/utils.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+
+EventLoop::EventLoop(int threads)
+    : thread_count_(threads > 0 ? threads : 1) {}
+
+EventLoop::~EventLoop() {
+    stop();
+    for (auto& w : workers_) {
+        if (w->thread.joinable()) w->thread.join();
+        if (w->epoll_fd >= 0) close(w->epoll_fd);
+        if (w->wake_fd >= 0) close(w->wake_fd);
+    }
+}
+
+bool EventLoop::start() {
+    for (int i = 0; i < thread_count_; ++i) {
+        std::unique_ptr<Worker> w(new Worker());
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->epoll_fd < 0 || w->wake_fd < 0) {
+            vlog("Event loop: failed to create epoll/eventfd");
+            if (w->epoll_fd >= 0) close(w->epoll_fd);
+            if (w->wake_fd >= 0) close(w->wake_fd);
+            return false;
+        }
+
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = w->wake_fd;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev);
+        workers_.push_back(std::move(w));
+    }
+
+    running_ = true;
+    for (auto& w : workers_) {
+        Worker* wp = w.get();
+        wp->thread = std::thread([this, wp]() { run(*wp); });
+    }
+
+    vlog("Event loop started with " + std::to_string(thread_count_) + " thread(s)");
+    return true;
+}
+
+void EventLoop::stop() {
+    if (!running_.exchange(false)) return;
+
+    for (auto& w : workers_) {
+        uint64_t one = 1;
+        ssize_t r = write(w->wake_fd, &one, sizeof(one));
+        (void)r;
+    }
+
+    // stop() may be called from a connection callback running on a worker;
+    // that worker exits on its own and is joined by the destructor.
+    for (auto& w : workers_) {
+        if (w->thread.joinable() && w->thread.get_id() != std::this_thread::get_id()) {
+            w->thread.join();
+        }
+    }
+}
+
+bool EventLoop::add(std::shared_ptr<ClientHandler> handler) {
+    if (!running_ || workers_.empty()) return false;
+
+    Worker& w = *workers_[next_worker_++ % workers_.size()];
+    int fd = handler->fd();
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.connections[fd] = handler;
+    }
+
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        vlog("Event loop: epoll_ctl ADD failed");
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.connections.erase(fd);
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::remove(Worker& w, int fd) {
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    std::shared_ptr<ClientHandler> handler;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        auto it = w.connections.find(fd);
+        if (it == w.connections.end()) return;
+        handler = std::move(it->second);
+        w.connections.erase(it);
+    }
+}
+
+void EventLoop::drive(Worker& w, const std::shared_ptr<ClientHandler>& handler) {
+    IoStatus st = handler->drive();
+    if (st == IoStatus::Done || st == IoStatus::Error) {
+        remove(w, handler->fd());
+        return;
+    }
+    std::chrono::steady_clock::time_point until;
+    if (handler->throttled(until)) w.timers.emplace(until, handler);
+    int wait_fd = handler->wait_fd();
+    if (wait_fd >= 0) watch(w, handler, wait_fd);
+}
+
+// Arms `fd` for one readiness event that drives `handler`. The registration
+// ends when the descriptor is closed; an entry left behind in waits is
+// replaced when the number is watched again.
+void EventLoop::watch(Worker& w, const std::shared_ptr<ClientHandler>& handler, int fd) {
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+        (errno != EEXIST || epoll_ctl(w.epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)) {
+        vlog("Event loop: epoll_ctl failed for a wait descriptor");
+        w.timers.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds(10), handler);
+        return;
+    }
+    w.waits[fd] = handler;
+}
+
+void EventLoop::run_timers(Worker& w) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<ClientHandler>> due;
+    while (!w.timers.empty() && w.timers.begin()->first <= now) {
+        if (auto handler = w.timers.begin()->second.lock()) due.push_back(std::move(handler));
+        w.timers.erase(w.timers.begin());
+    }
+    for (auto& h : due) {
+        if (h->fd() >= 0) drive(w, h);
+    }
+}
+
+void EventLoop::sweep(Worker& w) {
+    std::vector<std::shared_ptr<ClientHandler>> expired;
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        for (auto& kv : w.connections) {
+            if (kv.second->timed_out(now)) expired.push_back(kv.second);
+        }
+    }
+    for (auto& h : expired) remove(w, h->fd());
+    for (auto it = w.waits.begin(); it != w.waits.end();) {
+        it = it->second.expired() ? w.waits.erase(it) : std::next(it);
+    }
+}
+
+void EventLoop::run(Worker& w) {
+    const int max_events = 64;
+    struct epoll_event events[max_events];
+    auto last_sweep = std::chrono::steady_clock::now();
+
+    while (running_) {
+        int timeout = w.timers.empty() ? 100 : wait_timeout_ms(w.timers.begin()->first, 100);
+        int n = epoll_wait(w.epoll_fd, events, max_events, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            vlog("Event loop: epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n && running_; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == w.wake_fd) {
+                uint64_t v;
+                ssize_t r = read(w.wake_fd, &v, sizeof(v));
+                (void)r;
+                continue;
+            }
+
+            std::shared_ptr<ClientHandler> handler;
+            {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                auto it = w.connections.find(fd);
+                if (it != w.connections.end()) handler = it->second;
+            }
+            if (handler) {
+                drive(w, handler);
+                continue;
+            }
+            auto wait = w.waits.find(fd);
+            if (wait != w.waits.end()) {
+                handler = wait->second.lock();
+                w.waits.erase(wait);
+                if (handler && handler->fd() >= 0) drive(w, handler);
+            }
+        }
+        run_timers(w);
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_sweep >= std::chrono::milliseconds(100)) {
+            sweep(w);
+            last_sweep = now;
+        }
+    }
+
+    std::unordered_map<int, std::shared_ptr<ClientHandler>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        remaining.swap(w.connections);
+    }
+    for (auto& kv : remaining) epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, kv.first, nullptr);
+    w.timers.clear();
+    w.waits.clear();
+}
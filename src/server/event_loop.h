@@ -0,0 +1,57 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class ClientHandler;
+
+// Edge-triggered epoll reactor. Each worker thread owns an epoll instance and
+// the connections assigned to it, and drives their ClientHandler state machines
+// whenever the socket becomes readable or writable. A connection held back by
+// its rate limit gets no new readiness event, so it is driven again from a
+// timer when the limit allows. One waiting for its compressor is driven again
+// when the compressor's eventfd becomes readable.
+class EventLoop {
+public:
+    explicit EventLoop(int threads);
+    ~EventLoop();
+
+    bool start();
+    void stop();
+    bool add(std::shared_ptr<ClientHandler> handler);
+
+private:
+    struct Worker {
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::thread thread;
+        std::mutex mutex;
+        std::unordered_map<int, std::shared_ptr<ClientHandler>> connections;
+        // Throttled connections by when to drive them again; worker thread only.
+        std::multimap<std::chrono::steady_clock::time_point, std::weak_ptr<ClientHandler>> timers;
+        // Connections by the descriptor they wait on besides their socket;
+        // worker thread only.
+        std::unordered_map<int, std::weak_ptr<ClientHandler>> waits;
+    };
+
+    int thread_count_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> running_{false};
+    std::atomic<size_t> next_worker_{0};
+
+    void run(Worker& w);
+    void drive(Worker& w, const std::shared_ptr<ClientHandler>& handler);
+    void remove(Worker& w, int fd);
+    void sweep(Worker& w);
+    void run_timers(Worker& w);
+    void watch(Worker& w, const std::shared_ptr<ClientHandler>& handler, int fd);
+};
+
+#endif
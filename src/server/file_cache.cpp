@@ -0,0 +1,72 @@
+#include "file_cache.h"
+#include "file_transfer.h"
+#include "compression.h"
+#include "../utils/file_utils.h"
+#include "../utils/server_utils.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+
+CachedFile::~CachedFile() {
+    if (fd >= 0) close(fd);
+}
+
+static bool unchanged(const struct statx& sx, const struct stat& st) {
+    return sx.stx_ino == st.st_ino && makedev(sx.stx_dev_major, sx.stx_dev_minor) == st.st_dev &&
+           (off_t)sx.stx_size == st.st_size &&
+           sx.stx_mtime.tv_sec == st.st_mtim.tv_sec && sx.stx_mtime.tv_nsec == st.st_mtim.tv_nsec &&
+           sx.stx_ctime.tv_sec == st.st_ctim.tv_sec && sx.stx_ctime.tv_nsec == st.st_ctim.tv_nsec;
+}
+
+std::shared_ptr<const CachedFile> FileCache::get(const std::string& path) {
+    struct statx sx;
+    bool found = statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT,
+                       STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &sx) == 0 &&
+                 S_ISREG(sx.stx_mode);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = files_.find(path);
+        if (it != files_.end()) {
+            if (found && unchanged(sx, it->second.file->st)) {
+                uses_.splice(uses_.begin(), uses_, it->second.use);
+                return it->second.file;
+            }
+            uses_.erase(it->second.use);
+            files_.erase(it);
+        }
+    }
+    if (!found) return nullptr;
+
+    // Opened and sampled without the lock; a concurrent load of the same
+    // file just replaces this one.
+    auto file = load(path);
+    if (!file) return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+        uses_.erase(it->second.use);
+        files_.erase(it);
+    }
+    uses_.push_front(path);
+    files_[path] = Slot{file, uses_.begin()};
+    while (files_.size() > MAX_FILES) {
+        files_.erase(uses_.back());
+        uses_.pop_back();
+    }
+    return file;
+}
+
+std::shared_ptr<const CachedFile> FileCache::load(const std::string& path) {
+    auto file = std::make_shared<CachedFile>();
+    file->path = path;
+    file->fd = ::open(path.c_str(), O_RDONLY);
+    if (file->fd < 0 || fstat(file->fd, &file->st) != 0 || !S_ISREG(file->st.st_mode)) return nullptr;
+
+    file->mime = mime_type(path);
+    file->etag = file_etag(file->st);
+    file->last_modified = http_date(file->st.st_mtime);
+    file->headers = FileSender::entity_headers(file->st.st_size, file->etag, file->last_modified);
+    file->compressible = compress_ && worth_compressing(path, file->st);
+    return file;
+}
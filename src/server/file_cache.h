@@ -0,0 +1,62 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <sys/stat.h>
+
+// A served file held open, with what its responses need: the stat result,
+// MIME type, validators and the entity headers of a full 200 response
+// (Content-Length through Cache-Control). Shared by all requests for the
+// file while it is unchanged; the descriptor is closed with the last of them.
+struct CachedFile {
+    CachedFile() = default;
+    ~CachedFile();
+
+    CachedFile(const CachedFile&) = delete;
+    CachedFile& operator=(const CachedFile&) = delete;
+
+    std::string path;
+    int fd = -1;
+    struct stat st;
+    std::string mime;
+    std::string etag;
+    std::string last_modified;
+    std::string headers;
+    // worth_compressing(), when the server compresses at all.
+    bool compressible = false;
+};
+
+// The files one server sends, by path. get() compares the cached entry with
+// a statx() of the path, one syscall instead of stat + open + fstat; while
+// inode, size, mtime and ctime match, the entry is reused, otherwise it is
+// rebuilt. At most MAX_FILES descriptors are kept, the least recently used
+// going first.
+class FileCache {
+public:
+    explicit FileCache(bool compress) : compress_(compress) {}
+
+    static const size_t MAX_FILES = 256;
+
+    // The regular file at `path`; null when there is none or it cannot be
+    // opened.
+    std::shared_ptr<const CachedFile> get(const std::string& path);
+
+private:
+    struct Slot {
+        std::shared_ptr<const CachedFile> file;
+        std::list<std::string>::iterator use;
+    };
+
+    bool compress_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Slot> files_;
+    std::list<std::string> uses_;  // most recently used first
+
+    std::shared_ptr<const CachedFile> load(const std::string& path);
+};
+
+#endif
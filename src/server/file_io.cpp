@@ -0,0 +1,431 @@
+#include "file_io.h"
+#include "../utils/utils.h"
+#include "../utils/file_utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+
+static const unsigned URING_ENTRIES = 8;
+static const unsigned URING_BUFFERS = 4;
+static const size_t URING_BUFFER_SIZE = 256 * 1024;
+
+// SyncMode::Periodic starts writeback of every window of this size and waits
+// for the previous one, so dirty pages never pile up for the final sync.
+static const off_t SYNC_WINDOW = 8 * 1024 * 1024;
+
+// Free names to try when publishing a file that must not replace another,
+// in case each one is taken by a concurrent upload first.
+static const int PUBLISH_ATTEMPTS = 16;
+
+bool parse_sync_mode(const std::string& s, SyncMode& out) {
+    if (s == "none") out = SyncMode::None;
+    else if (s == "end") out = SyncMode::End;
+    else if (s == "periodic") out = SyncMode::Periodic;
+    else return false;
+    return true;
+}
+
+FileSink::~FileSink() {
+    if (fd_ >= 0) discard();
+}
+
+bool FileSink::open(const std::string& path, bool use_uring, SyncMode sync, bool replace) {
+    path_ = path;
+    sync_ = sync;
+    replace_ = replace;
+
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    if (dir.empty()) dir = ".";
+    fd_ = ::open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (fd_ < 0) {
+        vlog(std::string("O_TMPFILE unavailable (") + strerror(errno) + "), using a temporary name");
+        temp_path_ = path + ".tmp." + random_token(8);
+        fd_ = ::open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd_ < 0) return false;
+    }
+
+    if (use_uring) {
+        ring_.reset(new Uring());
+        if (ring_->init(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE)) {
+            busy_.assign(ring_->buffer_count(), false);
+        } else {
+            vlog("io_uring setup failed, writing upload with sync I/O");
+            ring_.reset();
+        }
+    }
+    return true;
+}
+
+bool FileSink::reserve(long long size) {
+    if (size <= 0) return true;
+    // KEEP_SIZE: the file still grows only as data arrives.
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0) return true;
+    if (errno == ENOSPC || errno == EFBIG || errno == EDQUOT) return false;
+    vlog(std::string("fallocate not supported here: ") + strerror(errno));
+    return true;
+}
+
+void FileSink::write_back() {
+    if (sync_ != SyncMode::Periodic) return;
+    while (offset_ - synced_ >= SYNC_WINDOW) {
+        sync_file_range(fd_, synced_, SYNC_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (synced_ >= SYNC_WINDOW) {
+            sync_file_range(fd_, synced_ - SYNC_WINDOW, SYNC_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+        synced_ += SYNC_WINDOW;
+    }
+}
+
+bool FileSink::write(const char* data, size_t len) {
+    if (failed_ || fd_ < 0) return false;
+
+    if (!ring_) {
+        while (len > 0) {
+            ssize_t w = ::write(fd_, data, len);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                vlog(std::string("File write failed: ") + strerror(errno));
+                failed_ = true;
+                return false;
+            }
+            data += w;
+            len -= (size_t)w;
+            offset_ += w;
+        }
+        write_back();
+        return true;
+    }
+
+    while (len > 0) {
+        if (cur_ < 0) {
+            auto it = std::find(busy_.begin(), busy_.end(), false);
+            while (it == busy_.end()) {
+                if (!reap(1)) return false;
+                it = std::find(busy_.begin(), busy_.end(), false);
+            }
+            cur_ = (int)(it - busy_.begin());
+            cur_len_ = 0;
+        }
+
+        size_t n = std::min(len, ring_->buffer_size() - cur_len_);
+        memcpy(ring_->buffer(cur_) + cur_len_, data, n);
+        cur_len_ += n;
+        data += n;
+        len -= n;
+
+        if (cur_len_ == ring_->buffer_size() && !queue_current()) return false;
+    }
+    return true;
+}
+
+bool FileSink::splice_from(int pipe_fd, size_t len) {
+    if (failed_ || fd_ < 0 || ring_) return false;
+
+    while (len > 0) {
+        ssize_t w = ::splice(pipe_fd, nullptr, fd_, nullptr, len, SPLICE_F_MOVE);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            vlog(std::string("File write failed: ") + (w < 0 ? strerror(errno) : "pipe drained"));
+            failed_ = true;
+            return false;
+        }
+        len -= (size_t)w;
+        offset_ += w;
+    }
+    write_back();
+    return true;
+}
+
+bool FileSink::write_at(off_t offset, const char* data, size_t len) {
+    if (fd_ < 0) return false;
+
+    while (len > 0) {
+        ssize_t w = ::pwrite(fd_, data, len, offset);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            vlog(std::string("File write failed: ") + strerror(errno));
+            return false;
+        }
+        data += w;
+        len -= (size_t)w;
+        offset += w;
+    }
+    return true;
+}
+
+bool FileSink::splice_at(int pipe_fd, off_t offset, size_t len) {
+    if (fd_ < 0) return false;
+
+    while (len > 0) {
+        loff_t off = offset;
+        ssize_t w = ::splice(pipe_fd, nullptr, fd_, &off, len, SPLICE_F_MOVE);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            vlog(std::string("File write failed: ") + (w < 0 ? strerror(errno) : "pipe drained"));
+            return false;
+        }
+        len -= (size_t)w;
+        offset += w;
+    }
+    return true;
+}
+
+bool FileSink::queue_current() {
+    if (cur_ < 0 || cur_len_ == 0) return true;
+
+    if (!ring_->prep_write(fd_, (unsigned)cur_, 0, cur_len_, offset_, ((uint64_t)cur_ << 32) | cur_len_)) {
+        failed_ = true;
+        return false;
+    }
+    busy_[cur_] = true;
+    offset_ += cur_len_;
+    cur_ = -1;
+    cur_len_ = 0;
+
+    if (!ring_->submit(0)) {
+        failed_ = true;
+        return false;
+    }
+    if (!reap(0)) return false;
+    write_back();
+    return true;
+}
+
+bool FileSink::reap(unsigned wait_nr) {
+    if (wait_nr > 0 && !ring_->submit(wait_nr)) {
+        failed_ = true;
+        return false;
+    }
+
+    uint64_t tag;
+    int res;
+    while (ring_->pop(tag, res)) {
+        unsigned idx = (unsigned)(tag >> 32);
+        unsigned expected = (unsigned)(tag & 0xffffffffu);
+        if (idx < busy_.size()) busy_[idx] = false;
+        if (res < 0) {
+            vlog(std::string("File write failed: ") + strerror(-res));
+            failed_ = true;
+        } else if ((unsigned)res != expected) {
+            vlog("File write failed: short write");
+            failed_ = true;
+        }
+    }
+    return !failed_;
+}
+
+bool FileSink::flush() {
+    if (ring_) {
+        if (!failed_) queue_current();
+        while (ring_->in_flight() > 0) {
+            if (!ring_->submit(1)) break;
+            reap(0);
+        }
+        ring_.reset();
+    }
+    return !failed_;
+}
+
+// Gives the file the name `path` unless that is taken (errno EEXIST).
+bool FileSink::link_new(const std::string& path) {
+    if (temp_path_.empty()) {
+        std::string proc = "/proc/self/fd/" + std::to_string(fd_);
+        return linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0;
+    }
+    if (renameat2(AT_FDCWD, temp_path_.c_str(), AT_FDCWD, path.c_str(), RENAME_NOREPLACE) == 0) {
+        temp_path_.clear();
+        return true;
+    }
+    if (errno != EINVAL) return false;
+    // The filesystem cannot rename without replacing; a hard link can't
+    // replace either.
+    if (link(temp_path_.c_str(), path.c_str()) != 0) return false;
+    unlink(temp_path_.c_str());
+    temp_path_.clear();
+    return true;
+}
+
+bool FileSink::publish() {
+    std::string wanted = path_;
+    for (int i = 0; i < PUBLISH_ATTEMPTS; ++i) {
+        if (link_new(path_)) return true;
+        if (errno != EEXIST) return false;
+        if (replace_) break;
+        // Someone else took the name since open(); take the next free one.
+        path_ = unique_path(wanted);
+    }
+    if (!replace_) return false;
+
+    if (!temp_path_.empty()) return rename(temp_path_.c_str(), path_.c_str()) == 0;
+    // linkat() does not replace; link under a temporary name and rename over.
+    std::string proc = "/proc/self/fd/" + std::to_string(fd_);
+    std::string tmp = path_ + ".tmp." + random_token(8);
+    if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, tmp.c_str(), AT_SYMLINK_FOLLOW) != 0) return false;
+    if (rename(tmp.c_str(), path_.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FileSink::commit() {
+    if (fd_ < 0) return false;
+
+    bool ok = flush();
+    if (ok && sync_ != SyncMode::None && fdatasync(fd_) != 0) {
+        vlog(std::string("fdatasync failed: ") + strerror(errno));
+        ok = false;
+    }
+    if (ok && !publish()) {
+        vlog(std::string("Cannot publish ") + path_ + ": " + strerror(errno));
+        ok = false;
+    }
+    if (::close(fd_) != 0) ok = false;
+    fd_ = -1;
+
+    if (!ok) {
+        if (!temp_path_.empty()) unlink(temp_path_.c_str());
+        failed_ = true;
+        return false;
+    }
+
+    if (sync_ != SyncMode::None) {
+        // Make the new directory entry durable too.
+        std::string dir = std::filesystem::path(path_).parent_path().string();
+        int dfd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            fsync(dfd);
+            ::close(dfd);
+        }
+    }
+    return true;
+}
+
+void FileSink::discard() {
+    if (fd_ < 0) return;
+    flush();
+    ::close(fd_);
+    fd_ = -1;
+    if (!temp_path_.empty()) unlink(temp_path_.c_str());
+    failed_ = true;
+}
+
+FileSource::~FileSource() {
+    drain();
+}
+
+void FileSource::drain() {
+    if (!ring_) return;
+
+    while (ring_->in_flight() > 0) {
+        if (!ring_->submit(1)) break;
+        uint64_t tag;
+        int res;
+        while (ring_->pop(tag, res)) {}
+    }
+    slots_.assign(ring_->buffer_count(), Slot());
+    current_ = -1;
+}
+
+void FileSource::seek(off_t offset, off_t length) {
+    drain();
+    read_offset_ = offset;
+    next_offset_ = offset;
+    end_ = offset + length;
+}
+
+bool FileSource::open(int fd, bool use_uring) {
+    fd_ = fd;
+
+    if (use_uring) {
+        ring_.reset(new Uring());
+        if (ring_->init(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE)) {
+            slots_.assign(ring_->buffer_count(), Slot());
+            return true;
+        }
+        vlog("io_uring setup failed, reading file with sync I/O");
+        ring_.reset();
+    }
+
+    buf_.resize(64 * 1024);
+    return true;
+}
+
+bool FileSource::issue_reads() {
+    for (unsigned i = 0; i < slots_.size() && read_offset_ < end_; ++i) {
+        Slot& s = slots_[i];
+        if (s.pending || s.ready || (int)i == current_) continue;
+
+        size_t len = (size_t)std::min<off_t>((off_t)ring_->buffer_size(), end_ - read_offset_);
+        if (!ring_->prep_read(fd_, i, len, read_offset_, i)) return false;
+        s.offset = read_offset_;
+        s.length = len;
+        s.pending = true;
+        read_offset_ += (off_t)len;
+    }
+    return ring_->submit(0);
+}
+
+bool FileSource::next(const char*& data, size_t& len) {
+    len = 0;
+    if (!ring_) {
+        if (next_offset_ >= end_) return true;
+        size_t want = (size_t)std::min<off_t>((off_t)buf_.size(), end_ - next_offset_);
+        while (true) {
+            ssize_t r = pread(fd_, buf_.data(), want, next_offset_);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            data = buf_.data();
+            len = (size_t)r;
+            next_offset_ += r;
+            return true;
+        }
+    }
+
+    if (current_ >= 0) {
+        slots_[current_].ready = false;
+        current_ = -1;
+    }
+    if (next_offset_ >= end_) return true;
+    if (!issue_reads()) return false;
+
+    int idx = -1;
+    for (unsigned i = 0; i < slots_.size(); ++i) {
+        if ((slots_[i].pending || slots_[i].ready) && slots_[i].offset == next_offset_) {
+            idx = (int)i;
+            break;
+        }
+    }
+    if (idx < 0) return false;
+
+    while (!slots_[idx].ready) {
+        if (!ring_->submit(1)) return false;
+        uint64_t tag;
+        int res;
+        while (ring_->pop(tag, res)) {
+            Slot& s = slots_[(size_t)tag];
+            s.pending = false;
+            s.ready = true;
+            s.result = res;
+        }
+    }
+
+    Slot& s = slots_[idx];
+    if (s.result <= 0) return false;
+
+    data = ring_->buffer((unsigned)idx);
+    len = (size_t)s.result;
+    next_offset_ += s.result;
+    if (len < s.length) {
+        // A short read is not an error: the reads queued behind it start
+        // past a gap, so they are dropped and reading resumes after it.
+        drain();
+        read_offset_ = next_offset_;
+    }
+    current_ = idx;
+    return true;
+}
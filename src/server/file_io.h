@@ -0,0 +1,123 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <sys/types.h>
+#include "uring.h"
+
+// Disk side of a transfer. Both classes use plain read/write syscalls by
+// default and an io_uring ring with registered buffers when asked to; if the
+// ring cannot be set up they quietly fall back to the plain path.
+
+// When received data is forced to disk.
+enum class SyncMode {
+    None,      // left to the kernel's writeback
+    End,       // fdatasync() before the file is published
+    Periodic   // writeback started every few MB with sync_file_range(), then as End
+};
+
+// Parses "none", "end" or "periodic".
+bool parse_sync_mode(const std::string& s, SyncMode& out);
+
+// Sequential writer for received file data. The file is created unnamed
+// (O_TMPFILE) in the directory of `path` and only appears under that name on
+// commit(), so an interrupted upload leaves nothing behind. Filesystems
+// without O_TMPFILE get a temporary name that is renamed instead.
+class FileSink {
+public:
+    FileSink() = default;
+    ~FileSink();
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    // An existing file at `path` is only replaced with `replace`; otherwise
+    // commit() takes the next free name next to it (see path()).
+    bool open(const std::string& path, bool use_uring, SyncMode sync = SyncMode::None, bool replace = false);
+    // Allocates disk space for `size` bytes up front. False with errno set
+    // (ENOSPC, EFBIG, EDQUOT) when it does not fit.
+    bool reserve(long long size);
+    bool write(const char* data, size_t len);
+    // Appends `len` bytes waiting in the pipe `pipe_fd` with splice(). Only
+    // for sinks opened without io_uring.
+    bool splice_from(int pipe_fd, size_t len);
+    // Positional writes for data that arrives out of order. They leave the
+    // sequential position alone and may run concurrently with each other,
+    // but not with commit() or discard().
+    bool write_at(off_t offset, const char* data, size_t len);
+    bool splice_at(int pipe_fd, off_t offset, size_t len);
+    // Completes the writes, syncs as configured and publishes the file.
+    bool commit();
+    // Drops the file.
+    void discard();
+    bool good() const { return !failed_; }
+    // Name of the file; after commit(), the one it was published under.
+    const std::string& path() const { return path_; }
+    const char* engine_name() const { return ring_ ? "io_uring" : "sync"; }
+
+private:
+    int fd_ = -1;
+    off_t offset_ = 0;
+    bool failed_ = false;
+    std::string path_;
+    std::string temp_path_;  // empty for an O_TMPFILE file
+    bool replace_ = false;
+    SyncMode sync_ = SyncMode::None;
+    off_t synced_ = 0;
+
+    std::unique_ptr<Uring> ring_;
+    std::vector<bool> busy_;
+    int cur_ = -1;
+    size_t cur_len_ = 0;
+
+    bool flush();
+    void write_back();
+    bool publish();
+    bool link_new(const std::string& path);
+    bool queue_current();
+    bool reap(unsigned wait_nr);
+};
+
+// Sequential reader with read-ahead, used where the data has to pass through
+// user space anyway (TLS).
+class FileSource {
+public:
+    FileSource() = default;
+    ~FileSource();
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    bool open(int fd, bool use_uring);
+    // Restarts reading at `offset`; next() then walks [offset, offset + length).
+    void seek(off_t offset, off_t length);
+    // Returns the next chunk in file order; len == 0 means end of range.
+    bool next(const char*& data, size_t& len);
+    const char* engine_name() const { return ring_ ? "io_uring" : "sync"; }
+
+private:
+    int fd_ = -1;
+    off_t read_offset_ = 0;
+    off_t end_ = 0;
+    off_t next_offset_ = 0;
+
+    std::vector<char> buf_;
+
+    struct Slot {
+        off_t offset = 0;
+        size_t length = 0;
+        int result = 0;
+        bool pending = false;
+        bool ready = false;
+    };
+    std::unique_ptr<Uring> ring_;
+    std::vector<Slot> slots_;
+    int current_ = -1;
+
+    bool issue_reads();
+    void drain();
+};
+
+#endif
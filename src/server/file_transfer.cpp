@@ -1,7 +1,6 @@
 #include "file_transfer.h"
 #include "../utils/utils.h"
 #include "../utils/file_utils.h"
-#include <sys/sendfile.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <fstream>
@@ -13,9 +12,27 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <cstring>
-#include <poll.h>
+#include <algorithm>
+#include <filesystem>
+#include <sys/statvfs.h>
 #include <openssl/ssl.h>
 
+// Pipe capacity requested for splice() uploads; one splice moves at most this much.
+static const size_t SPLICE_PIPE_SIZE = 1024 * 1024;
+
+// Fixed parts of the response headers; a response only fills in its
+// lengths, type and names. Downloads may be stored but are checked with the
+// server before reuse, which is a 304 as long as the file is unchanged.
+static const char HEAD_200[] = "HTTP/1.1 200 OK\r\nContent-Type: ";
+static const char HEAD_206[] = "HTTP/1.1 206 Partial Content\r\nContent-Type: ";
+static const char HEAD_304[] = "HTTP/1.1 304 Not Modified\r\n";
+static const char HEAD_416[] = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nContent-Range: bytes */";
+static const char CACHE_CONTROL[] = "Cache-Control: private, no-cache\r\n";
+static const char ACCEPT_RANGES[] = "Accept-Ranges: bytes\r\n";
+
+// Upper bound for the headers of a multipart part (Content-Disposition etc.).
+static const size_t MAX_PART_HEADERS_SIZE = 64 * 1024;
+
 std::string format_size(long long bytes) {
     const char* units[] = {"B", "KB", "MB", "GB", "TB"};
     int unit_index = 0;
@@ -36,588 +53,874 @@ int calculate_percentage(long long current, long long total) {
     return static_cast<int>((current * 100) / total);
 }
 
-bool stream_file(int fd, const std::string& filepath, const std::string& content_type,
-                const std::string& filename, bool as_attachment,
-                std::atomic<bool>* interrupted, int timeout_seconds, SSL* ssl) {
-    struct stat st;
-    if (::stat(filepath.c_str(), &st) != 0) {
-        vlog("stream_file: stat failed for " + filepath);
-        return false;
+
+static void report_progress(const char* verb, long long current, long long total,
+                            std::chrono::steady_clock::time_point& last_report_time,
+                            int& last_reported_percent, long long& last_reported_bytes,
+                            long long limit = 0) {
+    if (!is_verbose()) return;
+
+    auto report_time = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(report_time - last_report_time);
+    int current_percent = calculate_percentage(current, total);
+
+    bool should_log = false;
+    if (current_percent >= 100) {
+        should_log = true;
+    } else if (elapsed.count() >= 2000) {
+        should_log = true;
+    } else if (current_percent != last_reported_percent && current_percent % 10 == 0) {
+        should_log = true;
     }
 
-    off_t file_size = st.st_size;
-    off_t total_sent = 0;
+    if (should_log) {
+        std::string line = std::string(verb) + ": " + std::to_string(current_percent) + "% - " +
+                           format_size(current) + " / " + format_size(total);
+        if (elapsed.count() > 0) {
+            line += " (" + format_size((current - last_reported_bytes) * 1000 / elapsed.count()) + "/s";
+            if (limit > 0) line += ", limit " + format_size(limit) + "/s";
+            line += ")";
+        }
+        vlog(line);
+        last_report_time = report_time;
+        last_reported_percent = current_percent;
+        last_reported_bytes = current;
+    }
+}
 
-    auto last_report_time = std::chrono::steady_clock::now();
-    auto transfer_start_time = std::chrono::steady_clock::now();
+FileSender::FileSender(int fd, SSL* ssl, const std::string& filepath, const std::string& content_type,
+                       const std::string& filename, bool as_attachment, bool use_uring)
+    : fd_(fd), ssl_(ssl), filepath_(filepath), content_type_(content_type),
+      filename_(filename), as_attachment_(as_attachment), use_uring_(use_uring)
+{
+    last_progress_time_ = std::chrono::steady_clock::now();
+    last_report_time_ = last_progress_time_;
+}
 
-    auto last_progress_time = transfer_start_time;
-    long long last_sent_bytes = 0;
+FileSender::FileSender(int fd, SSL* ssl, std::shared_ptr<ZipPlan> archive)
+    : fd_(fd), ssl_(ssl), content_type_("application/zip"), filename_(archive->name()),
+      as_attachment_(true), use_uring_(false), archive_(std::move(archive))
+{
+    last_progress_time_ = std::chrono::steady_clock::now();
+    last_report_time_ = last_progress_time_;
+}
 
-    int last_reported_percent = -1;
+FileSender::FileSender(int fd, SSL* ssl, std::unique_ptr<DirListing> listing)
+    : fd_(fd), ssl_(ssl), content_type_("text/html; charset=utf-8"), filename_(listing->path()),
+      as_attachment_(false), use_uring_(false), listing_(std::move(listing))
+{
+    last_progress_time_ = std::chrono::steady_clock::now();
+    last_report_time_ = last_progress_time_;
+}
 
+FileSender::~FileSender() {
+    if (file_fd_ >= 0 && owns_fd_) close(file_fd_);
+}
 
-    vlog("Starting file send: " + filename + " (" + format_size(file_size) + ")");
+std::string FileSender::entity_headers(off_t size, const std::string& etag, const std::string& last_modified) {
+    std::string h;
+    h.reserve(160);
+    h.append("Content-Length: ").append(std::to_string(size)).append("\r\n").append(ACCEPT_RANGES);
+    h.append("ETag: ").append(etag).append("\r\nLast-Modified: ").append(last_modified).append("\r\n");
+    h.append(CACHE_CONTROL);
+    return h;
+}
 
-    std::ostringstream header_stream;
-    header_stream << "HTTP/1.1 200 OK\r\n"
-                  << "Content-Type: " + content_type + "\r\n"
-                  << "Content-Length: " << file_size << "\r\n";
+void FileSender::set_range(std::string_view range, std::string_view if_range) {
+    range_ = range;
+    if_range_ = if_range;
+}
 
-    if (as_attachment && !filename.empty()) {
-        header_stream << "Content-Disposition: attachment; filename=\"" << filename << "\"\r\n";
+bool FileSender::set_coding(ContentCoding coding) {
+    struct stat st;
+    if (coding == ContentCoding::Identity || archive_ || listing_ || !range_.empty()) return true;
+    if (file_) {
+        st = file_->st;
+    } else if (::stat(filepath_.c_str(), &st) != 0) {
+        return true;
     }
-    header_stream << "\r\n";
+    coding_ = coding;
+    return CompressionCache::instance().find(CompressionCache::key(filepath_, st, coding), coded_path_);
+}
 
-    std::string headers = header_stream.str();
+void FileSender::set_conditional(std::string_view if_none_match, std::string_view if_modified_since) {
+    if_none_match_ = if_none_match;
+    if_modified_since_ = if_modified_since;
+}
 
-    auto header_start_time = std::chrono::steady_clock::now();
-    ssize_t header_sent = 0;
-    while (header_sent < (ssize_t)headers.size()) {
-        if (interrupted && *interrupted) {
-            vlog("Header send interrupted by user");
-            return false;
-        }
+void FileSender::add_header(const std::string& name, const std::string& value) {
+    extra_headers_ += name + ": " + value + "\r\n";
+}
 
-        auto current_time = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(current_time - header_start_time);
-        if (elapsed.count() > timeout_seconds) {
-            vlog("Header send timeout");
-            return false;
-        }
+void FileSender::add_file_segment(off_t offset, off_t length) {
+    Segment seg;
+    seg.offset = offset;
+    seg.length = length;
+    segments_.push_back(seg);
+    if (length > 0) body_size_ += length;
+}
 
-        if (ssl) {
-            int r = SSL_write(ssl, headers.c_str() + header_sent, headers.size() - header_sent);
-            if (r > 0) {
-                header_sent += r;
-                continue;
-            } else {
-                int err = SSL_get_error(ssl, r);
-                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                    usleep(10000);
-                    continue;
-                }
-                vlog("stream_file: Header SSL_write failed");
-                return false;
-            }
-        }
+bool FileSender::body_seek(off_t offset, off_t length) {
+    if (listing_) return offset == 0;
+    if (stream_) return stream_->seek(offset, length);
+    source_.seek(offset, length);
+    return true;
+}
 
-        ssize_t sent = ::send(fd, headers.c_str() + header_sent, headers.size() - header_sent, MSG_NOSIGNAL);
-        if (sent <= 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(10000);
-                continue;
-            }
-            vlog("stream_file: Header send failed");
+bool FileSender::body_next(const char*& data, size_t& len, bool& ready) {
+    ready = true;
+    if (encoded_) {
+        CompressStream::Chunk c = encoded_->try_next(data, len);
+        ready = c != CompressStream::Chunk::NotReady;
+        return c != CompressStream::Chunk::Failed;
+    }
+    if (listing_) return listing_->next(data, len);
+    return stream_ ? stream_->next(data, len) : source_.next(data, len);
+}
+
+bool FileSender::open() {
+    time_t mtime;
+    off_t coded_size = -1;
+    struct stat st;
+    std::string etag;
+    if (archive_) {
+        // A deflated archive has no size until it is done. It gets no entity
+        // tag: its bytes are not known before it is generated.
+        file_size_ = archive_->size();
+        mtime = archive_->mtime();
+    } else if (listing_) {
+        // Entries change size without the directory changing: no validators.
+        file_size_ = -1;
+        mtime = 0;
+    } else if (file_) {
+        st = file_->st;
+        file_size_ = st.st_size;
+        mtime = st.st_mtime;
+        etag = coding_ == ContentCoding::Identity ? file_->etag : file_etag(st, coding_name(coding_));
+    } else {
+        if (::stat(filepath_.c_str(), &st) != 0) {
+            vlog("stream_file: stat failed for " + filepath_);
             return false;
         }
-        header_sent += sent;
+        file_size_ = st.st_size;
+        mtime = st.st_mtime;
+        etag = file_etag(st, coding_name(coding_));
+    }
+    std::string last_modified = file_ ? file_->last_modified : http_date(mtime);
+
+    std::string head;
+    head.reserve(512);
+    auto add_validators = [&]() {
+        if (!etag.empty()) head.append("ETag: ").append(etag).append("\r\n");
+        if (mtime) head.append("Last-Modified: ").append(last_modified).append("\r\n");
+        head.append(CACHE_CONTROL);
+    };
+    if (not_modified(if_none_match_, if_modified_since_, etag, mtime)) {
+        vlog("Not modified: " + (filename_.empty() ? filepath_ : filename_));
+        head.append(HEAD_304);
+        add_validators();
+        head.append(extra_headers_).append("\r\n");
+        segments_.push_back(Segment{head, 0, 0});
+        last_progress_time_ = std::chrono::steady_clock::now();
+        return true;
     }
 
-    int file_fd = open(filepath.c_str(), O_RDONLY);
-    if (file_fd >= 0) {
-        off_t offset = 0;
-
-        while (total_sent < file_size) {
-            if (interrupted && *interrupted) {
-                vlog("File send interrupted by user");
-                close(file_fd);
-                return false;
-            }
-
-            auto current_time = std::chrono::steady_clock::now();
-            if (total_sent > last_sent_bytes) {
-                last_progress_time = current_time;
-                last_sent_bytes = total_sent;
-            }
-            auto inactivity_elapsed = std::chrono::duration_cast<std::chrono::seconds>(current_time - last_progress_time);
-            if (inactivity_elapsed.count() > timeout_seconds) {
-                vlog("File send timeout (no progress for " + std::to_string(inactivity_elapsed.count()) + "s)");
-                close(file_fd);
+    if (archive_) {
+        // Generated on the fly while it is sent.
+        stream_.reset(new ZipStream(archive_));
+    } else if (!listing_) {
+        if (file_) {
+            file_fd_ = file_->fd;
+            owns_fd_ = false;
+        } else {
+            file_fd_ = ::open(filepath_.c_str(), O_RDONLY);
+            if (file_fd_ < 0) {
+                vlog("stream_file: Failed to open file");
                 return false;
             }
+        }
 
-            auto op_start_time = std::chrono::steady_clock::now();
-            bool op_completed = false;
-
-            if (ssl) {
-                const size_t bufsize = 64 * 1024;
-                std::vector<char> buf(bufsize);
-                ssize_t rr = pread(file_fd, buf.data(), bufsize, offset);
-                if (rr < 0) {
-                    if (errno == EINTR) continue;
-                    vlog("stream_file: read failed");
-                    close(file_fd);
-                    return false;
-                }
-                ssize_t to_send = rr;
-                ssize_t sent_chunk = 0;
-                while (sent_chunk < to_send) {
-                    if (interrupted && *interrupted) {
-                        vlog("File send interrupted by user");
-                        close(file_fd);
-                        return false;
-                    }
-                    int r = SSL_write(ssl, buf.data() + sent_chunk, to_send - sent_chunk);
-                    if (r > 0) {
-                        sent_chunk += r;
-                        total_sent += r;
-                        offset += r;
-                        op_completed = true;
-                    } else {
-                        int err = SSL_get_error(ssl, r);
-                        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                            usleep(10000);
-                            continue;
-                        }
-                        vlog("stream_file: SSL_write failed");
-                        close(file_fd);
-                        return false;
-                    }
-                }
+        if (coding_ != ContentCoding::Identity) {
+            std::string key = CompressionCache::key(filepath_, st, coding_);
+            struct stat cst;
+            int cached_fd = coded_path_.empty() ? -1 : ::open(coded_path_.c_str(), O_RDONLY);
+            if (cached_fd >= 0 && fstat(cached_fd, &cst) == 0) {
+                if (owns_fd_) ::close(file_fd_);
+                file_fd_ = cached_fd;
+                owns_fd_ = true;
+                coded_size = cst.st_size;
+                vlog("Serving cached " + std::string(coding_name(coding_)) + " copy of " + filepath_);
             } else {
-
-                ssize_t result = sendfile(fd, file_fd, &offset, file_size - total_sent);
-
-                if (result > 0) {
-                    total_sent += result;
-                    last_progress_time = std::chrono::steady_clock::now();
-                    last_sent_bytes = total_sent;
-                    op_completed = true;
-                } else if (result == 0) {
-                    if (total_sent >= file_size) {
-                        op_completed = true;
-                    } else {
-                        vlog("sendfile returned 0 but file not completely sent");
-                        close(file_fd);
-                        return false;
-                    }
-                } else {
-                    if (errno == EINTR) continue;
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        usleep(10000);
-                        continue;
-                    }
-                    vlog("stream_file: sendfile failed");
-                    close(file_fd);
-                    return false;
-                }
-
-            }
-
-            auto report_time = std::chrono::steady_clock::now();
-            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(report_time - last_report_time);
-            int current_percent = calculate_percentage(total_sent, file_size);
-
-            bool should_log = false;
-            if (current_percent >= 100) {
-                should_log = true;
-            } else if (elapsed.count() >= 2) {
-                should_log = true;
-            } else if (current_percent != last_reported_percent && current_percent % 10 == 0) {
-                should_log = true;
-            }
-
-            if (should_log && is_verbose()) {
-                vlog("Send: " + std::to_string(current_percent) + "% - " +
-                     format_size(total_sent) + " / " + format_size(file_size));
-                last_report_time = report_time;
-                last_reported_percent = current_percent;
+                if (cached_fd >= 0) ::close(cached_fd);
+                encoded_.reset(new CompressStream(filepath_, coding_, key, CompressionCache::instance().claim(key)));
+                vlog("Compressing " + filepath_ + " with " + coding_name(coding_));
             }
         }
+    }
 
-        close(file_fd);
-        vlog("File send completed: " + filename + " (" + format_size(total_sent) + ")");
-        return true;
+    // If-Range matches the entity tag or the Last-Modified value the client
+    // was given; anything else gets the whole file.
+    std::vector<ByteRange> ranges;
+    int range_rc = 0;
+    if (!range_.empty() && file_size_ >= 0 &&
+        (if_range_.empty() || if_range_ == last_modified || (!etag.empty() && if_range_ == etag))) {
+        range_rc = parse_range_header(range_, file_size_, ranges);
     }
 
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file.is_open()) {
-        vlog("stream_file: Failed to open file");
-        return false;
+    if (range_rc < 0) {
+        vlog("Range not satisfiable for " + filename_ + ": " + range_);
+        head.append(HEAD_416).append(std::to_string(file_size_)).append("\r\n").append(extra_headers_).append("\r\n");
+        segments_.push_back(Segment{head, 0, 0});
+        last_progress_time_ = std::chrono::steady_clock::now();
+        return true;
     }
 
-    const size_t buffer_size = 1024 * 1024;
-    std::vector<char> buffer(buffer_size);
+    auto content_range = [&](const ByteRange& r) {
+        return "Content-Range: bytes " + std::to_string(r.start) + "-" + std::to_string(r.start + r.length - 1) + "/" +
+               std::to_string(file_size_) + "\r\n";
+    };
+    std::vector<Segment> body;
+    if (range_rc > 0 && ranges.size() > 1) {
+        std::string boundary = random_token(24);
+        std::string part_type = content_type_.empty() ? "application/octet-stream" : content_type_;
+        off_t length = 0;
+        for (const auto& r : ranges) {
+            std::string part = "\r\n--" + boundary + "\r\nContent-Type: " + part_type + "\r\n" + content_range(r) + "\r\n";
+            length += part.size() + r.length;
+            body.push_back(Segment{std::move(part), 0, 0});
+            body.push_back(Segment{"", (off_t)r.start, (off_t)r.length});
+        }
+        std::string closing = "\r\n--" + boundary + "--\r\n";
+        length += closing.size();
+        body.push_back(Segment{closing, 0, 0});
+
+        head.append(HEAD_206).append("multipart/byteranges; boundary=").append(boundary)
+            .append("\r\nContent-Length: ").append(std::to_string(length)).append("\r\n");
+        vlog("Serving " + std::to_string(ranges.size()) + " byte ranges of " + filename_);
+    } else if (range_rc > 0) {
+        const ByteRange& r = ranges[0];
+        head.append(HEAD_206).append(content_type_).append("\r\nContent-Length: ").append(std::to_string(r.length))
+            .append("\r\n").append(content_range(r));
+        body.push_back(Segment{"", (off_t)r.start, (off_t)r.length});
+        vlog("Serving byte range " + std::to_string(r.start) + "-" + std::to_string(r.start + r.length - 1) +
+             " of " + filename_);
+    } else if (coding_ != ContentCoding::Identity) {
+        head.append(HEAD_200).append(content_type_).append("\r\nContent-Encoding: ").append(coding_name(coding_))
+            .append("\r\n");
+        if (coded_size >= 0) head.append("Content-Length: ").append(std::to_string(coded_size)).append("\r\n");
+        body.push_back(Segment{"", 0, coded_size});
+    } else if (file_size_ < 0) {
+        // Length unknown: the body ends when the connection closes.
+        head.append(HEAD_200).append(content_type_).append("\r\n");
+        body.push_back(Segment{"", 0, -1});
+    } else if (file_) {
+        head.append(HEAD_200).append(content_type_).append("\r\n").append(file_->headers);
+        body.push_back(Segment{"", 0, file_size_});
+    } else {
+        head.append(HEAD_200).append(content_type_).append("\r\nContent-Length: ").append(std::to_string(file_size_))
+            .append("\r\n");
+        body.push_back(Segment{"", 0, file_size_});
+    }
 
-    while (file.read(buffer.data(), buffer_size) || file.gcount() > 0) {
-        if (interrupted && *interrupted) {
-            vlog("File send interrupted by user");
-            file.close();
-            return false;
+    // A cached file's full response has all of its entity headers already.
+    bool prebuilt = file_ && range_rc == 0 && coding_ == ContentCoding::Identity;
+    if (!prebuilt) {
+        if (file_size_ >= 0 && coding_ == ContentCoding::Identity) head.append(ACCEPT_RANGES);
+        add_validators();
+    }
+    if (as_attachment_ && !filename_.empty()) {
+        head.append("Content-Disposition: attachment; filename=\"").append(filename_).append("\"\r\n");
+    }
+    // Only a digest of this very version of the file describes it.
+    bool digest_wanted = digest_ && file_ && coding_ == ContentCoding::Identity;
+    std::string sha;
+    if (digest_wanted && digest_->get(st, sha)) {
+        head.append("Repr-Digest: ").append(digest_field(sha)).append("\r\n");
+        head.append("Digest: SHA-256=").append(base64_encode(sha)).append("\r\n");
+        digest_wanted = false;
+    }
+    head.append(extra_headers_).append("\r\n");
+
+    segments_.push_back(Segment{std::move(head), 0, 0});
+    for (auto& seg : body) {
+        if (seg.data.empty()) {
+            add_file_segment(seg.offset, seg.length);
+        } else {
+            segments_.push_back(seg);
         }
+    }
 
-        auto current_time = std::chrono::steady_clock::now();
-        if (total_sent > last_sent_bytes) {
-            last_progress_time = current_time;
-            last_sent_bytes = total_sent;
+    vlog("Starting file send: " + filename_ + " (" + (file_size_ >= 0 && !encoded_ ? format_size(body_size_) : "streamed") + ")");
+    zero_copy_ = !stream_ && !encoded_ && !listing_ && (!ssl_ || sock_ktls_send(ssl_));
+    if (stream_ && range_rc == 0) {
+        hash_.reset(new Sha256());
+    } else if (digest_wanted) {
+        if (!zero_copy_ && range_rc == 0) {
+            hash_.reset(new Sha256());
+        } else {
+            digest_->refresh(filepath_, st);
         }
-        auto inactivity_elapsed = std::chrono::duration_cast<std::chrono::seconds>(current_time - last_progress_time);
-        if (inactivity_elapsed.count() > timeout_seconds) {
-            vlog("File send timeout (no progress for " + std::to_string(inactivity_elapsed.count()) + "s)");
-            file.close();
-            return false;
+    }
+    if (ssl_ && !stream_ && !encoded_ && !listing_) {
+        if (zero_copy_) {
+            vlog("TLS send path for " + filepath_ + ": kTLS SSL_sendfile");
+        } else {
+            vlog("TLS send path for " + filepath_ + ": user-space SSL_write (kTLS not active for this cipher/kernel)");
+            source_.open(file_fd_, use_uring_);
+            vlog(std::string("File read engine: ") + source_.engine_name());
         }
+    }
+    last_progress_time_ = std::chrono::steady_clock::now();
+    return true;
+}
 
-        ssize_t bytes_read = file.gcount();
-        ssize_t chunk_sent = 0;
+void FileSender::next_segment() {
+    ++seg_;
+    seg_sent_ = 0;
+    seg_started_ = false;
+}
 
-        while (chunk_sent < bytes_read) {
-            if (interrupted && *interrupted) {
-                vlog("File send interrupted by user");
-                file.close();
-                return false;
-            }
+size_t FileSender::grant(size_t want) {
+    if (!throttle_.active()) return want;
+    size_t n = throttle_.grant(want);
+    throttled_ = n == 0;
+    return n;
+}
 
-            auto op_start_time = std::chrono::steady_clock::now();
-            bool op_completed = false;
+bool FileSender::throttled(std::chrono::steady_clock::time_point& until) const {
+    if (!throttled_) return false;
+    until = throttle_.until();
+    return true;
+}
 
-            while (!op_completed) {
-                if (interrupted && *interrupted) {
-                    vlog("File send interrupted by user");
-                    file.close();
-                    return false;
+IoStatus FileSender::pump() {
+    IoStatus st;
+    throttled_ = false;
+    coder_wait_ = false;
+    while (seg_ < segments_.size()) {
+        const Segment& seg = segments_[seg_];
+
+        if (!seg.data.empty()) {
+            while (seg_sent_ < (off_t)seg.data.size()) {
+                ssize_t w = sock_write(fd_, ssl_, seg.data.data() + seg_sent_, seg.data.size() - seg_sent_, st);
+                if (w < 0) {
+                    if (st == IoStatus::Error) vlog("stream_file: Header send failed");
+                    return st;
                 }
+                seg_sent_ += w;
+                last_progress_time_ = std::chrono::steady_clock::now();
+            }
+            next_segment();
+            continue;
+        }
 
-                auto op_current_time = std::chrono::steady_clock::now();
-                auto op_elapsed = std::chrono::duration_cast<std::chrono::seconds>(op_current_time - op_start_time);
-                if (op_elapsed.count() > timeout_seconds) {
-                    vlog("Send operation timeout");
-                    file.close();
-                    return false;
-                }
+        if (!seg_started_) {
+            if (!zero_copy_ && !body_seek(seg.offset, seg.length)) {
+                vlog("stream_file: seek failed");
+                return IoStatus::Error;
+            }
+            chunk_len_ = chunk_off_ = 0;
+            seg_started_ = true;
+        }
 
-                if (ssl) {
-                    int r = SSL_write(ssl, buffer.data() + chunk_sent, bytes_read - chunk_sent);
-                    if (r > 0) {
-                        chunk_sent += r;
-                        total_sent += r;
-                        last_progress_time = std::chrono::steady_clock::now();
-                        last_sent_bytes = total_sent;
-                        op_completed = true;
-                    } else {
-                        int err = SSL_get_error(ssl, r);
-                        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                            usleep(10000);
-                            continue;
-                        }
-                        vlog("stream_file: SSL_write failed");
-                        file.close();
-                        return false;
+        while (seg.length < 0 || seg_sent_ < seg.length) {
+            ssize_t w;
+            if (!zero_copy_) {
+                if (chunk_off_ == chunk_len_) {
+                    chunk_off_ = 0;
+                    bool ready;
+                    if (!body_next(chunk_, chunk_len_, ready)) {
+                        chunk_len_ = 0;
+                        vlog("stream_file: read failed");
+                        return IoStatus::Error;
+                    }
+                    if (!ready) {
+                        chunk_len_ = 0;
+                        coder_wait_ = true;
+                        return IoStatus::WantWrite;
                     }
-                } else {
-
-                    ssize_t sent = ::send(fd, buffer.data() + chunk_sent, bytes_read - chunk_sent, MSG_NOSIGNAL);
-                    if (sent > 0) {
-                        chunk_sent += sent;
-                        total_sent += sent;
-                        last_progress_time = std::chrono::steady_clock::now();
-                        last_sent_bytes = total_sent;
-                        op_completed = true;
-                    } else if (sent == 0) {
-                        vlog("send returned 0 (connection closed)");
-                        file.close();
-                        return false;
-                    } else {
-                        if (errno == EINTR) continue;
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            usleep(10000);
-                            continue;
+                    if (chunk_len_ == 0) {
+                        if (seg.length < 0) {
+                            segments_[seg_].length = seg_sent_;
+                            if (!encoded_) file_size_ = seg_sent_;
+                            break;
                         }
-                        vlog("stream_file: send failed");
-                        file.close();
-                        return false;
+                        vlog("stream_file: read failed");
+                        return IoStatus::Error;
                     }
+                    if (hash_) hash_->update(chunk_, chunk_len_);
                 }
-            }
 
-            auto report_time = std::chrono::steady_clock::now();
-            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(report_time - last_report_time);
-            int current_percent = calculate_percentage(total_sent, file_size);
-
-            bool should_log = false;
-            if (current_percent >= 100) {
-                should_log = true;
-            } else if (elapsed.count() >= 2) {
-                should_log = true;
-            } else if (current_percent != last_reported_percent && current_percent % 10 == 0) {
-                should_log = true;
+                size_t n = grant(chunk_len_ - chunk_off_);
+                if (n == 0) return IoStatus::WantWrite;
+                w = sock_write(fd_, ssl_, chunk_ + chunk_off_, n, st);
+                throttle_.used(n, w > 0 ? (size_t)w : 0);
+                if (w < 0) {
+                    if (st == IoStatus::Error) vlog("stream_file: SSL_write failed");
+                    return st;
+                }
+                chunk_off_ += w;
+            } else {
+                off_t offset = seg.offset + seg_sent_;
+                size_t n = grant((size_t)(seg.length - seg_sent_));
+                if (n == 0) return IoStatus::WantWrite;
+                w = sock_sendfile(fd_, ssl_, file_fd_, offset, n, st);
+                throttle_.used(n, w > 0 ? (size_t)w : 0);
+                if (w == 0) {
+                    vlog("sendfile returned 0 but file not completely sent");
+                    return IoStatus::Error;
+                }
+                if (w < 0) {
+                    if (st == IoStatus::Error) vlog("stream_file: sendfile failed");
+                    return st;
+                }
             }
 
-            if (should_log && is_verbose()) {
-                vlog("Send: " + std::to_string(current_percent) + "% - " +
-                     format_size(total_sent) + " / " + format_size(file_size));
-                last_report_time = report_time;
-                last_reported_percent = current_percent;
+            seg_sent_ += w;
+            total_sent_ += w;
+            last_progress_time_ = std::chrono::steady_clock::now();
+            if (seg.length >= 0) {
+                report_progress("Send", total_sent_, body_size_, last_report_time_, last_reported_percent_,
+                                last_reported_bytes_, throttle_.limit());
             }
         }
+        next_segment();
+    }
 
-        if (file.eof()) {
-            break;
+    vlog("File send completed: " + filename_ + " (" + format_size(total_sent_) + ")");
+    if (hash_ && stream_) {
+        vlog("SHA-256 of " + filename_ + ": " + hex_encode(hash_->final()));
+    } else if (hash_) {
+        // Rewritten while it was sent, the file has no single digest.
+        struct stat now;
+        if (fstat(file_fd_, &now) == 0 && FileDigest::same_version(now, file_->st)) {
+            digest_->put(file_->st, hash_->final());
         }
     }
-
-    file.close();
-    vlog("File send completed: " + filename + " (" + format_size(total_sent) + ")");
-    return true;
+    return IoStatus::Done;
 }
 
-bool stream_receive_file(int fd, long long content_length, const std::string& boundary,
-                        const std::string& outname, long long max_size,
-                        std::atomic<bool>* interrupted, int timeout_seconds, SSL* ssl) {
-    std::string temp_path = outname + ".tmp." + random_token(8);
-    vlog("Starting file receive: " + outname + " (" + format_size(content_length) + " expected)");
-
-    std::ofstream file(temp_path, std::ios::binary);
-    if (!file.is_open()) {
-        vlog("Failed to open temp file: " + temp_path);
-        return false;
+std::vector<ByteRange> FileSender::sent_ranges() const {
+    std::vector<ByteRange> out;
+    if (coding_ != ContentCoding::Identity) {
+        if (segments_.size() > 1 && seg_ >= segments_.size()) out.push_back(ByteRange{0, (long long)file_size_});
+        return out;
+    }
+    for (size_t i = 0; i < segments_.size() && i <= seg_; ++i) {
+        const Segment& seg = segments_[i];
+        if (!seg.data.empty()) continue;
+        off_t sent = (i < seg_) ? seg.length : seg_sent_;
+        if (sent > 0 || seg.length == 0) out.push_back(ByteRange{(long long)seg.offset, (long long)sent});
     }
+    return out;
+}
 
-    const size_t buffer_size = 64 * 1024;
-    std::vector<char> buffer(buffer_size);
+bool FileSender::stalled(std::chrono::steady_clock::time_point now, int timeout_seconds) const {
+    auto inactivity = std::chrono::duration_cast<std::chrono::seconds>(now - last_progress_time_);
+    return inactivity.count() > timeout_seconds;
+}
 
-    long long total_received = 0;
+FileReceiver::FileReceiver(int fd, SSL* ssl, long long content_length, const std::string& boundary,
+                           const std::string& outname, long long max_size, bool use_uring)
+    : fd_(fd), ssl_(ssl), content_length_(content_length), outname_(outname), max_size_(max_size),
+      use_uring_(use_uring), raw_(boundary.empty()), boundary_delimiter_("--" + boundary),
+      data_end_("\r\n--" + boundary)
+{
+    last_progress_time_ = std::chrono::steady_clock::now();
+    last_report_time_ = last_progress_time_;
+}
 
-    auto last_report_time = std::chrono::steady_clock::now();
-    auto transfer_start_time = std::chrono::steady_clock::now();
+FileReceiver::~FileReceiver() {
+    if (!finished_) abort();
+    if (pipe_[0] >= 0) close(pipe_[0]);
+    if (pipe_[1] >= 0) close(pipe_[1]);
+}
 
-    auto last_progress_time = transfer_start_time;
-    long long last_received_bytes = 0;
+bool FileReceiver::open() {
+    vlog("Starting file receive (" + format_size(content_length_) + " expected)");
+    buffer_.resize(64 * 1024);
+
+    if (!raw_) {
+        vlog("Multipart boundary: " + boundary_delimiter_);
+        // The body bounds the total size of the files, so a disk that is too
+        // small is reported before anything is transferred.
+        std::string dir = outname_.empty() ? out_dir_ : std::filesystem::path(outname_).parent_path().string();
+        struct statvfs vfs;
+        if (content_length_ > 0 && statvfs(dir.empty() ? "." : dir.c_str(), &vfs) == 0 &&
+            (unsigned long long)vfs.f_bavail * vfs.f_frsize < (unsigned long long)content_length_) {
+            vlog("Not enough disk space in " + dir + " for " + format_size(content_length_));
+            out_of_space_ = true;
+            finished_ = true;
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    vlog("Raw request body");
+    // A raw body on a plain socket never passes through user space.
+    // (A body with a digest to check has to be read to be hashed.)
+    if (!ssl_ && expected_sha256_.empty() && pipe2(pipe_, O_CLOEXEC | O_NONBLOCK) == 0) {
+        fcntl(pipe_[1], F_SETPIPE_SZ, (int)SPLICE_PIPE_SIZE);
+    }
+    if (chunk_) {
+        vlog("Chunk at offset " + std::to_string(chunk_offset_) + " of " + chunk_->path());
+        return true;
+    }
+    if (!begin_file(raw_filename_)) {
+        abort();
+        return false;
+    }
 
-    int last_reported_percent = -1;
+    if (!file_->reserve(content_length_)) {
+        vlog("Not enough disk space for " + part_name_ + " (" + format_size(content_length_) + "): " +
+             strerror(errno));
+        out_of_space_ = true;
+        abort();
+        return false;
+    }
+    return true;
+}
 
+void FileReceiver::prime(const char* data, size_t len) {
+    if (len == 0 || finished_) return;
+    if (content_length_ >= 0 && (long long)len > content_length_) len = content_length_;
+    if (!consume(data, len)) abort();
+}
 
+IoStatus FileReceiver::pump() {
+    if (finished_) return failed_ ? IoStatus::Error : IoStatus::Done;
+    throttled_ = false;
 
-    enum ParseState { FIND_BOUNDARY, IN_HEADERS, IN_FILE_DATA, COMPLETE };
-    ParseState state = FIND_BOUNDARY;
+    if (pipe_[0] >= 0) {
+        IoStatus st = pump_splice();
+        if (st != IoStatus::Done) return st;
+    }
 
-    std::string search_buffer;
-    std::string boundary_delimiter = "--" + boundary;
-    std::string end_boundary = boundary_delimiter + "--";
+    while (total_received_ < content_length_ && state_ != COMPLETE) {
+        size_t to_read = grant((size_t)std::min((long long)buffer_.size(), content_length_ - total_received_));
+        if (to_read == 0) return IoStatus::WantRead;
+        IoStatus st;
+        ssize_t r = sock_read(fd_, ssl_, buffer_.data(), to_read, st);
+        throttle_.used(to_read, r > 0 ? (size_t)r : 0);
+        if (r == 0) {
+            vlog("Connection closed by client");
+            abort();
+            return IoStatus::Error;
+        }
+        if (r < 0) {
+            if (st == IoStatus::Error) {
+                vlog("Receive failed");
+                abort();
+            }
+            return st;
+        }
+        if (!consume(buffer_.data(), r)) {
+            abort();
+            return IoStatus::Error;
+        }
+    }
 
-    vlog("Multipart boundary: " + boundary_delimiter);
+    return finish() ? IoStatus::Done : IoStatus::Error;
+}
 
-    struct pollfd pfd;
-    pfd.fd = fd;
-    pfd.events = POLLIN;
+bool FileReceiver::stalled(std::chrono::steady_clock::time_point now, int timeout_seconds) const {
+    auto inactivity = std::chrono::duration_cast<std::chrono::seconds>(now - last_progress_time_);
+    return inactivity.count() > timeout_seconds;
+}
 
-    while (total_received < content_length && state != COMPLETE) {
-        if (interrupted && *interrupted) {
-            vlog("File receive interrupted by user");
-            file.close();
-            unlink(temp_path.c_str());
-            return false;
-        }
+size_t FileReceiver::grant(size_t want) {
+    if (!throttle_.active()) return want;
+    size_t n = throttle_.grant(want);
+    throttled_ = n == 0;
+    return n;
+}
 
+bool FileReceiver::throttled(std::chrono::steady_clock::time_point& until) const {
+    if (!throttled_) return false;
+    until = throttle_.until();
+    return true;
+}
 
-        auto current_time = std::chrono::steady_clock::now();
-        if (total_received > last_received_bytes) {
-            last_progress_time = current_time;
-            last_received_bytes = total_received;
+// Moves the body with splice() until it is complete. Returns Done when the
+// regular read path should take over (nothing left, or splice unsupported).
+IoStatus FileReceiver::pump_splice() {
+    while (total_received_ < content_length_) {
+        size_t to_move = grant((size_t)std::min((long long)SPLICE_PIPE_SIZE, content_length_ - total_received_));
+        if (to_move == 0) return IoStatus::WantRead;
+        IoStatus st;
+        ssize_t r = sock_splice(fd_, pipe_[1], to_move, st);
+        throttle_.used(to_move, r > 0 ? (size_t)r : 0);
+        if (r == 0) {
+            vlog("Connection closed by client");
+            abort();
+            return IoStatus::Error;
         }
-        auto inactivity_elapsed = std::chrono::duration_cast<std::chrono::seconds>(current_time - last_progress_time);
-        if (inactivity_elapsed.count() > timeout_seconds) {
-            vlog("File receive timeout (no progress for " + std::to_string(inactivity_elapsed.count()) + "s)");
-            file.close();
-            unlink(temp_path.c_str());
-            return false;
+        if (r < 0) {
+            if (st != IoStatus::Error) return st;
+            if (errno == EINVAL && total_received_ == 0) {
+                vlog("splice() not supported for this socket, reading upload instead");
+                break;
+            }
+            vlog("Receive failed");
+            abort();
+            return IoStatus::Error;
         }
+        off_t at = chunk_offset_ + total_received_;
+        if (!received((size_t)r) ||
+            !(chunk_ ? chunk_->splice_at(pipe_[0], at, (size_t)r) : file_->splice_from(pipe_[0], (size_t)r))) {
+            abort();
+            return IoStatus::Error;
+        }
+        report_progress("Receive", total_received_, content_length_, last_report_time_, last_reported_percent_,
+                        last_reported_bytes_, throttle_.limit());
+    }
+
+    close(pipe_[0]);
+    close(pipe_[1]);
+    pipe_[0] = pipe_[1] = -1;
+    return IoStatus::Done;
+}
 
+bool FileReceiver::received(size_t len) {
+    total_received_ += len;
+    last_progress_time_ = std::chrono::steady_clock::now();
 
+    if (max_size_ > 0 && total_received_ > max_size_) {
+        vlog("Size limit exceeded");
+        return false;
+    }
+    return true;
+}
 
-        int poll_result = poll(&pfd, 1, 100);
+void FileReceiver::store(const char* data, size_t len) {
+    if (!file_) return;
+    file_->write(data, len);
+    if (hash_) hash_->update(data, len);
+}
 
-        if (poll_result < 0) {
-            if (errno == EINTR) continue;
-            vlog("Poll failed during receive");
-            file.close();
-            unlink(temp_path.c_str());
-            return false;
+bool FileReceiver::consume(const char* data, size_t len) {
+    if (!received(len)) return false;
+
+    auto write = [this](const char* p, size_t n) { store(p, n); };
+
+    // File data is written straight from `data`; part headers, and whatever
+    // follows them in the same chunk, go through head_buffer_.
+    std::string rest;
+    while (len > 0 && state_ != COMPLETE) {
+        if (raw_ && chunk_) {
+            if (!chunk_->write_at(chunk_offset_ + total_received_ - len, data, len)) return false;
+            len = 0;
+        } else if (raw_) {
+            write(data, len);
+            len = 0;
+        } else if (state_ == IN_FILE_DATA) {
+            size_t used = data_end_.feed(data, len, write);
+            data += used;
+            len -= used;
+            if (data_end_.found()) {
+                if (!end_file()) return false;
+                data_end_.reset();
+                state_ = AFTER_BOUNDARY;
+            }
+        } else {
+            head_buffer_.append(data, len);
+            len = 0;
+            if (!parse_head()) return false;
+            if (state_ == IN_FILE_DATA) {
+                rest.swap(head_buffer_);
+                head_buffer_.clear();
+                data = rest.data();
+                len = rest.size();
+            }
         }
 
-        if (poll_result == 0) {
-            continue;
+        if (file_ && !file_->good()) {
+            vlog("File write failed");
+            return false;
         }
+    }
 
-        auto op_start_time = std::chrono::steady_clock::now();
-        bool op_completed = false;
-
-        while (!op_completed) {
-            if (interrupted && *interrupted) {
-                vlog("File receive interrupted by user");
-                file.close();
-                unlink(temp_path.c_str());
-                return false;
-            }
-
-            auto op_current_time = std::chrono::steady_clock::now();
-            auto op_elapsed = std::chrono::duration_cast<std::chrono::seconds>(op_current_time - op_start_time);
-            if (op_elapsed.count() > timeout_seconds) {
-                vlog("Receive operation timeout");
-                file.close();
-                unlink(temp_path.c_str());
-                return false;
-            }
+    report_progress("Receive", total_received_, content_length_, last_report_time_, last_reported_percent_,
+                        last_reported_bytes_, throttle_.limit());
+    return true;
+}
 
-            ssize_t to_read = std::min((long long)buffer_size, content_length - total_received);
-            ssize_t bytes_read = 0;
-            if (ssl) {
-                int r = SSL_read(ssl, buffer.data(), to_read);
-                if (r > 0) {
-                    bytes_read = r;
-                } else {
-                    int err = SSL_get_error(ssl, r);
-                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                        usleep(10000);
-                        continue;
-                    } else {
-                        vlog("Receive failed (SSL_read)");
-                        file.close();
-                        unlink(temp_path.c_str());
-                        return false;
-                    }
+// Advances through boundaries and part headers in head_buffer_ until file
+// data starts (the data is left at the front of head_buffer_) or more input
+// is needed.
+bool FileReceiver::parse_head() {
+    while (true) {
+        if (state_ == FIND_BOUNDARY) {
+            size_t boundary_pos = head_buffer_.find(boundary_delimiter_);
+            if (boundary_pos == std::string::npos) {
+                if (head_buffer_.size() > boundary_delimiter_.size()) {
+                    head_buffer_.erase(0, head_buffer_.size() - boundary_delimiter_.size());
                 }
-            } else {
-                bytes_read = ::recv(fd, buffer.data(), to_read, 0);
+                return true;
             }
+            head_buffer_.erase(0, boundary_pos + boundary_delimiter_.size());
+            state_ = AFTER_BOUNDARY;
+        }
 
-            if (bytes_read > 0) {
-                total_received += bytes_read;
-                op_completed = true;
-
-                if (max_size > 0 && total_received > max_size) {
-                    vlog("Size limit exceeded");
-                    file.close();
-                    unlink(temp_path.c_str());
-                    return false;
-                }
+        if (state_ == AFTER_BOUNDARY) {
+            if (head_buffer_.size() < 2) return true;
+            if (head_buffer_.compare(0, 2, "--") == 0) {
+                vlog("Found end boundary, upload complete");
+                head_buffer_.clear();
+                state_ = COMPLETE;
+                return true;
+            }
+            state_ = IN_HEADERS;
+        }
 
-                search_buffer.append(buffer.data(), bytes_read);
-            } else if (bytes_read == 0) {
-                vlog("Connection closed by client");
-                file.close();
-                unlink(temp_path.c_str());
-                return false;
-            } else {
-                if (errno == EINTR) continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(10000);
-                    continue;
-                }
-                vlog("Receive failed");
-                file.close();
-                unlink(temp_path.c_str());
+        // The part headers start after the CRLF that ends the boundary line.
+        size_t headers_end = head_buffer_.find("\r\n\r\n");
+        if (headers_end == std::string::npos) {
+            if (head_buffer_.size() > MAX_PART_HEADERS_SIZE) {
+                vlog("Multipart headers too large");
                 return false;
             }
+            return true;
         }
 
-        while (search_buffer.size() > 0 && state != COMPLETE) {
-            switch (state) {
-                case FIND_BOUNDARY: {
-                    size_t boundary_pos = search_buffer.find(boundary_delimiter);
-                    if (boundary_pos != std::string::npos) {
-                        vlog("Found boundary, moving to headers");
-                        search_buffer = search_buffer.substr(boundary_pos + boundary_delimiter.size());
-                        state = IN_HEADERS;
-                    } else {
-                        if (search_buffer.size() > boundary_delimiter.size()) {
-                            search_buffer = search_buffer.substr(search_buffer.size() - boundary_delimiter.size());
-                        }
-                        goto next_chunk;
-                    }
-                    break;
-                }
-
-                case IN_HEADERS: {
-                    size_t headers_end = search_buffer.find("\r\n\r\n");
-                    if (headers_end != std::string::npos) {
-                        vlog("Headers complete, starting file data");
-                        search_buffer = search_buffer.substr(headers_end + 4);
-                        state = IN_FILE_DATA;
-                    } else {
-                        goto next_chunk;
-                    }
-                    break;
-                }
+        std::string filename;
+        std::string disposition = get_header_value(head_buffer_.substr(0, headers_end + 2), "Content-Disposition");
+        bool is_file = content_disposition_filename(disposition, filename);
+        head_buffer_.erase(0, headers_end + 4);
+        if (is_file) {
+            if (!begin_file(filename)) return false;
+        } else {
+            vlog("Skipping form field part");
+            file_.reset();
+        }
+        state_ = IN_FILE_DATA;
+        return true;
+    }
+}
 
-                case IN_FILE_DATA: {
-                    size_t next_boundary_pos = search_buffer.find(boundary_delimiter);
-                    size_t end_boundary_pos = search_buffer.find(end_boundary);
+std::string FileReceiver::output_name(const std::string& filename) {
+    if (saved_.empty() && !outname_.empty()) return outname_;
 
-                    size_t boundary_pos = std::min(next_boundary_pos, end_boundary_pos);
+    std::string name = sanitize_filename(filename);
+    if (name.empty()) name = "upload_" + random_token(8);
+    return unique_path((std::filesystem::path(out_dir_) / name).string());
+}
 
-                    if (boundary_pos != std::string::npos) {
-                        file.write(search_buffer.data(), boundary_pos);
-                        vlog("Found boundary, file data complete");
-                        state = COMPLETE;
-                        break;
-                    }
+bool FileReceiver::begin_file(const std::string& filename) {
+    // Only the output file the operator named may replace an existing one.
+    bool replace = saved_.empty() && !outname_.empty();
+    part_name_ = output_name(filename);
+    bool spliced = pipe_[0] >= 0;
 
-                    size_t safe_write_size = search_buffer.size();
-                    if (safe_write_size > boundary_delimiter.size()) {
-                        safe_write_size -= boundary_delimiter.size();
-                    }
+    file_.reset(new FileSink());
+    if (!file_->open(part_name_, use_uring_ && !spliced, sync_, replace)) {
+        vlog("Failed to create file " + part_name_ + ": " + strerror(errno));
+        file_.reset();
+        return false;
+    }
+    vlog("Receiving " + part_name_ + " (write engine: " + (spliced ? "splice" : file_->engine_name()) + ")");
+    hash_.reset(spliced ? nullptr : new Sha256());
+    return true;
+}
 
-                    if (safe_write_size > 0) {
-                        file.write(search_buffer.data(), safe_write_size);
-                        search_buffer = search_buffer.substr(safe_write_size);
-                    }
+bool FileReceiver::end_file() {
+    if (!file_) return true;
+    std::string digest = hash_ ? hash_->final() : "";
+    hash_.reset();
+    if (!expected_sha256_.empty() && raw_ && digest != expected_sha256_) {
+        vlog("SHA-256 mismatch for " + part_name_ + ": got " + hex_encode(digest) + ", expected " +
+             hex_encode(expected_sha256_));
+        file_->discard();
+        file_.reset();
+        digest_mismatch_ = true;
+        return false;
+    }
 
-                    goto next_chunk;
-                    break;
-                }
+    bool ok = file_->commit();
+    part_name_ = file_->path();
+    file_.reset();
+    if (!ok) {
+        vlog("File write failed: " + part_name_);
+        return false;
+    }
+    saved_.push_back(part_name_);
+    digests_.push_back(hex_encode(digest));
+    vlog("File received: " + part_name_ + (digest.empty() ? "" : " (SHA-256 " + hex_encode(digest) + ")"));
+    return true;
+}
 
-                case COMPLETE:
-                    break;
-            }
+bool FileReceiver::finish() {
+    finished_ = true;
+    if (chunk_) return true;
+    if (!raw_ && state_ != COMPLETE) {
+        vlog("Warning: File receive completed but multipart parsing didn't find end boundary");
+        if (state_ == IN_FILE_DATA) {
+            data_end_.flush([this](const char* p, size_t n) { store(p, n); });
         }
+    }
 
-        next_chunk:
-
-        if (!file.good()) {
-            vlog("File write failed");
-            file.close();
-            unlink(temp_path.c_str());
-            return false;
-        }
+    if (!end_file()) {
+        failed_ = true;
+        return false;
+    }
+    if (saved_.empty()) {
+        vlog("No file in upload");
+        failed_ = true;
+        return false;
+    }
 
-        auto report_time = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(report_time - last_report_time);
-        int current_percent = calculate_percentage(total_received, content_length);
-
-        bool should_log = false;
-        if (current_percent >= 100) {
-            should_log = true;
-        } else if (elapsed.count() >= 2) {
-            should_log = true;
-        } else if (current_percent != last_reported_percent && current_percent % 10 == 0) {
-            should_log = true;
-        }
+    vlog("File receive completed: " + std::to_string(saved_.size()) + " file(s), " + format_size(total_received_));
+    return true;
+}
 
-        if (should_log && is_verbose()) {
-            vlog("Receive: " + std::to_string(current_percent) + "% - " +
-                 format_size(total_received) + " / " + format_size(content_length));
-            last_report_time = report_time;
-            last_reported_percent = current_percent;
-        }
-    }
+void FileReceiver::abort() {
+    finished_ = true;
+    failed_ = true;
+    if (file_) file_->discard();
+    file_.reset();
+}
 
-    file.close();
+bool stream_file(int fd, const std::string& filepath, const std::string& content_type,
+                const std::string& filename, bool as_attachment,
+                std::atomic<bool>* interrupted, int timeout_seconds, SSL* ssl) {
+    FileSender sender(fd, ssl, filepath, content_type, filename, as_attachment);
+    if (!sender.open()) return false;
 
-    if (state != COMPLETE) {
-        vlog("Warning: File receive completed but multipart parsing didn't find end boundary");
+    IoStatus st;
+    while ((st = sender.pump()) == IoStatus::WantRead || st == IoStatus::WantWrite) {
+        if (interrupted && *interrupted) {
+            vlog("File send interrupted by user");
+            return false;
+        }
+        if (sender.stalled(std::chrono::steady_clock::now(), timeout_seconds)) {
+            vlog("File send timeout (no progress for " + std::to_string(timeout_seconds) + "s)");
+            return false;
+        }
+        wait_for_io(fd, st, wait_timeout_ms(sender.last_progress() + std::chrono::seconds(timeout_seconds + 1),
+                                            INTERRUPT_CHECK_MS));
     }
+    return st == IoStatus::Done;
+}
 
-    vlog("File receive completed, renaming...");
+bool stream_receive_file(int fd, long long content_length, const std::string& boundary,
+                        const std::string& outname, long long max_size,
+                        std::atomic<bool>* interrupted, int timeout_seconds, SSL* ssl) {
+    FileReceiver receiver(fd, ssl, content_length, boundary, outname, max_size);
+    if (!receiver.open()) return false;
 
-    if (rename(temp_path.c_str(), outname.c_str()) != 0) {
-        vlog("Rename failed");
-        unlink(temp_path.c_str());
-        return false;
+    IoStatus st;
+    while ((st = receiver.pump()) == IoStatus::WantRead || st == IoStatus::WantWrite) {
+        if (interrupted && *interrupted) {
+            vlog("File receive interrupted by user");
+            return false;
+        }
+        if (receiver.stalled(std::chrono::steady_clock::now(), timeout_seconds)) {
+            vlog("File receive timeout (no progress for " + std::to_string(timeout_seconds) + "s)");
+            return false;
+        }
+        wait_for_io(fd, st, wait_timeout_ms(receiver.last_progress() + std::chrono::seconds(timeout_seconds + 1),
+                                            INTERRUPT_CHECK_MS));
     }
-
-    vlog("File receive completed: " + outname + " (" + format_size(total_received) + ")");
-    return true;
+    return st == IoStatus::Done;
 }
@@ -2,18 +2,260 @@
 #define FILE_TRANSFER_H
 
 #include <string>
+#include <string_view>
 #include <atomic>
+#include <chrono>
+#include <vector>
+#include "socket_io.h"
+#include "file_io.h"
+#include "boundary_scanner.h"
+#include "chunked_upload.h"
+#include "compression.h"
+#include "rate_limit.h"
+#include "dir_listing.h"
+#include "file_cache.h"
+#include "../utils/server_utils.h"
+#include "../utils/zip_stream.h"
+#include "../utils/digest_utils.h"
 
 
 #include <openssl/ssl.h>
 
 
+// Non-blocking file download: sends the response headers and then the file body.
+// pump() moves as many bytes as the socket accepts and returns WantRead/WantWrite
+// when it would block, so it can be driven by a blocking poll loop or an event loop.
+// With set_range() the response becomes a 206 (single or multipart/byteranges)
+// or a 416, following RFC 7233. Responses carry an ETag and Last-Modified,
+// and set_conditional() turns a request for an unchanged file into a 304.
+class FileSender {
+public:
+    FileSender(int fd, SSL* ssl, const std::string& filepath, const std::string& content_type,
+               const std::string& filename = "", bool as_attachment = false, bool use_uring = false);
+    // Serves a zip archive generated from `archive` while it is being sent.
+    FileSender(int fd, SSL* ssl, std::shared_ptr<ZipPlan> archive);
+    // Serves an opened directory listing; the body ends with the connection.
+    FileSender(int fd, SSL* ssl, std::unique_ptr<DirListing> listing);
+    ~FileSender();
+
+    // Sends `file`, the cache's entry for the file path, from its open
+    // descriptor and with its metadata instead of looking the file up again.
+    void set_file(std::shared_ptr<const CachedFile> file) { file_ = std::move(file); }
+    void set_range(std::string_view range, std::string_view if_range);
+    // Sends the file with a content coding, from the compression cache when
+    // a variant is there and compressed on the fly otherwise. Not applied to
+    // ranges or archives. Call after set_range(); false when the coded body
+    // will be delimited by closing the connection.
+    bool set_coding(ContentCoding coding);
+    ContentCoding coding() const { return coding_; }
+    // If-None-Match / If-Modified-Since of the request.
+    void set_conditional(std::string_view if_none_match, std::string_view if_modified_since);
+    // Describes the file with the SHA-256 `digest` holds for its current
+    // version (Repr-Digest, Digest). A whole uncoded body that is sent
+    // through user space is hashed on the way and recorded there; sendfile()
+    // leaves it to a background hash.
+    void set_digest(std::shared_ptr<FileDigest> digest) { digest_ = std::move(digest); }
+    // Extra response header, e.g. connection management; call before open().
+    void add_header(const std::string& name, const std::string& value);
+    // Limits the body to the rates of `throttle`.
+    void set_throttle(Throttle throttle) { throttle_ = std::move(throttle); }
+    bool open();
+    IoStatus pump();
+    // After pump() returned WantWrite: whether it was the throttle rather
+    // than the socket, and until when.
+    bool throttled(std::chrono::steady_clock::time_point& until) const;
+    // After pump() returned WantWrite: a descriptor that becomes readable
+    // when the body can go on, if it waits for the compressor rather than
+    // the socket; -1 otherwise.
+    int wait_fd() const { return coder_wait_ && encoded_ ? encoded_->ready_fd() : -1; }
+    bool stalled(std::chrono::steady_clock::time_point now, int timeout_seconds) const;
+    std::chrono::steady_clock::time_point last_progress() const { return last_progress_time_; }
+
+    // -1 for a streamed archive until it has been sent completely.
+    long long file_size() const { return file_size_; }
+    // File byte ranges written to the socket so far. A coded body counts as
+    // the whole file once it has been sent, and as nothing before that.
+    std::vector<ByteRange> sent_ranges() const;
+
+    // Entity headers of a full 200 response for a file, from Content-Length
+    // to Cache-Control.
+    static std::string entity_headers(off_t size, const std::string& etag, const std::string& last_modified);
+
+private:
+    // A response is a list of segments: literal bytes (headers, multipart
+    // part headers) or a range of the file when `data` is empty. A length of
+    // -1 runs until the body source is exhausted.
+    struct Segment {
+        std::string data;
+        off_t offset = 0;
+        off_t length = 0;
+    };
+
+    int fd_;
+    SSL* ssl_;
+    std::string filepath_;
+    std::string content_type_;
+    std::string filename_;
+    bool as_attachment_;
+    bool use_uring_;
+    std::string range_;
+    std::string if_range_;
+    std::string if_none_match_;
+    std::string if_modified_since_;
+    std::string extra_headers_;
+
+    std::shared_ptr<const CachedFile> file_;
+    int file_fd_ = -1;
+    bool owns_fd_ = true;  // false for the descriptor of file_
+    bool zero_copy_ = true;
+    off_t file_size_ = 0;
+    off_t body_size_ = 0;
+    off_t total_sent_ = 0;
+
+    std::vector<Segment> segments_;
+    size_t seg_ = 0;
+    off_t seg_sent_ = 0;
+    bool seg_started_ = false;
+
+    FileSource source_;
+    std::shared_ptr<ZipPlan> archive_;
+    std::unique_ptr<ZipStream> stream_;
+    std::unique_ptr<DirListing> listing_;
+    const char* chunk_ = nullptr;
+    size_t chunk_len_ = 0;
+    size_t chunk_off_ = 0;
+    // A whole generated archive, or a whole file to put() in digest_, is
+    // hashed as it goes out.
+    std::unique_ptr<Sha256> hash_;
+    std::shared_ptr<FileDigest> digest_;
+    ContentCoding coding_ = ContentCoding::Identity;
+    std::string coded_path_;  // cached variant, if there is one
+    std::unique_ptr<CompressStream> encoded_;
+    bool coder_wait_ = false;
+    Throttle throttle_;
+    bool throttled_ = false;
+
+    std::chrono::steady_clock::time_point last_progress_time_;
+    std::chrono::steady_clock::time_point last_report_time_;
+    int last_reported_percent_ = -1;
+    long long last_reported_bytes_ = 0;
+
+    void add_file_segment(off_t offset, off_t length);
+    void next_segment();
+    bool body_seek(off_t offset, off_t length);
+    // `ready` is cleared when a coded body has no output yet.
+    bool body_next(const char*& data, size_t& len, bool& ready);
+    size_t grant(size_t want);
+};
+
+// Non-blocking multipart/form-data upload. Every file part is written to its
+// own file as it streams in: the first one to `outname`, or, when that is
+// empty, each one under its (sanitized) part filename in the output
+// directory. With an empty `boundary` the request body is the file itself
+// (PUT or raw POST); on plain sockets it is then moved socket -> pipe -> file
+// with splice().
+// A raw body can also be a byte range of a ChunkedUpload (set_chunk()); it
+// is then written at its offset in that upload's file.
+// Bytes already read together with the request headers are handed over with prime().
+class FileReceiver {
+public:
+    FileReceiver(int fd, SSL* ssl, long long content_length, const std::string& boundary,
+                 const std::string& outname, long long max_size, bool use_uring = false);
+    ~FileReceiver();
+
+    // Call before open().
+    void set_sync(SyncMode sync) { sync_ = sync; }
+    // SHA-256 the client announced for a raw body; a body that does not
+    // match is dropped.
+    void set_expected_sha256(const std::string& sha) { expected_sha256_ = sha; }
+    void set_output_dir(const std::string& dir) { out_dir_ = dir; }
+    // Client-supplied name of a raw body, used like a part filename.
+    void set_filename(const std::string& name) { raw_filename_ = name; }
+    // Makes a raw body the part of `upload` that starts at `offset`.
+    void set_chunk(std::shared_ptr<ChunkedUpload> upload, long long offset) {
+        chunk_ = std::move(upload);
+        chunk_offset_ = offset;
+    }
+    void set_throttle(Throttle throttle) { throttle_ = std::move(throttle); }
+
+    bool open();
+    // After a failed open(): the upload does not fit on the disk.
+    bool out_of_space() const { return out_of_space_; }
+    void prime(const char* data, size_t len);
+    IoStatus pump();
+    // After pump() returned WantRead: whether it was the throttle, and until when.
+    bool throttled(std::chrono::steady_clock::time_point& until) const;
+    bool stalled(std::chrono::steady_clock::time_point now, int timeout_seconds) const;
+    std::chrono::steady_clock::time_point last_progress() const { return last_progress_time_; }
+
+    // Files written so far, and their SHA-256 in hex (empty for a body
+    // that was spliced to disk unread).
+    const std::vector<std::string>& saved_files() const { return saved_; }
+    const std::vector<std::string>& saved_digests() const { return digests_; }
+    // After a failure: the body did not match set_expected_sha256().
+    bool digest_mismatch() const { return digest_mismatch_; }
+
+private:
+    enum ParseState { FIND_BOUNDARY, AFTER_BOUNDARY, IN_HEADERS, IN_FILE_DATA, COMPLETE };
+
+    int fd_;
+    SSL* ssl_;
+    long long content_length_;
+    std::string outname_;
+    std::string out_dir_ = ".";
+    std::string raw_filename_;
+    long long max_size_;
+    bool use_uring_;
+
+    std::unique_ptr<FileSink> file_;  // null while skipping a non-file part
+    std::unique_ptr<Sha256> hash_;
+    std::string expected_sha256_;
+    bool digest_mismatch_ = false;
+    std::vector<std::string> saved_;
+    std::vector<std::string> digests_;
+    std::string part_name_;
+    std::shared_ptr<ChunkedUpload> chunk_;
+    long long chunk_offset_ = 0;
+    std::vector<char> buffer_;
+    bool raw_;
+    int pipe_[2] = {-1, -1};
+    long long total_received_ = 0;
+    bool finished_ = false;
+    bool failed_ = false;
+    bool out_of_space_ = false;
+    SyncMode sync_ = SyncMode::None;
+
+    ParseState state_ = FIND_BOUNDARY;
+    std::string head_buffer_;
+    std::string boundary_delimiter_;
+    BoundaryScanner data_end_;
+    Throttle throttle_;
+    bool throttled_ = false;
+
+    std::chrono::steady_clock::time_point last_progress_time_;
+    std::chrono::steady_clock::time_point last_report_time_;
+    int last_reported_percent_ = -1;
+    long long last_reported_bytes_ = 0;
+
+    bool received(size_t len);
+    void store(const char* data, size_t len);
+    bool consume(const char* data, size_t len);
+    IoStatus pump_splice();
+    size_t grant(size_t want);
+    bool parse_head();
+    bool begin_file(const std::string& filename);
+    bool end_file();
+    std::string output_name(const std::string& filename);
+    bool finish();
+    void abort();
+};
+
 bool stream_file(int fd, const std::string& filepath, const std::string& content_type,
-                const std::string& filename = "", bool as_attachment = false, 
+                const std::string& filename = "", bool as_attachment = false,
                 std::atomic<bool>* interrupted = nullptr, int timeout_seconds = 30, SSL* ssl = nullptr);
 
 bool stream_receive_file(int fd, long long content_length, const std::string& boundary,
-                        const std::string& outname, long long max_size, 
+                        const std::string& outname, long long max_size,
                         std::atomic<bool>* interrupted = nullptr, int timeout_seconds = 30, SSL* ssl = nullptr);
 
 std::string format_size(long long bytes);
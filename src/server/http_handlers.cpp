@@ -1,4 +1,7 @@
 #include "http_handlers.h"
+#include "chunked_upload.h"
+#include "../utils/server_utils.h"
+#include "../utils/digest_utils.h"
 #include <sstream>
 #include <string>
 #include <iomanip>
@@ -19,16 +22,56 @@ static std::string html_escape(const std::string &in) {
     return out.str();
 }
 
+// Parallel connections the upload page uses for a chunked upload, and how
+// often it retries a chunk (with growing pauses) before giving up.
+static const int UPLOAD_STREAMS = 4;
+static const int UPLOAD_RETRIES = 10;
+
 std::string html_upload_page(const std::string &token) {
     std::ostringstream s;
     s << "<!doctype html><html><head><meta charset=\"utf-8\"><title>Upload to SimpleFileHost</title>"
       << "<style>body{font-family:Arial;padding:20px} #drop{border:2px dashed #888;padding:30px;text-align:center}</style>"
-      << "</head><body><h2>Upload file</h2>"
-      << "<div id=\"drop\">Drag & Drop or use the form below<br><form method=\"POST\" enctype=\"multipart/form-data\">"
-      << "<input type=\"file\" name=\"file\"><br><br><input type=\"submit\" value=\"Upload\"></form></div>"
-      << "<script>var d=document.getElementById('drop'); d.ondragover=function(e){e.preventDefault();};"
-      << "d.ondrop=function(e){e.preventDefault(); var fd=new FormData(); fd.append('file', e.dataTransfer.files[0]);"
-      << "fetch('',{method:'POST', body:fd}).then(r=>r.text()).then(t=>document.body.innerHTML=t); };</script>"
+      << "</head><body><h2>Upload files</h2>"
+      << "<div id=\"drop\">Drag & Drop or use the form below<br><form id=\"form\" method=\"POST\" enctype=\"multipart/form-data\">"
+      << "<input type=\"file\" name=\"file\" multiple><br><br><input type=\"submit\" value=\"Upload\"></form></div>"
+      // One file is sent as a raw PUT body, several as one multipart POST;
+      // the plain form post is the no-script fallback. A file bigger than a
+      // chunk goes as a chunked upload over UPLOAD_STREAMS connections; only
+      // the body that completes the file gets a response text. A chunk that
+      // fails is resumed from the server's Upload-Offset, and the upload id
+      // is kept in localStorage so that picking the same file again after a
+      // reload carries on where it stopped. A single-request upload carries
+      // its SHA-256 where the browser offers WebCrypto (secure contexts).
+      << "<script>var C=" << UPLOAD_CHUNK_SIZE << ", N=" << UPLOAD_STREAMS << ", R=" << UPLOAD_RETRIES << ";"
+      << "function put(f,h,b){ h['Content-Disposition']=\"attachment; filename*=UTF-8''\"+encodeURIComponent(f.name);"
+      << "return fetch('/" << token << "/file',{method:'PUT', body:b, headers:h})"
+      << ".then(function(r){ return r.text().then(function(t){ if(!r.ok) throw t; return t; }); }); }"
+      << "function offset(id){ return fetch('/" << token << "/file',{method:'HEAD', headers:{'Upload-Id':id}})"
+      << ".then(function(r){ return r.ok ? +r.headers.get('Upload-Offset') : 0; }, function(){ return 0; }); }"
+      << "function saved(k,v){ try{ if(v===undefined) return localStorage.getItem(k);"
+      << "if(v) localStorage.setItem(k,v); else localStorage.removeItem(k); }catch(e){ return null; } }"
+      << "function sha(f){ if(typeof crypto=='undefined' || !crypto.subtle) return Promise.resolve({});"
+      << "return f.arrayBuffer().then(function(b){ return crypto.subtle.digest('SHA-256',b); }).then(function(d){"
+      << "return {'Repr-Digest':'sha-256=:'+btoa(String.fromCharCode.apply(null,new Uint8Array(d)))+':'}; }); }"
+      << "function chunked(f){ var key='sfh:'+f.name+':'+f.size+':'+f.lastModified, id=saved(key);"
+      << "if(!id){ id=Date.now().toString(36)+Math.random().toString(36).slice(2); saved(key,id); }"
+      << "return offset(id).then(function(off){ var n=Math.ceil(f.size/C), next=Math.floor(off/C), done=false;"
+      << "function from(i,o){ return o>i*C && o<(i+1)*C ? o : i*C; }"
+      << "return new Promise(function(ok,fail){ function send(i,a,tries){ var b=Math.min(f.size,(i+1)*C);"
+      << "put(f,{'Upload-Id':id,'Content-Range':'bytes '+a+'-'+(b-1)+'/'+f.size},f.slice(a,b))"
+      << ".then(function(t){ if(done) return; if(t){ done=true; saved(key,''); ok(t); } else go(); },"
+      << "function(e){ if(done) return; if(typeof e=='string' || tries>=R){ done=true; return fail(e); }"
+      << "setTimeout(function(){ offset(id).then(function(o){ send(i,from(i,o),tries+1); }); }, 1000*Math.min(30,1<<tries)); }); }"
+      << "function go(){ if(!done && next<n){ var i=next++; send(i,from(i,off),0); } }"
+      << "for(var k=0;k<N;k++) go(); }); }); }"
+      << "function up(fs){ if(!fs.length) return; var p;"
+      << "if(fs.length==1){ p=fs[0].size>C ? chunked(fs[0]) : sha(fs[0]).then(function(h){ return put(fs[0],h,fs[0]); }); }"
+      << "else{ var fd=new FormData(); for(var i=0;i<fs.length;i++) fd.append('file', fs[i]);"
+      << "p=fetch('',{method:'POST', body:fd}).then(r=>r.text()); }"
+      << "p.then(t=>document.body.innerHTML=t, t=>document.body.innerHTML=t); }"
+      << "var d=document.getElementById('drop'); d.ondragover=function(e){e.preventDefault();};"
+      << "d.ondrop=function(e){e.preventDefault(); up(e.dataTransfer.files); };"
+      << "document.getElementById('form').onsubmit=function(e){e.preventDefault(); up(this.file.files); };</script>"
       << "</body></html>";
     return s.str();
 }
@@ -49,3 +92,55 @@ std::string html_download_page(const std::string &token, const std::string &file
     return s.str();
 }
 
+std::string html_listing_head(const std::string &path) {
+    std::ostringstream s;
+    std::string esc_path = html_escape(path);
+    s << "<!doctype html><html><head><meta charset=\"utf-8\"><title>Index of " << esc_path << "</title>"
+      << "<style>body{font-family:Arial;padding:20px} td{padding:2px 16px 2px 0} td+td{text-align:right}</style>"
+      << "</head><body><h2>Index of " << esc_path << "</h2><table>"
+      << "<tr><th align=\"left\">Name</th><th>Size</th><th>Modified</th></tr>";
+    if (path != "/") s << "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>";
+    s << "\n";
+    return s.str();
+}
+
+std::string html_listing_entry(const std::string &name, bool is_dir, const std::string &size, time_t mtime) {
+    struct tm tm_local;
+    localtime_r(&mtime, &tm_local);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm_local);
+
+    std::string suffix = is_dir ? "/" : "";
+    return "<tr><td><a href=\"" + url_encode(name) + suffix + "\">" + html_escape(name) + suffix +
+           "</a></td><td>" + (is_dir ? "-" : size) + "</td><td>" + date + "</td></tr>\n";
+}
+
+std::string html_listing_tail() {
+    return "</table></body></html>\n";
+}
+
+
+// The entity tag is a hash of the HTML, so it changes with the page and
+// not with the server.
+std::shared_ptr<const PageResponse> PageCache::get(const std::string &key, time_t last_modified,
+                                                   const std::function<std::string()> &build) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pages_.find(key);
+    if (it != pages_.end()) return it->second;
+
+    std::string html = build();
+    Sha256 sha;
+    sha.update(html.data(), html.size());
+
+    auto page = std::make_shared<PageResponse>();
+    page->etag = "\"" + hex_encode(sha.final()).substr(0, 32) + "\"";
+    page->last_modified = last_modified;
+    page->data = "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: " +
+                 std::to_string(html.size()) + "\r\nETag: " + page->etag + "\r\nLast-Modified: " +
+                 http_date(last_modified) + "\r\nCache-Control: no-cache\r\n";
+    page->head_size = page->data.size();
+    page->data += "\r\n";
+    page->data += html;
+    pages_[key] = page;
+    return page;
+}
@@ -2,8 +2,41 @@
 #define HTTP_HANDLERS_H
 
 #include <string>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <ctime>
 
 std::string html_upload_page(const std::string &token);
 std::string html_download_page(const std::string &token, const std::string &filename, bool can_preview);
+// Pieces of a directory listing page: everything before the first entry,
+// one table row per entry (links are relative to the directory's URL, which
+// ends in '/'), and the end. `path` is the directory's path in the share.
+std::string html_listing_head(const std::string &path);
+std::string html_listing_entry(const std::string &name, bool is_dir, const std::string &size, time_t mtime);
+std::string html_listing_tail();
+
+// A complete page response: status line and headers, then the HTML, in one
+// buffer. The per-connection headers go in at `head_size`, between the last
+// header line and the empty line that ends the headers.
+struct PageResponse {
+    std::string data;
+    size_t head_size = 0;
+    std::string etag;
+    time_t last_modified = 0;
+};
+
+// The page responses of one share, each built on first use and then served
+// as is.
+class PageCache {
+public:
+    std::shared_ptr<const PageResponse> get(const std::string &key, time_t last_modified,
+                                            const std::function<std::string()> &build);
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<const PageResponse>> pages_;
+};
 
 #endif
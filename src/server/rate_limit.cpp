@@ -0,0 +1,59 @@
+#include "rate_limit.h"
+#include <algorithm>
+
+static const double RATE_BURST_SECONDS = 0.5;
+static const long long RATE_MIN_BURST = 64 * 1024;
+
+long long rate_burst(long long rate) {
+    return std::max((long long)(rate * RATE_BURST_SECONDS), RATE_MIN_BURST);
+}
+
+TokenBucket::TokenBucket(long long rate, long long burst)
+    : rate_(rate), burst_((double)burst), tokens_((double)burst), last_(std::chrono::steady_clock::now()) {}
+
+size_t TokenBucket::grant(size_t want, std::chrono::steady_clock::time_point& ready) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+    last_ = now;
+
+    if (tokens_ < 1) {
+        // Wait for a useful amount rather than waking up for every byte.
+        double need = std::min(burst_, std::max(1.0, (double)want)) / 4 - tokens_;
+        ready = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                          std::chrono::duration<double>(std::max(need, 1.0) / rate_));
+        return 0;
+    }
+    size_t n = std::min(want, (size_t)tokens_);
+    tokens_ -= (double)n;
+    return n;
+}
+
+void TokenBucket::refund(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tokens_ = std::min(burst_, tokens_ + (double)n);
+}
+
+size_t Throttle::grant(size_t want) {
+    if (conn_) {
+        want = conn_->grant(want, until_);
+        if (want == 0) return 0;
+    }
+    if (global_) {
+        size_t n = global_->grant(want, until_);
+        if (conn_ && n < want) conn_->refund(want - n);
+        want = n;
+    }
+    return want;
+}
+
+void Throttle::used(size_t granted, size_t moved) {
+    if (moved >= granted) return;
+    if (conn_) conn_->refund(granted - moved);
+    if (global_) global_->refund(granted - moved);
+}
+
+long long Throttle::limit() const {
+    if (conn_ && global_) return std::min(conn_->rate(), global_->rate());
+    return conn_ ? conn_->rate() : global_ ? global_->rate() : 0;
+}
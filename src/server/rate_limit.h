@@ -0,0 +1,57 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+
+// Token bucket: `rate` bytes per second, with up to `burst` bytes available
+// at once after a quiet period. Bytes are granted before they are moved and
+// whatever the socket did not take is returned.
+class TokenBucket {
+public:
+    TokenBucket(long long rate, long long burst);
+
+    // Up to `want` bytes that may be moved now. When there are none, returns
+    // 0 and sets `ready` to when some will be.
+    size_t grant(size_t want, std::chrono::steady_clock::time_point& ready);
+    void refund(size_t n);
+    long long rate() const { return rate_; }
+
+private:
+    std::mutex mutex_;
+    long long rate_;
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+// Bucket size for a rate: half a second of traffic, at least 64 KiB.
+long long rate_burst(long long rate);
+
+// The buckets one transfer draws from: the server-wide one and its
+// connection's, either of which may be absent.
+class Throttle {
+public:
+    Throttle() = default;
+    Throttle(std::shared_ptr<TokenBucket> global, std::shared_ptr<TokenBucket> conn)
+        : global_(std::move(global)), conn_(std::move(conn)) {}
+
+    bool active() const { return global_ || conn_; }
+    // Bytes that may be moved now, at most `want`; 0 with until() set when
+    // the transfer has to wait.
+    size_t grant(size_t want);
+    // After a grant: `moved` of the `granted` bytes went out.
+    void used(size_t granted, size_t moved);
+    std::chrono::steady_clock::time_point until() const { return until_; }
+    // Lowest configured rate in bytes per second, 0 when unlimited.
+    long long limit() const;
+
+private:
+    std::shared_ptr<TokenBucket> global_;
+    std::shared_ptr<TokenBucket> conn_;
+    std::chrono::steady_clock::time_point until_{};
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "request_parser.h"
+#include <strings.h>
+
+static const std::string_view HEAD_END = "\r\n\r\n";
+
+static std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+static bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+RequestParser::Status RequestParser::feed(std::string_view buf) {
+    if (head_size_ > 0) return Status::Complete;
+
+    // The terminator may straddle the previous end of the buffer.
+    size_t from = scanned_ >= HEAD_END.size() - 1 ? scanned_ - (HEAD_END.size() - 1) : 0;
+    size_t end = buf.find(HEAD_END, from);
+    if (end == std::string_view::npos) {
+        scanned_ = buf.size();
+        return buf.size() > MAX_HEAD_SIZE ? Status::TooLarge : Status::Incomplete;
+    }
+    if (end + HEAD_END.size() > MAX_HEAD_SIZE) return Status::TooLarge;
+    head_size_ = end + HEAD_END.size();
+    return Status::Complete;
+}
+
+RequestParser::Status RequestParser::parse(std::string_view head) {
+    field_count_ = 0;
+    content_length_ = -1;
+
+    size_t eol = head.find("\r\n");
+    if (eol == std::string_view::npos) return Status::Invalid;
+    std::string_view line = head.substr(0, eol);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+    if (sp1 == 0 || sp2 == std::string_view::npos || sp2 == sp1 + 1) return Status::Invalid;
+    method_ = line.substr(0, sp1);
+    target_ = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    version_ = line.substr(sp2 + 1);
+
+    size_t pos = eol + 2;
+    while (pos < head.size()) {
+        eol = head.find("\r\n", pos);
+        if (eol == std::string_view::npos || eol == pos) break;
+        line = head.substr(pos, eol - pos);
+        pos = eol + 2;
+
+        size_t colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos) return Status::Invalid;
+        if (field_count_ == MAX_FIELDS) return Status::TooLarge;
+        Field& f = fields_[field_count_++];
+        f.name = line.substr(0, colon);
+        f.value = trim(line.substr(colon + 1));
+    }
+
+    std::string_view length = header("Content-Length");
+    if (!length.empty() && length.size() <= 18) {
+        long long n = 0;
+        for (char c : length) {
+            if (c < '0' || c > '9') {
+                n = -1;
+                break;
+            }
+            n = n * 10 + (c - '0');
+        }
+        content_length_ = n;
+    }
+    return Status::Complete;
+}
+
+void RequestParser::reset() {
+    scanned_ = 0;
+    head_size_ = 0;
+}
+
+std::string_view RequestParser::header(std::string_view name) const {
+    for (size_t i = 0; i < field_count_; ++i) {
+        if (iequals(fields_[i].name, name)) return fields_[i].value;
+    }
+    return std::string_view();
+}
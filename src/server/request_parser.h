@@ -0,0 +1,59 @@
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include <string_view>
+#include <cstddef>
+
+// HTTP/1.1 request head parser that works in place. feed() is called with
+// the buffered input after every read and continues the search for the end
+// of the head where the previous call stopped; parse() then splits the
+// request line and header fields of the complete head into views of the
+// caller's buffer. Nothing is copied or allocated, so the views are valid as
+// long as that buffer is unchanged.
+class RequestParser {
+public:
+    enum class Status { Incomplete, Complete, TooLarge, Invalid };
+
+    // Longest accepted head, and most header fields in one.
+    static const size_t MAX_HEAD_SIZE = 64 * 1024;
+    static const size_t MAX_FIELDS = 100;
+
+    // Looks for the empty line that ends the head in `buf`, which must hold
+    // what the previous calls saw followed by new data.
+    Status feed(std::string_view buf);
+    // Bytes of the head, the final CRLF CRLF included, once feed() is Complete.
+    size_t head_size() const { return head_size_; }
+
+    // Tokenizes a complete head (head_size() bytes of the buffer).
+    Status parse(std::string_view head);
+    // Looks for the next head from the start of the buffer. What parse()
+    // found stays available until it is called again.
+    void reset();
+
+    std::string_view method() const { return method_; }
+    std::string_view target() const { return target_; }
+    std::string_view version() const { return version_; }
+
+    // Value of the first field called `name` (case-insensitive), without
+    // surrounding whitespace; empty when there is none.
+    std::string_view header(std::string_view name) const;
+    // Content-Length, or -1 when it is missing or malformed.
+    long long content_length() const { return content_length_; }
+
+private:
+    struct Field {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    size_t scanned_ = 0;
+    size_t head_size_ = 0;
+    std::string_view method_;
+    std::string_view target_;
+    std::string_view version_;
+    Field fields_[MAX_FIELDS];
+    size_t field_count_ = 0;
+    long long content_length_ = -1;
+};
+
+#endif
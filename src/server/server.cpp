@@ -2,6 +2,13 @@
 #include "../utils/server_utils.h"
 #include "../utils/network_utils.h"
 #include "client_handler.h"
+#include "chunked_upload.h"
+#include "rate_limit.h"
+#include "file_cache.h"
+#include "../utils/digest_utils.h"
+#include "../utils/file_utils.h"
+#include "event_loop.h"
+#include "uring.h"
 #include "../utils/utils.h"
 #include <thread>
 #include <cstring>
@@ -35,10 +42,19 @@ bool SimpleHTTPServer::set_socket_timeout(int fd, int seconds) {
 }
 
 SimpleHTTPServer::SimpleHTTPServer(const ServerOptions &opt)
-    : opts(opt), port(opt.port) {}
+    : opts(opt), port(opt.port) {
+    if (!opts.uploads) opts.uploads = std::make_shared<UploadRegistry>(opts.max_size);
+    if (!opts.started) opts.started = time(nullptr);
+    if (!opts.pages) opts.pages = std::make_shared<PageCache>();
+    if (!opts.files) opts.files = std::make_shared<FileCache>(opts.compress);
+    if (opts.rate_limit > 0 && !opts.rate_bucket) {
+        opts.rate_bucket = std::make_shared<TokenBucket>(opts.rate_limit, rate_burst(opts.rate_limit));
+    }
+}
 
 SimpleHTTPServer::~SimpleHTTPServer() { 
     stop();
+    event_loop.reset();
     if (ssl_ctx) {
         SSL_CTX_free(ssl_ctx);
         ssl_ctx = nullptr;
@@ -61,11 +77,45 @@ void SimpleHTTPServer::remove_client_socket(int fd) {
 void SimpleHTTPServer::close_all_client_sockets() {
     std::lock_guard<std::mutex> lock(clients_mutex);
     for (int fd : client_sockets) {
-        close(fd);
+        shutdown(fd, SHUT_RDWR);
     }
     client_sockets.clear();
 }
 
+void SimpleHTTPServer::record_served(const std::vector<ByteRange>& ranges, long long total, bool complete) {
+    if (total < 0) return;
+    {
+        std::lock_guard<std::mutex> lock(served_mutex);
+        if (download_done) return;
+
+        for (const auto& r : ranges) {
+            if (r.length > 0) served_ranges.push_back(r);
+        }
+        std::sort(served_ranges.begin(), served_ranges.end(),
+                  [](const ByteRange& a, const ByteRange& b) { return a.start < b.start; });
+
+        std::vector<ByteRange> merged;
+        for (const auto& r : served_ranges) {
+            if (!merged.empty() && r.start <= merged.back().start + merged.back().length) {
+                long long end = std::max(merged.back().start + merged.back().length, r.start + r.length);
+                merged.back().length = end - merged.back().start;
+            } else {
+                merged.push_back(r);
+            }
+        }
+        served_ranges.swap(merged);
+
+        // Only a response that finished cleanly can complete the download, so a
+        // client that dropped mid-way can still come back and resume.
+        bool covered = total == 0 ||
+                       (!served_ranges.empty() && served_ranges[0].start == 0 && served_ranges[0].length >= total);
+        if (!complete || ranges.empty() || !covered) return;
+        download_done = true;
+    }
+
+    if (on_client_done) on_client_done();
+}
+
 bool SimpleHTTPServer::start() {
     vlog("Starting server...");
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -101,7 +151,7 @@ bool SimpleHTTPServer::start() {
             port = ntohs(addr.sin_port);
     }
 
-    if (listen(listen_fd, 5) < 0) {
+    if (listen(listen_fd, SOMAXCONN) < 0) {
         vlog("Listen failed");
         return false;
     }
@@ -147,9 +197,46 @@ bool SimpleHTTPServer::start() {
             return false;
         }
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+        // Let OpenSSL hand the record layer to the kernel when the negotiated
+        // cipher allows it, so downloads can stay on the sendfile path.
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+        vlog("Kernel TLS offload enabled on SSL context");
+#endif
+
         vlog("TLS initialized");
     }
 
+    if (opts.io_engine == "uring" || opts.io_engine == "auto") {
+        if (Uring::supported()) {
+            opts.io_engine = "uring";
+            vlog("File I/O engine: io_uring");
+        } else {
+            if (opts.io_engine == "uring" && on_log) on_log("io_uring not supported by this kernel, using sync file I/O");
+            opts.io_engine = "sync";
+        }
+    }
+
+    if (opts.mode == "send" && !opts.archive && !opts.digest) {
+        // Responses carry the digest once it is known. Hashing starts right
+        // away, since sendfile() never brings the data into user space.
+        auto log = on_log;
+        std::string name = file_basename(opts.path);
+        opts.digest = std::make_shared<FileDigest>([log, name](const std::string& hex) {
+            if (log) log("SHA-256 of " + name + ": " + hex);
+        });
+        if (auto file = opts.files->get(opts.path)) opts.digest->refresh(opts.path, file->st);
+    }
+
+    if (opts.event_loop_threads > 0) {
+        event_loop.reset(new EventLoop(opts.event_loop_threads));
+        if (!event_loop->start()) {
+            vlog("Failed to start event loop");
+            event_loop.reset();
+            return false;
+        }
+    }
+
     running = true;
     std::thread(&SimpleHTTPServer::server_loop, this).detach();
 
@@ -166,7 +253,13 @@ void SimpleHTTPServer::stop() {
     if (running) {
         running = false;
         close_all_client_sockets(); 
+        if (event_loop) {
+            event_loop->stop();
+        }
         if (listen_fd != -1) {
+            // shutdown() releases the port right away; a bare close() leaves
+            // the socket listening until server_loop's poll() lets go of it.
+            shutdown(listen_fd, SHUT_RDWR);
             close(listen_fd);
             listen_fd = -1;
         }
@@ -204,63 +297,76 @@ void SimpleHTTPServer::server_loop() {
         }
         
         if (poll_result == 0) {
+            opts.uploads->expire();
             continue;
         }
         
         if (fds[0].revents & POLLIN) {
-            sockaddr_in cli{};
-            socklen_t clilen = sizeof(cli);
-            int fd = accept(listen_fd, (sockaddr *)&cli, &clilen);
-            
-            if (fd < 0) {
-                if (!running) break;
-                continue;
-            }
+            // Drain the whole backlog: a QR-code scan burst arrives all at once.
+            while (running) {
+                sockaddr_in cli{};
+                socklen_t clilen = sizeof(cli);
+                int fd = accept(listen_fd, (sockaddr *)&cli, &clilen);
 
-            SSL* client_ssl = nullptr;
-            if (ssl_ctx && get_tls_enabled()) {
-                int flags = fcntl(fd, F_GETFL, 0);
-                fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
-
-                client_ssl = SSL_new(ssl_ctx);
-                if (!client_ssl) {
-                    vlog("Failed to create SSL object for client");
-                    close(fd);
-                    continue;
-                }
-                SSL_set_fd(client_ssl, fd);
-
-                if (SSL_accept(client_ssl) <= 0) {
-                    vlog("TLS handshake failed for incoming client");
-                    SSL_shutdown(client_ssl);
-                    SSL_free(client_ssl);
-                    close(fd);
-                    continue;
+                if (fd < 0) {
+                    if (errno == EINTR) continue;
+                    break;
                 }
+                accept_client(fd, cli);
             }
-
-            set_socket_timeout(fd, opts.socket_timeout_seconds);
-            
-            fcntl(fd, F_SETFL, O_NONBLOCK);
-            
-            add_client_socket(fd);
-            
-            vlog("New client connected: " + get_client_ip(fd));
-            if (on_log) {
-                std::ostringstream ss;
-                ss << "Client connected: " << inet_ntoa(cli.sin_addr) << ":" << ntohs(cli.sin_port);
-                on_log(ss.str());
-            }
-
-            std::thread([this, fd, client_ssl]() {
-                ClientHandler handler(this->opts, fd, client_ssl);
-                handler.on_log = this->on_log;
-                handler.on_client_done = this->on_client_done;
-                handler.handle();
-                
-                remove_client_socket(fd);
-            }).detach();
         }
     }
     vlog("Server loop ended");
 }
+
+void SimpleHTTPServer::accept_client(int fd, const sockaddr_in& cli) {
+    // The TLS handshake is not run here: it is the first step of the
+    // ClientHandler state machine, so a slow client cannot stall accept().
+    SSL* client_ssl = nullptr;
+    if (ssl_ctx && get_tls_enabled()) {
+        client_ssl = SSL_new(ssl_ctx);
+        if (!client_ssl) {
+            vlog("Failed to create SSL object for client");
+            close(fd);
+            return;
+        }
+        SSL_set_fd(client_ssl, fd);
+        SSL_set_accept_state(client_ssl);
+    }
+
+    set_socket_timeout(fd, opts.socket_timeout_seconds);
+    
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    
+    vlog("New client connected: " + get_client_ip(fd));
+    if (on_log) {
+        std::ostringstream ss;
+        ss << "Client connected: " << inet_ntoa(cli.sin_addr) << ":" << ntohs(cli.sin_port);
+        on_log(ss.str());
+    }
+
+    if (event_loop) {
+        auto handler = std::make_shared<ClientHandler>(this->opts, fd, client_ssl);
+        handler->on_log = this->on_log;
+        handler->on_client_done = this->on_client_done;
+        handler->on_file_served = [this](const std::vector<ByteRange>& r, long long total, bool complete) {
+            record_served(r, total, complete);
+        };
+        event_loop->add(handler);
+        return;
+    }
+
+    add_client_socket(fd);
+
+    std::thread([this, fd, client_ssl]() {
+        ClientHandler handler(this->opts, fd, client_ssl);
+        handler.on_log = this->on_log;
+        handler.on_client_done = this->on_client_done;
+        handler.on_file_served = [this](const std::vector<ByteRange>& r, long long total, bool complete) {
+            record_served(r, total, complete);
+        };
+        handler.handle();
+        
+        remove_client_socket(fd);
+    }).detach();
+}
@@ -6,11 +6,21 @@
 #include <atomic>
 #include <vector>
 #include <mutex>
+#include <memory>
 
 
 #include <openssl/ssl.h>
+#include <netinet/in.h>
+#include "../utils/server_utils.h"
 
 
+class ZipPlan;
+class UploadRegistry;
+class FileDigest;
+class PageCache;
+class TokenBucket;
+class FileCache;
+
 struct ServerOptions {
     int port = 0;
     std::string token;
@@ -22,8 +32,36 @@ struct ServerOptions {
     std::string working_dir = ".";
     std::atomic<bool>* interrupted = nullptr;
     int socket_timeout_seconds = 30;
+    int event_loop_threads = 0;
+    std::string io_engine = "sync";
+    int keep_alive_timeout_seconds = 5;
+    int keep_alive_max_requests = 100;
+    // Upload durability: "none", "end" or "periodic" (see SyncMode).
+    std::string sync_mode = "none";
+    // Compress /file and /raw for clients that accept gzip or br.
+    bool compress = true;
+    // Bandwidth limits in bytes per second for all transfers together and
+    // for each connection; 0 is unlimited.
+    long long rate_limit = 0;
+    long long conn_rate_limit = 0;
+    // Set by senddir: /file streams this zip archive instead of `path`.
+    std::shared_ptr<ZipPlan> archive;
+    // Set by the server: chunked uploads in progress, shared by all clients.
+    std::shared_ptr<UploadRegistry> uploads;
+    // Set by the server: when it started, the Last-Modified of its pages.
+    time_t started = 0;
+    // Set by the server when rate_limit is set: the bucket all transfers share.
+    std::shared_ptr<TokenBucket> rate_bucket;
+    // Set by the server: its pages, built once.
+    std::shared_ptr<PageCache> pages;
+    // Set by the server: the files it sends, open and with their metadata.
+    std::shared_ptr<FileCache> files;
+    // Set by the server when sending a file: its SHA-256, once hashed.
+    std::shared_ptr<FileDigest> digest;
 };
 
+class EventLoop;
+
 class SimpleHTTPServer {
 public:
     SimpleHTTPServer(const ServerOptions& opt);
@@ -32,6 +70,7 @@ public:
     bool start();
     void stop();
     std::string host_url() const;
+    int get_port() const { return port; }
     
     std::function<void(const std::string&)> on_log;
     std::function<void()> on_client_done;
@@ -43,16 +82,25 @@ private:
     std::atomic<bool> running{false};
     std::vector<int> client_sockets;
     std::mutex clients_mutex;
+    // Byte ranges of the shared file delivered so far; the download counts as
+    // done once they cover the whole file, however many requests that took.
+    std::vector<ByteRange> served_ranges;
+    std::mutex served_mutex;
+    bool download_done = false;
     
     void server_loop();
+    void accept_client(int fd, const sockaddr_in& cli);
     void add_client_socket(int fd);
     void remove_client_socket(int fd);
     void close_all_client_sockets();
+    void record_served(const std::vector<ByteRange>& ranges, long long total, bool complete);
     bool set_socket_timeout(int fd, int seconds);
 
 
     SSL_CTX* ssl_ctx = nullptr;
 
+    std::unique_ptr<EventLoop> event_loop;
+
 };
 
 #endif
@@ -0,0 +1,175 @@
+#include "socket_io.h"
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static ssize_t ssl_result(SSL* ssl, int r, IoStatus& st) {
+    int err = SSL_get_error(ssl, r);
+    if (err == SSL_ERROR_WANT_READ) {
+        st = IoStatus::WantRead;
+        return -1;
+    }
+    if (err == SSL_ERROR_WANT_WRITE) {
+        st = IoStatus::WantWrite;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        st = IoStatus::Done;
+        return 0;
+    }
+    ERR_clear_error();
+    st = IoStatus::Error;
+    return -1;
+}
+
+ssize_t sock_read(int fd, SSL* ssl, void* buf, size_t len, IoStatus& st) {
+    if (ssl) {
+        int r = SSL_read(ssl, buf, (int)len);
+        if (r > 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        return ssl_result(ssl, r, st);
+    }
+
+    while (true) {
+        ssize_t r = ::recv(fd, buf, len, 0);
+        if (r >= 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        if (errno == EINTR) continue;
+        st = (errno == EAGAIN || errno == EWOULDBLOCK) ? IoStatus::WantRead : IoStatus::Error;
+        return -1;
+    }
+}
+
+ssize_t sock_write(int fd, SSL* ssl, const void* buf, size_t len, IoStatus& st) {
+    if (ssl) {
+        int r = SSL_write(ssl, buf, (int)len);
+        if (r > 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        ssize_t res = ssl_result(ssl, r, st);
+        if (res == 0) st = IoStatus::Error;
+        return -1;
+    }
+
+    while (true) {
+        ssize_t r = ::send(fd, buf, len, MSG_NOSIGNAL);
+        if (r > 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            st = IoStatus::WantWrite;
+            return -1;
+        }
+        st = IoStatus::Error;
+        return -1;
+    }
+}
+
+ssize_t sock_writev(int fd, SSL* ssl, const struct iovec* iov, int iovcnt, IoStatus& st) {
+    if (ssl) {
+        // TLS frames each buffer separately; send the first non-empty one.
+        for (int i = 0; i < iovcnt; ++i) {
+            if (iov[i].iov_len > 0) return sock_write(fd, ssl, iov[i].iov_base, iov[i].iov_len, st);
+        }
+        st = IoStatus::Done;
+        return 0;
+    }
+
+    struct msghdr msg = {};
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = iovcnt;
+    while (true) {
+        ssize_t r = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (r >= 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        if (errno == EINTR) continue;
+        st = (errno == EAGAIN || errno == EWOULDBLOCK) ? IoStatus::WantWrite : IoStatus::Error;
+        return -1;
+    }
+}
+
+ssize_t sock_sendfile(int fd, SSL* ssl, int file_fd, off_t& offset, size_t len, IoStatus& st) {
+    if (ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+        ossl_ssize_t r = SSL_sendfile(ssl, file_fd, offset, len, 0);
+        if (r > 0) {
+            offset += r;
+            st = IoStatus::Done;
+            return r;
+        }
+        ssize_t res = ssl_result(ssl, (int)r, st);
+        if (res == 0) st = IoStatus::Error;
+        return -1;
+#else
+        st = IoStatus::Error;
+        return -1;
+#endif
+    }
+
+    while (true) {
+        ssize_t r = ::sendfile(fd, file_fd, &offset, len);
+        if (r > 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        if (r == 0) {
+            st = IoStatus::Error;
+            return 0;
+        }
+        if (errno == EINTR) continue;
+        st = (errno == EAGAIN || errno == EWOULDBLOCK) ? IoStatus::WantWrite : IoStatus::Error;
+        return -1;
+    }
+}
+
+ssize_t sock_splice(int fd, int pipe_fd, size_t len, IoStatus& st) {
+    while (true) {
+        ssize_t r = ::splice(fd, nullptr, pipe_fd, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r >= 0) {
+            st = IoStatus::Done;
+            return r;
+        }
+        if (errno == EINTR) continue;
+        st = (errno == EAGAIN || errno == EWOULDBLOCK) ? IoStatus::WantRead : IoStatus::Error;
+        return -1;
+    }
+}
+
+bool sock_ktls_send(SSL* ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)) == 1;
+#else
+    (void)ssl;
+    return false;
+#endif
+}
+
+bool wait_for_io(int fd, IoStatus want, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = (want == IoStatus::WantWrite) ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r < 0) return errno == EINTR;
+    return r > 0;
+}
+
+int wait_timeout_ms(std::chrono::steady_clock::time_point deadline, int cap_ms) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    if (left.count() < 1) return 1;
+    return left.count() < cap_ms ? (int)left.count() : cap_ms;
+}
@@ -0,0 +1,51 @@
+#ifndef SOCKET_IO_H
+#define SOCKET_IO_H
+
+#include <string>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+#include <openssl/ssl.h>
+
+
+// Result of one non-blocking step of a connection state machine.
+// WantRead/WantWrite tell the driver which readiness to wait for before
+// calling the step again.
+enum class IoStatus { Done, WantRead, WantWrite, Error };
+
+// Non-blocking read/write over a plain or TLS socket.
+// Return the number of bytes transferred (> 0), 0 when the peer closed the
+// connection, or -1 with `st` set to WantRead/WantWrite (would block) or Error.
+ssize_t sock_read(int fd, SSL* ssl, void* buf, size_t len, IoStatus& st);
+ssize_t sock_write(int fd, SSL* ssl, const void* buf, size_t len, IoStatus& st);
+// Gathered write: one sendmsg() on plain sockets; over TLS only the first
+// non-empty buffer is written per call.
+ssize_t sock_writev(int fd, SSL* ssl, const struct iovec* iov, int iovcnt, IoStatus& st);
+
+// Zero-copy file send: sendfile() on plain sockets, SSL_sendfile() on TLS
+// sockets whose write side has been offloaded to the kernel (kTLS).
+// Advances `offset` by the number of bytes sent; same return contract as above.
+ssize_t sock_sendfile(int fd, SSL* ssl, int file_fd, off_t& offset, size_t len, IoStatus& st);
+
+// Moves up to `len` bytes from a plain socket into the pipe `pipe_fd` with
+// splice(), so received data never enters user space. Same return contract
+// as sock_read(); errno is EINVAL when the socket cannot be spliced.
+ssize_t sock_splice(int fd, int pipe_fd, size_t len, IoStatus& st);
+
+// True when the kernel accepted the negotiated cipher for TLS transmit offload.
+bool sock_ktls_send(SSL* ssl);
+
+// Longest wait for the socket in the blocking loops before the interrupt
+// flag is looked at again; readiness ends the wait at once.
+const int INTERRUPT_CHECK_MS = 500;
+
+// Waits until the socket is ready for the direction `want` asks for.
+// Returns false on timeout or poll failure.
+bool wait_for_io(int fd, IoStatus want, int timeout_ms);
+// Timeout for wait_for_io() that ends at `deadline`: the milliseconds left,
+// at least 1 and at most `cap_ms`.
+int wait_timeout_ms(std::chrono::steady_clock::time_point deadline, int cap_ms);
+
+#endif
@@ -0,0 +1,228 @@
+#include "uring.h"
+#include "../utils/utils.h"
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+#endif
+
+bool Uring::supported() {
+#ifdef HAVE_IO_URING
+    static std::once_flag once;
+    static bool ok = false;
+    std::call_once(once, []() {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = sys_io_uring_setup(2, &p);
+        if (fd >= 0) {
+            ok = true;
+            close(fd);
+        } else {
+            vlog(std::string("io_uring unavailable: ") + strerror(errno));
+        }
+    });
+    return ok;
+#else
+    return false;
+#endif
+}
+
+Uring::~Uring() {
+    if (sqes_ptr_) munmap(sqes_ptr_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_) munmap(sq_ptr_, sq_size_);
+    if (ring_fd_ >= 0) close(ring_fd_);
+}
+
+bool Uring::init(unsigned entries, unsigned buffer_count, size_t buffer_size) {
+#ifdef HAVE_IO_URING
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd_ = sys_io_uring_setup(entries, &p);
+    if (ring_fd_ < 0) {
+        vlog(std::string("io_uring_setup failed: ") + strerror(errno));
+        return false;
+    }
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        sq_ptr_ = nullptr;
+        return false;
+    }
+
+    if (single_mmap) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            cq_ptr_ = nullptr;
+            return false;
+        }
+    }
+
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ptr_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_SQES);
+    if (sqes_ptr_ == MAP_FAILED) {
+        sqes_ptr_ = nullptr;
+        return false;
+    }
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sq_entries_ = p.sq_entries;
+
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = cq + p.cq_off.cqes;
+
+    buffer_size_ = buffer_size;
+    buffers_.resize(buffer_count);
+    std::vector<struct iovec> iov(buffer_count);
+    for (unsigned i = 0; i < buffer_count; ++i) {
+        buffers_[i].resize(buffer_size);
+        iov[i].iov_base = buffers_[i].data();
+        iov[i].iov_len = buffer_size;
+    }
+
+    if (sys_io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, iov.data(), buffer_count) < 0) {
+        vlog(std::string("io_uring buffer registration failed: ") + strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void)entries;
+    (void)buffer_count;
+    (void)buffer_size;
+    return false;
+#endif
+}
+
+void* Uring::next_sqe() {
+#ifdef HAVE_IO_URING
+    unsigned tail = *sq_tail_;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head >= sq_entries_) {
+        if (!submit(0)) return nullptr;
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (tail - head >= sq_entries_) return nullptr;
+    }
+
+    unsigned idx = tail & *sq_mask_;
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes_ptr_) + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[idx] = idx;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++queued_;
+    return sqe;
+#else
+    return nullptr;
+#endif
+}
+
+bool Uring::prep_read(int fd, unsigned buf, size_t len, off_t offset, uint64_t tag) {
+#ifdef HAVE_IO_URING
+    auto* sqe = static_cast<struct io_uring_sqe*>(next_sqe());
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffers_[buf].data());
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = (uint16_t)buf;
+    sqe->user_data = tag;
+    return true;
+#else
+    (void)fd; (void)buf; (void)len; (void)offset; (void)tag;
+    return false;
+#endif
+}
+
+bool Uring::prep_write(int fd, unsigned buf, size_t buf_offset, size_t len, off_t offset, uint64_t tag) {
+#ifdef HAVE_IO_URING
+    auto* sqe = static_cast<struct io_uring_sqe*>(next_sqe());
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffers_[buf].data() + buf_offset);
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = (uint16_t)buf;
+    sqe->user_data = tag;
+    return true;
+#else
+    (void)fd; (void)buf; (void)buf_offset; (void)len; (void)offset; (void)tag;
+    return false;
+#endif
+}
+
+bool Uring::submit(unsigned wait_nr) {
+#ifdef HAVE_IO_URING
+    if (queued_ == 0 && wait_nr == 0) return true;
+
+    while (true) {
+        int r = sys_io_uring_enter(ring_fd_, queued_, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            vlog(std::string("io_uring_enter failed: ") + strerror(errno));
+            return false;
+        }
+        in_flight_ += (unsigned)r;
+        queued_ -= (unsigned)r;
+        return true;
+    }
+#else
+    (void)wait_nr;
+    return false;
+#endif
+}
+
+bool Uring::pop(uint64_t& tag, int& res) {
+#ifdef HAVE_IO_URING
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+
+    const struct io_uring_cqe* cqe = static_cast<const struct io_uring_cqe*>(cqes_) + (head & *cq_mask_);
+    tag = cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    if (in_flight_ > 0) --in_flight_;
+    return true;
+#else
+    (void)tag;
+    (void)res;
+    return false;
+#endif
+}
@@ -0,0 +1,70 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/types.h>
+
+// Minimal io_uring ring over the raw syscalls (no liburing dependency).
+// The ring owns a small set of registered buffers; reads and writes are
+// queued against a buffer index and submitted together with one
+// io_uring_enter call.
+class Uring {
+public:
+    Uring() = default;
+    ~Uring();
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    // True when the running kernel accepts io_uring_setup (probed once).
+    static bool supported();
+
+    bool init(unsigned entries, unsigned buffer_count, size_t buffer_size);
+
+    unsigned buffer_count() const { return (unsigned)buffers_.size(); }
+    size_t buffer_size() const { return buffer_size_; }
+    char* buffer(unsigned idx) { return buffers_[idx].data(); }
+
+    bool prep_read(int fd, unsigned buf, size_t len, off_t offset, uint64_t tag);
+    bool prep_write(int fd, unsigned buf, size_t buf_offset, size_t len, off_t offset, uint64_t tag);
+
+    // Submits all queued requests and waits for at least `wait_nr` completions.
+    bool submit(unsigned wait_nr = 0);
+    // Pops one completion; returns false when the completion queue is empty.
+    bool pop(uint64_t& tag, int& res);
+
+    unsigned in_flight() const { return in_flight_; }
+
+private:
+    int ring_fd_ = -1;
+
+    void* sq_ptr_ = nullptr;
+    size_t sq_size_ = 0;
+    void* cq_ptr_ = nullptr;
+    size_t cq_size_ = 0;
+    void* sqes_ptr_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_entries_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    void* cqes_ = nullptr;
+
+    unsigned queued_ = 0;
+    unsigned in_flight_ = 0;
+
+    std::vector<std::vector<char>> buffers_;
+    size_t buffer_size_ = 0;
+
+    void* next_sqe();
+};
+
+#endif
@@ -1,146 +1,507 @@
 #include "archive_utils.h"
+#include "zip_stream.h"
 #include "../utils/utils.h"
-#include <archive.h>
-#include <archive_entry.h>
+#include "../utils/file_utils.h"
+#include <zlib.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <iostream>
 #include <filesystem>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
 #include <system_error>
 #include <cerrno>
-#include <limits.h>
 
 namespace fs = std::filesystem;
 
-static int add_file_to_archive(struct archive *a, const fs::path &file_path, const fs::path &base_path, const std::string &root_folder = "") {
-    struct archive_entry *entry = archive_entry_new();
-    if (!entry) return -1;
+// Files are cut into blocks that are deflated independently (each primed with
+// the previous 32 KiB as dictionary and ended on a byte boundary with a sync
+// flush), so the blocks of one entry, and the entries of a tree, compress in
+// parallel and still concatenate into ordinary deflate streams.
+static const size_t BLOCK_SIZE = 1024 * 1024;
+static const size_t DICT_SIZE = 32 * 1024;
+static const size_t BLOCKS_IN_FLIGHT_PER_THREAD = 4;
 
-    std::string fullpath = file_path.string();
-    std::string relpath;
-    try {
-        relpath = fs::relative(file_path, base_path).string();
-    } catch (const std::exception &) {
-        relpath = file_path.filename().string();
+// Output is handed to the volume writer thread in chunks of this size.
+static const size_t OUTPUT_CHUNK_SIZE = 4 * 1024 * 1024;
+static const size_t OUTPUT_CHUNKS_QUEUED = 4;
+
+static std::atomic<int> g_archive_threads{0};
+
+void set_archive_threads(int threads) {
+    g_archive_threads = threads;
+}
+
+int get_archive_threads() {
+    return g_archive_threads;
+}
+
+std::string split_volume_name(const std::string &base, size_t index) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%03zu", index);
+    return base + suffix;
+}
+
+std::vector<std::string> find_split_volumes(const std::string &path) {
+    std::string base = path;
+    static const std::string first = ".001";
+    if (base.size() > first.size() && base.compare(base.size() - first.size(), first.size(), first) == 0) {
+        base.resize(base.size() - first.size());
+    } else if (file_exists(base)) {
+        return {};
     }
-    for (auto &c : relpath) if (c == '\\') c = '/';
 
-    std::string pathname = relpath;
-    if (!root_folder.empty()) {
-        pathname = root_folder + "/" + relpath;
+    std::vector<std::string> out;
+    for (size_t i = 1;; ++i) {
+        std::string v = split_volume_name(base, i);
+        if (!file_exists(v)) break;
+        out.push_back(v);
     }
+    return out;
+}
+
+namespace {
+
+// Sink for the archive bytes. Writes are buffered into chunks that a separate
+// thread puts on disk, so disk I/O overlaps with compression. With a split
+// size the byte stream is cut into volumes of exactly that size (name.001,
+// name.002, ...; the last one holds the remainder) in the same pass.
+class VolumeWriter {
+public:
+    VolumeWriter(const std::string &path, uint64_t split_size)
+        : path_(path), split_(split_size) {}
+    ~VolumeWriter() { finish(); }
+
+    bool start();
+    bool write(const char *p, size_t n);
+    // Flushes what is buffered and waits for the writer thread.
+    bool finish();
+    // Removes everything written so far.
+    void discard();
+
+private:
+    std::string path_;
+    uint64_t split_;
+
+    std::string chunk_;
+    std::deque<std::string> queue_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool closing_ = false;
+    bool failed_ = false;
+    std::thread thread_;
 
-    bool is_dir = fs::is_directory(file_path);
-    if (is_dir) {
-        if (pathname.empty() || pathname.back() != '/') pathname += '/';
+    int fd_ = -1;
+    uint64_t volume_written_ = 0;
+    std::vector<std::string> paths_;
+
+    bool submit();
+    void run();
+    bool write_out(const std::string &chunk);
+    bool open_volume();
+    bool close_volume();
+};
+
+bool VolumeWriter::start() {
+    if (split_ == 0 && !open_volume()) return false;
+    chunk_.reserve(OUTPUT_CHUNK_SIZE);
+    thread_ = std::thread(&VolumeWriter::run, this);
+    return true;
+}
+
+bool VolumeWriter::open_volume() {
+    std::string path = split_ ? split_volume_name(path_, paths_.size() + 1) : path_;
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        std::cerr << "[archive] Cannot open output zip: " << path << ": " << strerror(errno) << "\n";
+        return false;
     }
+    paths_.push_back(path);
+    volume_written_ = 0;
+    return true;
+}
 
-    archive_entry_set_pathname(entry, pathname.c_str());
+bool VolumeWriter::close_volume() {
+    if (fd_ < 0) return true;
+    bool ok = ::close(fd_) == 0;
+    fd_ = -1;
+    if (ok && split_) vlog("[archive] Wrote volume " + paths_.back());
+    return ok;
+}
 
-    struct stat st;
-    if (lstat(fullpath.c_str(), &st) != 0) {
-        archive_entry_free(entry);
-        if (is_verbose()) elog(std::string("[archive] lstat failed for ") + fullpath);
-        return -2;
+bool VolumeWriter::write_out(const std::string &chunk) {
+    const char *p = chunk.data();
+    size_t left = chunk.size();
+    while (left > 0) {
+        if (fd_ < 0 && !open_volume()) return false;
+        size_t n = left;
+        if (split_) n = (size_t)std::min<uint64_t>(n, split_ - volume_written_);
+        while (n > 0) {
+            ssize_t w = ::write(fd_, p, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                elog("[archive] Write failed on " + paths_.back() + ": " + strerror(errno));
+                return false;
+            }
+            p += w;
+            left -= (size_t)w;
+            n -= (size_t)w;
+            volume_written_ += (uint64_t)w;
+        }
+        if (split_ && volume_written_ == split_ && !close_volume()) return false;
     }
+    return true;
+}
 
-    if (S_ISREG(st.st_mode)) {
-        archive_entry_set_size(entry, st.st_size);
-    } else {
-        archive_entry_set_size(entry, 0);
+void VolumeWriter::run() {
+    while (true) {
+        std::string chunk;
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cv_.wait(lk, [&] { return closing_ || !queue_.empty(); });
+            if (queue_.empty()) break;
+            chunk.swap(queue_.front());
+        }
+        bool ok = !failed_ && write_out(chunk);
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            queue_.pop_front();
+            if (!ok) failed_ = true;
+        }
+        cv_.notify_all();
     }
+    if (!close_volume()) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        failed_ = true;
+    }
+}
 
-    archive_entry_set_filetype(entry, st.st_mode & S_IFMT);
-    archive_entry_set_perm(entry, st.st_mode & 0777);
+bool VolumeWriter::submit() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    cv_.wait(lk, [&] { return failed_ || queue_.size() < OUTPUT_CHUNKS_QUEUED; });
+    if (failed_) return false;
+    queue_.push_back(std::move(chunk_));
+    lk.unlock();
+    cv_.notify_all();
 
-    if (S_ISLNK(st.st_mode)) {
-        std::vector<char> linkbuf(PATH_MAX + 1);
-        ssize_t r = readlink(fullpath.c_str(), linkbuf.data(), PATH_MAX);
-        if (r > 0) {
-            linkbuf[r] = '\0';
-            archive_entry_set_symlink(entry, linkbuf.data());
-        }
+    chunk_ = std::string();
+    chunk_.reserve(OUTPUT_CHUNK_SIZE);
+    return true;
+}
+
+bool VolumeWriter::write(const char *p, size_t n) {
+    while (n > 0) {
+        size_t take = std::min(n, OUTPUT_CHUNK_SIZE - chunk_.size());
+        chunk_.append(p, take);
+        p += take;
+        n -= take;
+        if (chunk_.size() == OUTPUT_CHUNK_SIZE && !submit()) return false;
     }
+    return true;
+}
 
-    if (archive_write_header(a, entry) != ARCHIVE_OK) {
-        if (is_verbose()) elog(std::string("[archive] Warning: failed to write header for ") + fullpath + ": " + archive_error_string(a));
-    } else {
-        if (S_ISREG(st.st_mode)) {
-            FILE *f = fopen(fullpath.c_str(), "rb");
-            if (f) {
-                const size_t bufsize = 8192;
-                std::vector<char> buf(bufsize);
-                size_t r;
-                while ((r = fread(buf.data(), 1, bufsize, f)) > 0) {
-                    ssize_t w = archive_write_data(a, buf.data(), static_cast<size_t>(r));
-                    if (w < 0) {
-                        if (is_verbose()) elog(std::string("[archive] Error writing data for ") + fullpath + ": " + archive_error_string(a));
-                        break;
-                    }
-                }
-                fclose(f);
-            } else {
-                if (is_verbose()) elog(std::string("[archive] Warning: cannot open file ") + fullpath + " for reading");
-            }
+bool VolumeWriter::finish() {
+    if (!thread_.joinable()) return !failed_;
+    bool ok = chunk_.empty() || submit();
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        closing_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    if (!ok || failed_) return false;
+
+    // Volumes left over from an earlier, larger archive of the same name
+    // would otherwise be taken as part of this one.
+    if (split_) {
+        for (size_t i = paths_.size() + 1;; ++i) {
+            std::string stale = split_volume_name(path_, i);
+            if (::unlink(stale.c_str()) != 0) break;
         }
     }
+    return true;
+}
 
-    archive_entry_free(entry);
-    return 0;
+void VolumeWriter::discard() {
+    finish();
+    for (const auto &p : paths_) std::remove(p.c_str());
+    paths_.clear();
 }
 
-int create_zip_from_dir(const std::string &src_dir, const std::string &out_zip) {
-    try {
-        fs::path base(src_dir);
-        if (!fs::exists(base)) {
-            std::cerr << "[archive] Source directory does not exist: " << src_dir << "\n";
-            return 2;
+struct Block {
+    size_t entry;
+    uint64_t offset;
+    size_t len;
+    bool last;
+
+    std::string out;
+    uint32_t crc = 0;
+    int status = 0;  // 0 pending, 1 done, -1 failed
+};
+
+class ParallelZipWriter {
+public:
+    ParallelZipWriter(std::vector<ZipEntry> &entries, int threads)
+        : entries_(entries), threads_(threads) {}
+
+    int write(const std::string &out_zip, uint64_t split_size);
+
+private:
+    std::vector<ZipEntry> &entries_;
+    int threads_;
+    std::vector<Block> blocks_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t next_block_ = 0;
+    size_t written_blocks_ = 0;
+    bool abort_ = false;
+
+    VolumeWriter *out_ = nullptr;
+    uint64_t offset_ = 0;
+
+    void worker();
+    bool compress(Block &b);
+    bool put(const std::string &data);
+    bool write_stored(ZipEntry &e);
+    bool write_deflated(ZipEntry &e, size_t &block);
+};
+
+bool ParallelZipWriter::compress(Block &b) {
+    const ZipEntry &e = entries_[b.entry];
+    size_t dict = (size_t)std::min<uint64_t>(b.offset, DICT_SIZE);
+
+    int fd = ::open(e.source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        elog("[archive] Cannot open file " + e.source + " for reading");
+        return false;
+    }
+
+    std::vector<char> in(dict + b.len);
+    size_t got = 0;
+    while (got < in.size()) {
+        ssize_t r = pread(fd, in.data() + got, in.size() - got, (off_t)(b.offset - dict + got));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += (size_t)r;
+    }
+    ::close(fd);
+    if (got != in.size()) {
+        elog("[archive] " + e.source + " changed while archiving");
+        return false;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, e.level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    if (dict > 0) deflateSetDictionary(&zs, (const Bytef *)in.data(), (uInt)dict);
+
+    b.out.resize(deflateBound(&zs, b.len) + 16);
+    zs.next_in = (Bytef *)in.data() + dict;
+    zs.avail_in = (uInt)b.len;
+    zs.next_out = (Bytef *)&b.out[0];
+    zs.avail_out = (uInt)b.out.size();
+    int rc = deflate(&zs, b.last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool ok = b.last ? rc == Z_STREAM_END : rc == Z_OK && zs.avail_in == 0;
+    b.out.resize(b.out.size() - zs.avail_out);
+    deflateEnd(&zs);
+
+    b.crc = (uint32_t)crc32(0L, (const Bytef *)in.data() + dict, (uInt)b.len);
+    return ok;
+}
+
+void ParallelZipWriter::worker() {
+    size_t window = BLOCKS_IN_FLIGHT_PER_THREAD * (size_t)threads_;
+    while (true) {
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cv_.wait(lk, [&] {
+                return abort_ || next_block_ >= blocks_.size() || next_block_ < written_blocks_ + window;
+            });
+            if (abort_ || next_block_ >= blocks_.size()) return;
+            i = next_block_++;
+        }
+
+        bool ok = compress(blocks_[i]);
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            blocks_[i].status = ok ? 1 : -1;
         }
+        cv_.notify_all();
+    }
+}
 
-        std::string folder_name = base.filename().string();
-        if (folder_name.empty()) {
-            folder_name = base.parent_path().filename().string();
-            if (folder_name.empty()) {
-                folder_name = "archive";
+bool ParallelZipWriter::put(const std::string &data) {
+    if (!out_->write(data.data(), data.size())) return false;
+    offset_ += data.size();
+    return true;
+}
+
+bool ParallelZipWriter::write_stored(ZipEntry &e) {
+    e.offset = offset_;
+    e.crc = (uint32_t)crc32(0L, Z_NULL, 0);
+    if (!put(zip_local_header(e, true))) return false;
+
+    if (!e.link_target.empty()) {
+        e.crc = (uint32_t)crc32(e.crc, (const Bytef *)e.link_target.data(), (uInt)e.link_target.size());
+        if (!put(e.link_target)) return false;
+    } else if (S_ISREG(e.mode) && e.size > 0) {
+        FILE *f = fopen(e.source.c_str(), "rb");
+        if (!f) {
+            elog("[archive] Cannot open file " + e.source + " for reading");
+            return false;
+        }
+        std::vector<char> buf(BLOCK_SIZE);
+        uint64_t left = e.size;
+        while (left > 0) {
+            size_t r = fread(buf.data(), 1, (size_t)std::min<uint64_t>(left, buf.size()), f);
+            if (r == 0) break;
+            e.crc = (uint32_t)crc32(e.crc, (const Bytef *)buf.data(), (uInt)r);
+            if (!out_->write(buf.data(), r)) {
+                fclose(f);
+                return false;
             }
+            offset_ += r;
+            left -= r;
         }
+        fclose(f);
+        if (left > 0) {
+            elog("[archive] " + e.source + " changed while archiving");
+            return false;
+        }
+    }
+    return put(zip_data_descriptor(e));
+}
 
-        struct archive *a = archive_write_new();
-        if (!a) return 3;
+bool ParallelZipWriter::write_deflated(ZipEntry &e, size_t &block) {
+    e.offset = offset_;
+    if (!put(zip_local_header(e, false))) return false;
 
-        archive_write_set_format_zip(a);
-#if defined(ARCHIVE_VERSION_NUMBER) && ARCHIVE_VERSION_NUMBER >= 3000000
-        archive_write_zip_set_compression_deflate(a);
-#else
-        archive_write_set_compression_deflate(a);
-#endif
-        archive_write_set_option(a, "zip", "compression-level", "9");
+    uint64_t start = offset_;
+    e.crc = (uint32_t)crc32(0L, Z_NULL, 0);
+    while (true) {
+        Block &b = blocks_[block];
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cv_.wait(lk, [&] { return b.status != 0; });
+        }
+        if (b.status < 0) return false;
 
-        if (archive_write_open_filename(a, out_zip.c_str()) != ARCHIVE_OK) {
-            std::cerr << "[archive] Cannot open output zip: " << archive_error_string(a) << "\n";
-            archive_write_free(a);
-            return 4;
+        e.crc = (uint32_t)crc32_combine(e.crc, b.crc, (z_off_t)b.len);
+        bool ok = put(b.out);
+        bool last = b.last;
+        std::string().swap(b.out);
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            ++written_blocks_;
         }
+        cv_.notify_all();
+        ++block;
+        if (!ok) return false;
+        if (last) break;
+    }
 
-        for (auto it = fs::recursive_directory_iterator(base); it != fs::recursive_directory_iterator(); ++it) {
-            try {
-                add_file_to_archive(a, it->path(), base, folder_name);
-            } catch (const std::exception &ex) {
-                if (is_verbose()) elog(std::string("[archive] Exception while adding: ") + it->path().string() + " : " + ex.what());
-            }
+    e.compressed_size = offset_ - start;
+    return put(zip_data_descriptor(e));
+}
+
+int ParallelZipWriter::write(const std::string &out_zip, uint64_t split_size) {
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        ZipEntry &e = entries_[i];
+        if (e.method != 8) continue;
+        for (uint64_t off = 0; off < e.size; off += BLOCK_SIZE) {
+            Block b;
+            b.entry = i;
+            b.offset = off;
+            b.len = (size_t)std::min<uint64_t>(BLOCK_SIZE, e.size - off);
+            b.last = off + b.len >= e.size;
+            blocks_.push_back(std::move(b));
         }
+    }
+
+    VolumeWriter out(out_zip, split_size);
+    if (!out.start()) return 4;
+    out_ = &out;
 
-        add_file_to_archive(a, base, base, folder_name);
+    vlog("[archive] Compressing " + std::to_string(entries_.size()) + " entries (" +
+         std::to_string(blocks_.size()) + " blocks) on " + std::to_string(threads_) + " threads");
 
-        if (archive_write_close(a) != ARCHIVE_OK) {
-            if (is_verbose()) elog(std::string("[archive] Warning: error on close: ") + archive_error_string(a));
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads_ && !blocks_.empty(); ++t) {
+        pool.emplace_back(&ParallelZipWriter::worker, this);
+    }
+
+    bool ok = true;
+    size_t block = 0;
+    for (auto &e : entries_) {
+        ok = (e.method == 8) ? write_deflated(e, block) : write_stored(e);
+        if (!ok) break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        abort_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : pool) t.join();
+
+    if (ok) {
+        uint64_t cd_offset = offset_;
+        for (const auto &e : entries_) {
+            if (!(ok = put(zip_central_header(e)))) break;
         }
-        archive_write_free(a);
-        return 0;
+        if (ok) ok = put(zip_end_records(entries_.size(), cd_offset, offset_ - cd_offset));
+    }
+
+    if (!out.finish()) ok = false;
+    out_ = nullptr;
+    if (!ok) {
+        std::cerr << "[archive] Failed to write " << out_zip << "\n";
+        out.discard();
+        return 8;
+    }
+    return 0;
+}
+
+}  // namespace
+
+static int write_zip(std::vector<ZipEntry> &entries, const std::string &out_zip, int level, long long split_size) {
+    size_t deflated = 0;
+    for (auto &e : entries) {
+        zip_choose_method(e, level);
+        if (e.method != 0) ++deflated;
+    }
+    vlog("[archive] " + std::to_string(deflated) + " of " + std::to_string(entries.size()) + " entries deflated");
+
+    int threads = get_archive_threads();
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    ParallelZipWriter writer(entries, threads);
+    return writer.write(out_zip, split_size > 0 ? (uint64_t)split_size : 0);
+}
+
+int create_zip_from_dir(const std::string &src_dir, const std::string &out_zip, int level, long long split_size) {
+    try {
+        fs::path base(src_dir);
+        if (!fs::exists(base)) {
+            std::cerr << "[archive] Source directory does not exist: " << src_dir << "\n";
+            return 2;
+        }
+
+        std::vector<ZipEntry> entries;
+        std::string folder_name;
+        if (!zip_collect_dir(src_dir, entries, folder_name)) return 3;
+
+        return write_zip(entries, out_zip, level, split_size);
     } catch (const std::system_error &se) {
         std::cerr << "[archive] System error: " << se.what() << "\n";
         return 11;
@@ -153,7 +514,7 @@ int create_zip_from_dir(const std::string &src_dir, const std::string &out_zip)
     }
 }
 
-int create_zip_from_file(const std::string &file_path, const std::string &out_zip) {
+int create_zip_from_file(const std::string &file_path, const std::string &out_zip, int level, long long split_size) {
     try {
         fs::path fpath(file_path);
         if (!fs::exists(fpath) || !fs::is_regular_file(fpath)) {
@@ -161,74 +522,13 @@ int create_zip_from_file(const std::string &file_path, const std::string &out_zi
             return 2;
         }
 
-        struct archive *a = archive_write_new();
-        if (!a) return 3;
-
-        archive_write_set_format_zip(a);
-#if defined(ARCHIVE_VERSION_NUMBER) && ARCHIVE_VERSION_NUMBER >= 3000000
-        archive_write_zip_set_compression_deflate(a);
-#else
-        archive_write_set_compression_deflate(a);
-#endif
-        archive_write_set_option(a, "zip", "compression-level", "9");
-
-        if (archive_write_open_filename(a, out_zip.c_str()) != ARCHIVE_OK) {
-            std::cerr << "[archive] Cannot open output zip: " << archive_error_string(a) << "\n";
-            archive_write_free(a);
-            return 4;
-        }
-
-        struct archive_entry *entry = archive_entry_new();
-        std::string filename = fpath.filename().string();
-        archive_entry_set_pathname(entry, filename.c_str());
-
-        struct stat st;
-        if (lstat(fpath.string().c_str(), &st) != 0) {
-            archive_entry_free(entry);
+        std::vector<ZipEntry> entries(1);
+        if (!zip_make_entry(fpath.string(), fpath.filename().string(), entries[0])) {
             std::cerr << "[archive] lstat failed for " << fpath.string() << "\n";
-            archive_write_free(a);
             return 5;
         }
 
-        archive_entry_set_size(entry, st.st_size);
-        archive_entry_set_filetype(entry, st.st_mode & S_IFMT);
-        archive_entry_set_perm(entry, st.st_mode & 0777);
-
-        if (archive_write_header(a, entry) != ARCHIVE_OK) {
-            std::cerr << "[archive] Failed to write header for " << fpath.string() << ": " << archive_error_string(a) << "\n";
-            archive_entry_free(entry);
-            archive_write_free(a);
-            return 6;
-        }
-
-        FILE *fp = fopen(fpath.string().c_str(), "rb");
-        if (!fp) {
-            std::cerr << "[archive] Cannot open file for reading: " << fpath.string() << "\n";
-            archive_entry_free(entry);
-            archive_write_free(a);
-            return 7;
-        }
-        const size_t bufsize = 8192;
-        std::vector<char> buf(bufsize);
-        size_t r;
-        while ((r = fread(buf.data(), 1, bufsize, fp)) > 0) {
-            ssize_t w = archive_write_data(a, buf.data(), static_cast<size_t>(r));
-            if (w < 0) {
-                std::cerr << "[archive] Error writing data for " << fpath.string() << ": " + std::string(archive_error_string(a)) << "\n";
-                fclose(fp);
-                archive_entry_free(entry);
-                archive_write_free(a);
-                return 8;
-            }
-        }
-        fclose(fp);
-
-        archive_entry_free(entry);
-        if (archive_write_close(a) != ARCHIVE_OK) {
-            if (is_verbose()) elog(std::string("[archive] Warning: error on close: ") + archive_error_string(a));
-        }
-        archive_write_free(a);
-        return 0;
+        return write_zip(entries, out_zip, level, split_size);
     } catch (const std::system_error &se) {
         std::cerr << "[archive] System error: " << se.what() << "\n";
         return 11;
@@ -1,6 +1,21 @@
 #pragma once
 #include <string>
+#include <vector>
 
-int create_zip_from_dir(const std::string &src_dir, const std::string &out_zip);
-int create_zip_from_file(const std::string &file_path, const std::string &out_zip);
+// Number of compression threads used by the zip writers; 0 means one per CPU.
+void set_archive_threads(int threads);
+int get_archive_threads();
 
+// `level`: 0 stores, 1-9 deflates, -1 (ZIP_LEVEL_AUTO) decides per file.
+// With `split_size` > 0 the archive is written as volumes of that many bytes,
+// out_zip.001, out_zip.002, ..., which concatenate back into the archive.
+int create_zip_from_dir(const std::string &src_dir, const std::string &out_zip, int level = -1,
+                        long long split_size = 0);
+int create_zip_from_file(const std::string &file_path, const std::string &out_zip, int level = -1,
+                         long long split_size = 0);
+
+// Name of volume `index` (from 1) of a split archive.
+std::string split_volume_name(const std::string &base, size_t index);
+// Volumes of the split archive `path` refers to, either by its base name or
+// by its first volume; empty if `path` is not a split archive.
+std::vector<std::string> find_split_volumes(const std::string &path);
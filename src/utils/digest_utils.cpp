@@ -0,0 +1,164 @@
+#include "digest_utils.h"
+#include "../server/request_parser.h"
+#include "utils.h"
+#include <openssl/evp.h>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const size_t DIGEST_READ_SIZE = 1024 * 1024;
+
+Sha256::Sha256() : ctx_(EVP_MD_CTX_new()) {
+    EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr);
+}
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(ctx_);
+}
+
+void Sha256::update(const void* data, size_t len) {
+    EVP_DigestUpdate(ctx_, data, len);
+}
+
+std::string Sha256::final() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx_, md, &len);
+    EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr);
+    return std::string((const char*)md, len);
+}
+
+std::string hex_encode(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes) {
+        out += digits[c >> 4];
+        out += digits[c & 15];
+    }
+    return out;
+}
+
+std::string base64_encode(const std::string& bytes) {
+    std::string out(4 * ((bytes.size() + 2) / 3) + 1, '\0');
+    int n = EVP_EncodeBlock((unsigned char*)&out[0], (const unsigned char*)bytes.data(), (int)bytes.size());
+    out.resize(n < 0 ? 0 : n);
+    return out;
+}
+
+static bool base64_sha256(const std::string& b64, std::string& out) {
+    // A SHA-256 digest is 44 characters of base64 with one '=' of padding.
+    if (b64.size() != 44) return false;
+    unsigned char buf[33];
+    if (EVP_DecodeBlock(buf, (const unsigned char*)b64.data(), (int)b64.size()) != 33) return false;
+    out.assign((const char*)buf, 32);
+    return true;
+}
+
+std::string digest_field(const std::string& sha256) {
+    return "sha-256=:" + base64_encode(sha256) + ":";
+}
+
+// Looks for the sha-256 member of a digest list: "sha-256=:b64:" in the
+// structured-field headers, "SHA-256=b64" in Digest.
+static bool find_sha256(std::string_view value, std::string& out) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+
+        size_t b = item.find_first_not_of(" \t");
+        size_t e = item.find_last_not_of(" \t");
+        if (b == std::string_view::npos) continue;
+        item = item.substr(b, e - b + 1);
+        if (item.size() < 8 || strncasecmp(item.data(), "sha-256=", 8) != 0) continue;
+
+        std::string_view b64 = item.substr(8);
+        if (b64.size() >= 2 && b64.front() == ':' && b64.back() == ':') b64 = b64.substr(1, b64.size() - 2);
+        return base64_sha256(std::string(b64), out);
+    }
+    return false;
+}
+
+bool request_sha256(const RequestParser& request, std::string& out) {
+    for (const char* name : {"Repr-Digest", "Content-Digest", "Digest"}) {
+        std::string_view value = request.header(name);
+        if (!value.empty() && find_sha256(value, out)) return true;
+    }
+    return false;
+}
+
+FileDigest::~FileDigest() {
+    stop_ = true;
+    if (thread_.joinable()) thread_.join();
+}
+
+bool FileDigest::same_version(const struct stat& a, const struct stat& b) {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+bool FileDigest::get(const struct stat& st, std::string& out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!known_ || !same_version(st_, st)) return false;
+    out = digest_;
+    return true;
+}
+
+void FileDigest::put(const struct stat& st, const std::string& sha256) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (known_ && same_version(st_, st)) return;
+        st_ = st;
+        digest_ = sha256;
+        known_ = true;
+    }
+    if (done_) done_(hex_encode(sha256));
+}
+
+void FileDigest::refresh(const std::string& path, const struct stat& st) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || stop_ || (known_ && same_version(st_, st))) return;
+    // The previous hash, if any, has finished.
+    if (thread_.joinable()) thread_.join();
+    running_ = true;
+    thread_ = std::thread(&FileDigest::run, this, path, st);
+}
+
+void FileDigest::run(const std::string& path, struct stat st) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat now;
+    if (fd < 0) {
+        vlog("Cannot hash " + path + ": " + strerror(errno));
+    } else if (fstat(fd, &now) != 0 || !same_version(now, st)) {
+        // Replaced since it was looked up; the next request asks again.
+        ::close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        Sha256 sha;
+        std::vector<char> buf(DIGEST_READ_SIZE);
+        while (!stop_) {
+            ssize_t r = ::read(fd, buf.data(), buf.size());
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                vlog("Cannot hash " + path + ": " + strerror(errno));
+                break;
+            }
+            if (r == 0) {
+                // A file written to while it was read has no single digest.
+                if (fstat(fd, &now) == 0 && same_version(now, st)) put(st, sha.final());
+                break;
+            }
+            sha.update(buf.data(), (size_t)r);
+        }
+        ::close(fd);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+}
@@ -0,0 +1,80 @@
+#ifndef DIGEST_UTILS_H
+#define DIGEST_UTILS_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <sys/stat.h>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+class RequestParser;
+
+// Incremental SHA-256. OpenSSL picks the SHA-NI / AVX2 code path the CPU
+// supports.
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const void* data, size_t len);
+    // The 32-byte digest; starts over afterwards.
+    std::string final();
+
+private:
+    EVP_MD_CTX* ctx_;
+};
+
+std::string hex_encode(const std::string& bytes);
+std::string base64_encode(const std::string& bytes);
+
+// Value of a Repr-Digest / Content-Digest field for a SHA-256 digest:
+// "sha-256=:<base64>:".
+std::string digest_field(const std::string& sha256);
+// The SHA-256 a request announces in Repr-Digest, Content-Digest or the
+// older Digest header. False when there is none.
+bool request_sha256(const RequestParser& request, std::string& out);
+
+// SHA-256 of the file a server sends, kept together with the version of
+// the file it was computed for (device, inode, size, mtime): get() only
+// hands it out for that version, so a replaced or rewritten file is never
+// described by the digest of its predecessor. Downloads that pass through
+// user space hash the file inline and put() the result; for sendfile(),
+// which never sees the data, refresh() hashes it on a background thread.
+class FileDigest {
+public:
+    // `done` is called with the hex digest whenever a new one is recorded.
+    explicit FileDigest(std::function<void(const std::string&)> done = nullptr) : done_(std::move(done)) {}
+    ~FileDigest();
+
+    FileDigest(const FileDigest&) = delete;
+    FileDigest& operator=(const FileDigest&) = delete;
+
+    // Whether `a` and `b` describe the same version of a file.
+    static bool same_version(const struct stat& a, const struct stat& b);
+
+    // The digest of the version `st`, if it is known.
+    bool get(const struct stat& st, std::string& out) const;
+    void put(const struct stat& st, const std::string& sha256);
+    // Hashes the version `st` of `path` in the background, unless its digest
+    // is known or a hash is already running.
+    void refresh(const std::string& path, const struct stat& st);
+
+private:
+    std::function<void(const std::string&)> done_;
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    mutable std::mutex mutex_;
+    bool running_ = false;
+    bool known_ = false;
+    struct stat st_;
+    std::string digest_;
+
+    void run(const std::string& path, struct stat st);
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "file_utils.h"
 #include <sys/stat.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <fstream>
 #include <sstream>
 
@@ -14,6 +16,40 @@ std::string file_basename(const std::string &path) {
     return path.substr(p + 1);
 }
 
+std::string sanitize_filename(const std::string &name) {
+    std::string base = file_basename(name);
+    std::string out;
+    for (char c : base) {
+        if ((unsigned char)c >= 0x20 && c != 0x7f) out.push_back(c);
+    }
+    while (!out.empty() && (out.back() == ' ' || out.back() == '.')) out.pop_back();
+    while (!out.empty() && out.front() == ' ') out.erase(0, 1);
+    if (out.empty() || out == "." || out == "..") return "";
+    if (out.size() > 255) out.resize(255);
+    return out;
+}
+
+std::string unique_path(const std::string &path) {
+    if (!file_exists(path)) return path;
+
+    std::string dir;
+    std::string name = path;
+    auto slash = path.find_last_of('/');
+    if (slash != std::string::npos) {
+        dir = path.substr(0, slash + 1);
+        name = path.substr(slash + 1);
+    }
+    auto dot = name.find_last_of('.');
+    if (dot == 0 || dot == std::string::npos) dot = name.size();
+    std::string stem = name.substr(0, dot);
+    std::string ext = name.substr(dot);
+
+    for (int n = 1;; ++n) {
+        std::string candidate = dir + stem + " (" + std::to_string(n) + ")" + ext;
+        if (!file_exists(candidate)) return candidate;
+    }
+}
+
 std::string mime_type(const std::string &name) {
     if (name.find(".html") != std::string::npos) return "text/html";
     if (name.find(".htm") != std::string::npos) return "text/html";
@@ -29,6 +65,28 @@ std::string mime_type(const std::string &name) {
     return "application/octet-stream";
 }
 
+bool share_path(const std::string &root, const std::string &rel, std::string &out) {
+    std::string joined = root;
+    size_t pos = 0;
+    while (pos <= rel.size()) {
+        size_t end = rel.find('/', pos);
+        if (end == std::string::npos) end = rel.size();
+        std::string part = rel.substr(pos, end - pos);
+        pos = end + 1;
+        if (part.empty() || part == ".") continue;
+        if (part == "..") return false;
+        if (joined.back() != '/') joined += '/';
+        joined += part;
+    }
+
+    char resolved[PATH_MAX];
+    if (!realpath(joined.c_str(), resolved)) return false;
+    out = resolved;
+    if (out == root) return true;
+    std::string prefix = root.back() == '/' ? root : root + "/";
+    return out.compare(0, prefix.size(), prefix) == 0;
+}
+
 void write_file(const std::string &path, const std::string &data) {
     std::ofstream ofs(path, std::ios::binary);
     ofs.write(data.data(), data.size());
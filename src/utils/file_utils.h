@@ -5,7 +5,16 @@
 
 bool file_exists(const std::string &path);
 std::string file_basename(const std::string &path);
+// Last component of a client-supplied file name with control characters
+// removed; empty when nothing usable is left ("", ".", "..").
+std::string sanitize_filename(const std::string &name);
+// `path`, or "stem (n).ext" for the first n that does not exist yet.
+std::string unique_path(const std::string &path);
 std::string mime_type(const std::string &name);
+// Real path of `rel`, a decoded request path, inside the directory `root`
+// (itself a real path). False when it does not exist or lies outside the
+// directory, through a ".." component or a symbolic link.
+bool share_path(const std::string &root, const std::string &rel, std::string &out);
 void write_file(const std::string &path, const std::string &data);
 std::string read_file_all(const std::string &path);
 
@@ -44,3 +44,95 @@ std::string get_tls_key() {
     std::lock_guard<std::mutex> lk(g_tls_mutex);
     return g_tls_key;
 }
+
+static int g_event_loop_threads = 0;
+static std::mutex g_event_loop_mutex;
+
+void set_event_loop_threads(int threads) {
+    std::lock_guard<std::mutex> lk(g_event_loop_mutex);
+    g_event_loop_threads = threads;
+}
+
+int get_event_loop_threads() {
+    std::lock_guard<std::mutex> lk(g_event_loop_mutex);
+    return g_event_loop_threads;
+}
+
+static std::string g_io_engine = "sync";
+static std::mutex g_io_engine_mutex;
+
+void set_io_engine(const std::string &engine) {
+    std::lock_guard<std::mutex> lk(g_io_engine_mutex);
+    g_io_engine = engine;
+}
+
+std::string get_io_engine() {
+    std::lock_guard<std::mutex> lk(g_io_engine_mutex);
+    return g_io_engine;
+}
+
+static int g_keep_alive_timeout = 5;
+static int g_keep_alive_max_requests = 100;
+static std::mutex g_keep_alive_mutex;
+
+void set_keep_alive(int timeout_seconds, int max_requests) {
+    std::lock_guard<std::mutex> lk(g_keep_alive_mutex);
+    g_keep_alive_timeout = timeout_seconds;
+    g_keep_alive_max_requests = max_requests;
+}
+
+int get_keep_alive_timeout() {
+    std::lock_guard<std::mutex> lk(g_keep_alive_mutex);
+    return g_keep_alive_timeout;
+}
+
+int get_keep_alive_max_requests() {
+    std::lock_guard<std::mutex> lk(g_keep_alive_mutex);
+    return g_keep_alive_max_requests;
+}
+
+static std::string g_sync_mode = "none";
+static std::mutex g_sync_mode_mutex;
+
+void set_sync_mode(const std::string &mode) {
+    std::lock_guard<std::mutex> lk(g_sync_mode_mutex);
+    g_sync_mode = mode;
+}
+
+std::string get_sync_mode() {
+    std::lock_guard<std::mutex> lk(g_sync_mode_mutex);
+    return g_sync_mode;
+}
+
+static bool g_compression = true;
+static std::mutex g_compression_mutex;
+
+void set_compression(bool enabled) {
+    std::lock_guard<std::mutex> lk(g_compression_mutex);
+    g_compression = enabled;
+}
+
+bool get_compression() {
+    std::lock_guard<std::mutex> lk(g_compression_mutex);
+    return g_compression;
+}
+
+static long long g_rate_limit = 0;
+static long long g_conn_rate_limit = 0;
+static std::mutex g_rate_limit_mutex;
+
+void set_rate_limit(long long global_rate, long long conn_rate) {
+    std::lock_guard<std::mutex> lk(g_rate_limit_mutex);
+    g_rate_limit = global_rate;
+    g_conn_rate_limit = conn_rate;
+}
+
+long long get_rate_limit() {
+    std::lock_guard<std::mutex> lk(g_rate_limit_mutex);
+    return g_rate_limit;
+}
+
+long long get_conn_rate_limit() {
+    std::lock_guard<std::mutex> lk(g_rate_limit_mutex);
+    return g_conn_rate_limit;
+}
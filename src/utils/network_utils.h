@@ -13,4 +13,24 @@ void set_tls_files(const std::string &cert_path, const std::string &key_path);
 std::string get_tls_cert();
 std::string get_tls_key();
 
+void set_event_loop_threads(int threads);
+int get_event_loop_threads();
+
+void set_io_engine(const std::string &engine);
+std::string get_io_engine();
+
+void set_keep_alive(int timeout_seconds, int max_requests);
+int get_keep_alive_timeout();
+int get_keep_alive_max_requests();
+
+void set_sync_mode(const std::string &mode);
+std::string get_sync_mode();
+
+void set_compression(bool enabled);
+bool get_compression();
+
+void set_rate_limit(long long global_rate, long long conn_rate);
+long long get_rate_limit();
+long long get_conn_rate_limit();
+
 #endif
@@ -1,18 +1,17 @@
 #include "server_utils.h"
 #include <string>
 #include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+#include <strings.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 long long extract_content_length(const std::string &req) {
-    auto pos = req.find("Content-Length:");
-    if (pos == std::string::npos) return -1;
-    pos += strlen("Content-Length:");
-    while (pos < req.size() && (req[pos] == ' ' || req[pos] == '\t')) ++pos;
-    size_t end = req.find("\r\n", pos);
-    if (end == std::string::npos) return -1;
-    std::string num = req.substr(pos, end - pos);
+    std::string num = get_header_value(req, "Content-Length");
+    if (num.empty()) return -1;
     try {
         return std::stoll(num);
     } catch (...) {
@@ -28,3 +27,243 @@ std::string get_client_ip(int fd) {
     }
     return "unknown";
 }
+
+std::string get_header_value(const std::string &req, const std::string &name) {
+    size_t pos = req.find("\r\n");
+    while (pos != std::string::npos) {
+        size_t line_start = pos + 2;
+        size_t line_end = req.find("\r\n", line_start);
+        if (line_end == std::string::npos || line_end == line_start) break;
+
+        if (line_end - line_start > name.size() && req[line_start + name.size()] == ':' &&
+            strncasecmp(req.c_str() + line_start, name.c_str(), name.size()) == 0) {
+            size_t v = line_start + name.size() + 1;
+            while (v < line_end && (req[v] == ' ' || req[v] == '\t')) ++v;
+            size_t e = line_end;
+            while (e > v && (req[e - 1] == ' ' || req[e - 1] == '\t')) --e;
+            return req.substr(v, e - v);
+        }
+        pos = line_end;
+    }
+    return "";
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Value of parameter `name` in a header value like `form-data; name="x"`.
+static bool header_param(const std::string &value, const std::string &name, std::string &out) {
+    size_t pos = 0;
+    while ((pos = value.find(';', pos)) != std::string::npos) {
+        ++pos;
+        while (pos < value.size() && (value[pos] == ' ' || value[pos] == '\t')) ++pos;
+        size_t eq = value.find('=', pos);
+        if (eq == std::string::npos) return false;
+        std::string key = value.substr(pos, eq - pos);
+        while (!key.empty() && (key.back() == ' ' || key.back() == '\t')) key.pop_back();
+        if (strcasecmp(key.c_str(), name.c_str()) != 0) continue;
+
+        size_t v = eq + 1;
+        out.clear();
+        if (v < value.size() && value[v] == '"') {
+            for (++v; v < value.size() && value[v] != '"'; ++v) {
+                if (value[v] == '\\' && v + 1 < value.size()) ++v;
+                out.push_back(value[v]);
+            }
+        } else {
+            size_t e = value.find(';', v);
+            out = value.substr(v, e == std::string::npos ? std::string::npos : e - v);
+            while (!out.empty() && (out.back() == ' ' || out.back() == '\t')) out.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool content_disposition_filename(const std::string &value, std::string &out) {
+    std::string ext;
+    if (header_param(value, "filename*", ext)) {
+        // RFC 5987: charset'language'percent-encoded
+        size_t q = ext.find('\'');
+        size_t q2 = q == std::string::npos ? q : ext.find('\'', q + 1);
+        if (q2 != std::string::npos) {
+            out.clear();
+            for (size_t i = q2 + 1; i < ext.size(); ++i) {
+                int hi, lo;
+                if (ext[i] == '%' && i + 2 < ext.size() && (hi = hex_value(ext[i + 1])) >= 0 &&
+                    (lo = hex_value(ext[i + 2])) >= 0) {
+                    out.push_back((char)(hi * 16 + lo));
+                    i += 2;
+                } else {
+                    out.push_back(ext[i]);
+                }
+            }
+            return true;
+        }
+    }
+    return header_param(value, "filename", out);
+}
+
+bool url_decode(const std::string &in, std::string &out) {
+    out.clear();
+    out.reserve(in.size());
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] != '%') {
+            out.push_back(in[i]);
+            continue;
+        }
+        int hi, lo;
+        if (i + 2 >= in.size() || (hi = hex_value(in[i + 1])) < 0 || (lo = hex_value(in[i + 2])) < 0) return false;
+        char c = (char)(hi * 16 + lo);
+        if (c == '\0') return false;
+        out.push_back(c);
+        i += 2;
+    }
+    return true;
+}
+
+std::string url_encode(const std::string &in) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(in.size());
+    for (unsigned char c : in) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            out.push_back((char)c);
+        } else {
+            out.push_back('%');
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 15]);
+        }
+    }
+    return out;
+}
+
+std::string http_date(time_t t) {
+    struct tm tm_utc;
+    gmtime_r(&t, &tm_utc);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_utc);
+    return buf;
+}
+
+bool parse_http_date(const std::string &value, time_t &out) {
+    struct tm tm_utc;
+    memset(&tm_utc, 0, sizeof(tm_utc));
+    const char *end = strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm_utc);
+    if (!end || *end != '\0') return false;
+    out = timegm(&tm_utc);
+    return out != (time_t)-1;
+}
+
+std::string file_etag(const struct stat &st, const std::string &suffix) {
+    std::ostringstream ss;
+    ss << '"' << std::hex << (unsigned long long)st.st_ino << '-' << (unsigned long long)st.st_size << '-'
+       << (unsigned long long)st.st_mtim.tv_sec << '.' << (unsigned long long)st.st_mtim.tv_nsec;
+    if (!suffix.empty()) ss << '-' << suffix;
+    ss << '"';
+    return ss.str();
+}
+
+// If-None-Match uses the weak comparison: W/ prefixes are ignored.
+static bool etag_listed(const std::string &list, const std::string &etag) {
+    auto opaque = [](const std::string &tag) { return tag.compare(0, 2, "W/") == 0 ? tag.substr(2) : tag; };
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        size_t b = item.find_first_not_of(" \t");
+        size_t e = item.find_last_not_of(" \t");
+        if (b == std::string::npos) continue;
+        item = item.substr(b, e - b + 1);
+        if (item == "*" || opaque(item) == opaque(etag)) return true;
+    }
+    return false;
+}
+
+bool not_modified(const std::string &if_none_match, const std::string &if_modified_since,
+                  const std::string &etag, time_t mtime) {
+    if (!if_none_match.empty()) return !etag.empty() && etag_listed(if_none_match, etag);
+    time_t since;
+    return mtime != 0 && !if_modified_since.empty() && parse_http_date(if_modified_since, since) &&
+           mtime <= since;
+}
+
+static bool parse_range_number(const std::string &s, long long &out) {
+    if (s.empty() || s.size() > 18) return false;
+    for (char c : s) {
+        if (!isdigit((unsigned char)c)) return false;
+    }
+    out = std::strtoll(s.c_str(), nullptr, 10);
+    return true;
+}
+
+int parse_range_header(const std::string &value, long long size, std::vector<ByteRange> &out) {
+    const size_t max_ranges = 16;
+    out.clear();
+
+    if (value.size() < 6 || strncasecmp(value.c_str(), "bytes=", 6) != 0) return 0;
+
+    size_t specs = 0;
+    size_t pos = 6;
+    while (pos <= value.size()) {
+        size_t comma = value.find(',', pos);
+        if (comma == std::string::npos) comma = value.size();
+
+        std::string spec = value.substr(pos, comma - pos);
+        size_t b = spec.find_first_not_of(" \t");
+        size_t e = spec.find_last_not_of(" \t");
+        spec = (b == std::string::npos) ? "" : spec.substr(b, e - b + 1);
+        pos = comma + 1;
+        if (spec.empty()) continue;
+
+        if (++specs > max_ranges) return 0;
+
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos) return 0;
+        std::string first = spec.substr(0, dash);
+        std::string last = spec.substr(dash + 1);
+
+        long long start, end;
+        if (first.empty()) {
+            long long suffix;
+            if (!parse_range_number(last, suffix)) return 0;
+            if (suffix == 0 || size == 0) continue;
+            start = suffix >= size ? 0 : size - suffix;
+            end = size - 1;
+        } else {
+            if (!parse_range_number(first, start)) return 0;
+            if (last.empty()) {
+                end = size - 1;
+            } else {
+                if (!parse_range_number(last, end) || end < start) return 0;
+                if (end >= size) end = size - 1;
+            }
+            if (start >= size) continue;
+        }
+
+        out.push_back(ByteRange{start, end - start + 1});
+    }
+
+    if (specs == 0) return 0;
+    return out.empty() ? -1 : 1;
+}
+
+bool parse_content_range(const std::string &value, long long &first, long long &last, long long &total) {
+    if (value.size() < 6 || strncasecmp(value.c_str(), "bytes ", 6) != 0) return false;
+
+    size_t dash = value.find('-', 6);
+    size_t slash = value.find('/', 6);
+    if (dash == std::string::npos || slash == std::string::npos || slash < dash) return false;
+
+    return parse_range_number(value.substr(6, dash - 6), first) &&
+           parse_range_number(value.substr(dash + 1, slash - dash - 1), last) &&
+           parse_range_number(value.substr(slash + 1), total) &&
+           first <= last && last < total;
+}
@@ -2,8 +2,48 @@
 #define SERVER_UTILS_H
 
 #include <string>
+#include <vector>
+#include <ctime>
+#include <sys/stat.h>
+
+struct ByteRange {
+    long long start;
+    long long length;
+};
 
 long long extract_content_length(const std::string &req);
 std::string get_client_ip(int fd);
 
+std::string get_header_value(const std::string &req, const std::string &name);
+std::string http_date(time_t t);
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT").
+bool parse_http_date(const std::string &value, time_t &out);
+
+// Strong entity tag of a file from its inode, size and mtime; `suffix` tells
+// apart differently coded bodies of the same file.
+std::string file_etag(const struct stat &st, const std::string &suffix = "");
+// If-None-Match / If-Modified-Since evaluation (RFC 9110 13.2.2): true when
+// the client's copy is current and a 304 can be sent. An empty `etag` or a
+// zero `mtime` means the resource has no such validator.
+bool not_modified(const std::string &if_none_match, const std::string &if_modified_since,
+                  const std::string &etag, time_t mtime);
+
+// Filename parameter of a Content-Disposition value (filename*=UTF-8''...
+// preferred over filename="..."). False when there is none.
+bool content_disposition_filename(const std::string &value, std::string &out);
+
+// Decodes %XX escapes in a request path. False for a malformed escape or an
+// encoded NUL.
+bool url_decode(const std::string &in, std::string &out);
+// Percent-encodes everything but unreserved characters and '/'.
+std::string url_encode(const std::string &in);
+
+// Parses a "Range: bytes=..." value against a resource of `size` bytes.
+// Returns 1 with the satisfiable ranges in `out`, 0 when the header should be
+// ignored (syntax error or too many ranges), -1 when nothing is satisfiable.
+int parse_range_header(const std::string &value, long long size, std::vector<ByteRange> &out);
+
+// Parses a request "Content-Range: bytes first-last/total" value.
+bool parse_content_range(const std::string &value, long long &first, long long &last, long long &total);
+
 #endif
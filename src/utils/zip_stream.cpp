@@ -0,0 +1,673 @@
+#include "zip_stream.h"
+#include "../utils/utils.h"
+#include <zlib.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <cctype>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+const uint64_t ZIP_DATA_DESCRIPTOR_SIZE = 24;
+const uint64_t ZIP_END_RECORDS_SIZE = 56 + 20 + 22;
+
+static const uint16_t ZIP_VERSION = 45;         // 4.5: Zip64
+static const uint16_t ZIP_MADE_BY = (3 << 8) | ZIP_VERSION;  // Unix
+static const uint16_t ZIP_FLAGS = 0x0008 | 0x0800;  // data descriptor, UTF-8 names
+static const size_t ZIP_IO_BUFFER = 256 * 1024;
+
+static void put16(std::string &s, uint16_t v) {
+    s.push_back((char)(v & 0xff));
+    s.push_back((char)(v >> 8));
+}
+
+static void put32(std::string &s, uint32_t v) {
+    put16(s, (uint16_t)(v & 0xffff));
+    put16(s, (uint16_t)(v >> 16));
+}
+
+static void put64(std::string &s, uint64_t v) {
+    put32(s, (uint32_t)(v & 0xffffffffu));
+    put32(s, (uint32_t)(v >> 32));
+}
+
+static void dos_time(time_t t, uint16_t &time_out, uint16_t &date_out) {
+    struct tm tm;
+    if (!localtime_r(&t, &tm) || tm.tm_year < 80) {
+        time_out = 0;
+        date_out = (1 << 5) | 1;  // 1980-01-01
+        return;
+    }
+    time_out = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    date_out = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+uint64_t zip_local_header_size(const ZipEntry &e) {
+    return 30 + e.name.size() + 20;
+}
+
+uint64_t zip_central_header_size(const ZipEntry &e) {
+    return 46 + e.name.size() + 28;
+}
+
+std::string zip_local_header(const ZipEntry &e, bool sizes_known) {
+    uint16_t t, d;
+    dos_time(e.mtime, t, d);
+
+    std::string s;
+    s.reserve(zip_local_header_size(e));
+    put32(s, 0x04034b50);
+    put16(s, ZIP_VERSION);
+    put16(s, ZIP_FLAGS);
+    put16(s, e.method);
+    put16(s, t);
+    put16(s, d);
+    put32(s, 0);            // CRC follows in the data descriptor
+    put32(s, 0xffffffffu);  // sizes live in the Zip64 extra field
+    put32(s, 0xffffffffu);
+    put16(s, (uint16_t)e.name.size());
+    put16(s, 20);
+    s += e.name;
+    put16(s, 0x0001);
+    put16(s, 16);
+    put64(s, sizes_known ? e.size : 0);
+    put64(s, sizes_known ? e.compressed_size : 0);
+    return s;
+}
+
+std::string zip_data_descriptor(const ZipEntry &e) {
+    std::string s;
+    s.reserve(ZIP_DATA_DESCRIPTOR_SIZE);
+    put32(s, 0x08074b50);
+    put32(s, e.crc);
+    put64(s, e.compressed_size);
+    put64(s, e.size);
+    return s;
+}
+
+std::string zip_central_header(const ZipEntry &e) {
+    uint16_t t, d;
+    dos_time(e.mtime, t, d);
+
+    uint32_t external = e.mode << 16;
+    if (S_ISDIR(e.mode)) external |= 0x10;
+
+    std::string s;
+    s.reserve(zip_central_header_size(e));
+    put32(s, 0x02014b50);
+    put16(s, ZIP_MADE_BY);
+    put16(s, ZIP_VERSION);
+    put16(s, ZIP_FLAGS);
+    put16(s, e.method);
+    put16(s, t);
+    put16(s, d);
+    put32(s, e.crc);
+    put32(s, 0xffffffffu);
+    put32(s, 0xffffffffu);
+    put16(s, (uint16_t)e.name.size());
+    put16(s, 28);
+    put16(s, 0);  // comment
+    put16(s, 0);  // disk
+    put16(s, 0);  // internal attributes
+    put32(s, external);
+    put32(s, 0xffffffffu);
+    s += e.name;
+    put16(s, 0x0001);
+    put16(s, 24);
+    put64(s, e.size);
+    put64(s, e.compressed_size);
+    put64(s, e.offset);
+    return s;
+}
+
+std::string zip_end_records(uint64_t entries, uint64_t cd_offset, uint64_t cd_size) {
+    std::string s;
+    s.reserve(ZIP_END_RECORDS_SIZE);
+
+    put32(s, 0x06064b50);
+    put64(s, 44);
+    put16(s, ZIP_MADE_BY);
+    put16(s, ZIP_VERSION);
+    put32(s, 0);
+    put32(s, 0);
+    put64(s, entries);
+    put64(s, entries);
+    put64(s, cd_size);
+    put64(s, cd_offset);
+
+    put32(s, 0x07064b50);
+    put32(s, 0);
+    put64(s, cd_offset + cd_size);
+    put32(s, 1);
+
+    put32(s, 0x06054b50);
+    put16(s, 0);
+    put16(s, 0);
+    put16(s, (uint16_t)std::min<uint64_t>(entries, 0xffff));
+    put16(s, (uint16_t)std::min<uint64_t>(entries, 0xffff));
+    put32(s, (uint32_t)std::min<uint64_t>(cd_size, 0xffffffffu));
+    put32(s, (uint32_t)std::min<uint64_t>(cd_offset, 0xffffffffu));
+    put16(s, 0);
+    return s;
+}
+
+static const int ZIP_AUTO_LEVEL = 6;
+static const size_t ZIP_SAMPLE_SIZE = 64 * 1024;
+static const uint64_t ZIP_MIN_DEFLATE_SIZE = 64;
+
+static bool incompressible_extension(const std::string &name) {
+    static const char *const exts[] = {
+        "jpg", "jpeg", "png", "gif", "webp", "heic", "heif", "avif",
+        "mp4", "m4v", "mkv", "mov", "avi", "webm", "wmv", "flv",
+        "mp3", "m4a", "aac", "ogg", "oga", "opus", "flac", "wma",
+        "zip", "gz", "tgz", "bz2", "xz", "txz", "zst", "lz4", "7z", "rar",
+        "jar", "apk", "aab", "ipa", "deb", "rpm", "whl", "dmg",
+        "docx", "xlsx", "pptx", "odt", "ods", "odp", "epub",
+    };
+    size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos || name.find('/', dot) != std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (auto &c : ext) c = (char)tolower((unsigned char)c);
+    for (const char *x : exts) {
+        if (ext == x) return true;
+    }
+    return false;
+}
+
+// Trial-compresses the first block at the fastest level; data that does not
+// shrink by at least a tenth is not worth deflating.
+static bool sample_compresses(const std::string &path, uint64_t size) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return true;
+
+    std::vector<char> in((size_t)std::min<uint64_t>(size, ZIP_SAMPLE_SIZE));
+    ssize_t r;
+    do {
+        r = pread(fd, in.data(), in.size(), 0);
+    } while (r < 0 && errno == EINTR);
+    ::close(fd);
+    if (r <= 0) return true;
+
+    uLongf out_len = compressBound((uLong)r);
+    std::vector<Bytef> out(out_len);
+    if (compress2(out.data(), &out_len, (const Bytef *)in.data(), (uLong)r, 1) != Z_OK) return true;
+    return out_len * 10 < (uLongf)r * 9;
+}
+
+void zip_choose_method(ZipEntry &e, int level) {
+    e.method = 0;
+    e.level = 0;
+    if (!S_ISREG(e.mode) || e.size == 0 || level == 0) return;
+
+    if (level == ZIP_LEVEL_AUTO) {
+        if (e.size < ZIP_MIN_DEFLATE_SIZE) return;
+        if (incompressible_extension(e.name)) return;
+        if (!sample_compresses(e.source, e.size)) return;
+        level = ZIP_AUTO_LEVEL;
+    }
+    e.method = 8;
+    e.level = std::min(level, 9);
+}
+
+bool zip_make_entry(const std::string &path, const std::string &name, ZipEntry &e) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        if (is_verbose()) elog("[archive] lstat failed for " + path);
+        return false;
+    }
+
+    e.source = path;
+    e.name = name;
+    e.mode = st.st_mode;
+    e.mtime = st.st_mtime;
+
+    if (S_ISDIR(st.st_mode)) {
+        if (e.name.empty() || e.name.back() != '/') e.name += '/';
+    } else if (S_ISREG(st.st_mode)) {
+        e.size = (uint64_t)st.st_size;
+    } else if (S_ISLNK(st.st_mode)) {
+        std::vector<char> linkbuf(PATH_MAX + 1);
+        ssize_t r = readlink(path.c_str(), linkbuf.data(), PATH_MAX);
+        if (r <= 0) {
+            if (is_verbose()) elog("[archive] readlink failed for " + path);
+            return false;
+        }
+        e.link_target.assign(linkbuf.data(), (size_t)r);
+        e.size = e.link_target.size();
+    } else {
+        if (is_verbose()) elog("[archive] Skipping special file " + path);
+        return false;
+    }
+    e.compressed_size = e.size;
+    return true;
+}
+
+bool zip_collect_dir(const std::string &dir, std::vector<ZipEntry> &out, std::string &root_name) {
+    fs::path base(dir);
+    std::error_code ec;
+    if (!fs::is_directory(base, ec)) {
+        elog("[archive] Source directory does not exist: " + dir);
+        return false;
+    }
+
+    root_name = base.filename().string();
+    if (root_name.empty()) {
+        root_name = base.parent_path().filename().string();
+        if (root_name.empty()) root_name = "archive";
+    }
+
+    ZipEntry root;
+    if (zip_make_entry(base.string(), root_name + "/", root)) out.push_back(root);
+
+    std::string prefix = base.string();
+    if (prefix.empty() || prefix.back() != '/') prefix += '/';
+
+    fs::recursive_directory_iterator it(base, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        std::string path = it->path().string();
+        std::string rel = path.compare(0, prefix.size(), prefix) == 0 ? path.substr(prefix.size())
+                                                                       : it->path().filename().string();
+        ZipEntry e;
+        if (zip_make_entry(path, root_name + "/" + rel, e)) out.push_back(std::move(e));
+    }
+    if (ec && is_verbose()) elog("[archive] Directory walk stopped: " + ec.message());
+    return true;
+}
+
+bool ZipPlan::scan(const std::string &dir, int level) {
+    entries_.clear();
+    central_offsets_.clear();
+
+    std::string root;
+    if (!zip_collect_dir(dir, entries_, root)) return false;
+    name_ = root + ".zip";
+
+    store_ = true;
+    mtime_ = 0;
+    size_t deflated = 0;
+    for (auto &e : entries_) {
+        zip_choose_method(e, level);
+        if (e.method != 0) {
+            store_ = false;
+            ++deflated;
+        }
+        mtime_ = std::max(mtime_, e.mtime);
+    }
+    crc_known_.assign(entries_.size(), 0);
+
+    if (store_) {
+        uint64_t off = 0;
+        for (auto &e : entries_) {
+            e.offset = off;
+            off += zip_local_header_size(e) + e.size + ZIP_DATA_DESCRIPTOR_SIZE;
+        }
+        cd_offset_ = off;
+        for (const auto &e : entries_) {
+            central_offsets_.push_back(off);
+            off += zip_central_header_size(e);
+        }
+        cd_size_ = off - cd_offset_;
+        size_ = off + ZIP_END_RECORDS_SIZE;
+    }
+
+    vlog("[archive] " + name_ + ": " + std::to_string(entries_.size()) + " entries, " +
+         std::to_string(deflated) + " deflated" + (store_ ? ", " + std::to_string(size_) + " bytes" : ""));
+    return true;
+}
+
+bool ZipPlan::crc(size_t i, uint32_t &out) {
+    {
+        std::lock_guard<std::mutex> lk(crc_mutex_);
+        if (crc_known_[i]) {
+            out = entries_[i].crc;
+            return true;
+        }
+    }
+
+    const ZipEntry &e = entries_[i];
+    uLong c = crc32(0L, Z_NULL, 0);
+    if (!e.link_target.empty()) {
+        c = crc32(c, (const Bytef *)e.link_target.data(), (uInt)e.link_target.size());
+    } else if (S_ISREG(e.mode) && e.size > 0) {
+        int fd = ::open(e.source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            vlog("[archive] Cannot open " + e.source);
+            return false;
+        }
+        std::vector<char> buf(ZIP_IO_BUFFER);
+        uint64_t left = e.size;
+        while (left > 0) {
+            ssize_t r = read(fd, buf.data(), (size_t)std::min<uint64_t>(left, buf.size()));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                vlog("[archive] " + e.source + " changed while archiving");
+                ::close(fd);
+                return false;
+            }
+            c = crc32(c, (const Bytef *)buf.data(), (uInt)r);
+            left -= (uint64_t)r;
+        }
+        ::close(fd);
+    }
+
+    remember_crc(i, (uint32_t)c);
+    out = (uint32_t)c;
+    return true;
+}
+
+void ZipPlan::remember_crc(size_t i, uint32_t crc) {
+    std::lock_guard<std::mutex> lk(crc_mutex_);
+    entries_[i].crc = crc;
+    crc_known_[i] = 1;
+}
+
+struct ZipStream::Deflater {
+    z_stream zs;
+    bool eof = false;
+    bool finished = false;
+    size_t out_off = 0;
+    size_t out_len = 0;
+    bool ok;
+
+    explicit Deflater(int level) {
+        memset(&zs, 0, sizeof(zs));
+        ok = deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    ~Deflater() {
+        if (ok) deflateEnd(&zs);
+    }
+};
+
+ZipStream::ZipStream(std::shared_ptr<ZipPlan> plan)
+    : plan_(std::move(plan)), in_(ZIP_IO_BUFFER)
+{
+    if (!plan_->stored()) out_.resize(ZIP_IO_BUFFER);
+    seek(0, -1);
+}
+
+ZipStream::~ZipStream() {
+    close_file();
+}
+
+void ZipStream::close_file() {
+    if (file_fd_ >= 0) ::close(file_fd_);
+    file_fd_ = -1;
+}
+
+bool ZipStream::seek(off_t offset, off_t length) {
+    close_file();
+    z_.reset();
+    lit_.clear();
+    loaded_ = false;
+    remaining_ = length < 0 ? -1 : length;
+    pos_ = (uint64_t)offset;
+    part_off_ = 0;
+    index_ = 0;
+
+    size_t n = plan_->entry_count();
+    if (!plan_->stored()) {
+        if (offset != 0) return false;
+        written_.assign(n, Written());
+        cd_offset_ = 0;
+        part_ = n > 0 ? Part::Local : Part::End;
+        return true;
+    }
+
+    uint64_t off = (uint64_t)offset;
+    uint64_t end_off = plan_->cd_offset() + plan_->cd_size();
+    if (off >= (uint64_t)plan_->size()) {
+        part_ = Part::Finished;
+    } else if (off >= end_off) {
+        part_ = Part::End;
+        part_off_ = off - end_off;
+    } else if (off >= plan_->cd_offset()) {
+        size_t lo = 0, hi = n;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (plan_->central_offset(mid) <= off) lo = mid; else hi = mid;
+        }
+        part_ = Part::Central;
+        index_ = lo;
+        part_off_ = off - plan_->central_offset(lo);
+    } else {
+        size_t lo = 0, hi = n;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (plan_->entry(mid).offset <= off) lo = mid; else hi = mid;
+        }
+        const ZipEntry &e = plan_->entry(lo);
+        uint64_t rel = off - e.offset;
+        uint64_t header = zip_local_header_size(e);
+        index_ = lo;
+        if (rel < header) {
+            part_ = Part::Local;
+            part_off_ = rel;
+        } else if (rel < header + e.size) {
+            part_ = Part::Data;
+            part_off_ = rel - header;
+        } else {
+            part_ = Part::Descriptor;
+            part_off_ = rel - header - e.size;
+        }
+    }
+    return true;
+}
+
+bool ZipStream::written_entry(size_t i, ZipEntry &out) {
+    out = plan_->entry(i);
+    if (plan_->stored()) return plan_->crc(i, out.crc);
+
+    out.offset = written_[i].offset;
+    out.compressed_size = written_[i].compressed_size;
+    out.size = written_[i].size;
+    out.crc = written_[i].crc;
+    return true;
+}
+
+bool ZipStream::load_part() {
+    switch (part_) {
+        case Part::Local: {
+            ZipEntry e = plan_->entry(index_);
+            if (!plan_->stored()) written_[index_].offset = pos_;
+            lit_ = zip_local_header(e, e.method == 0);
+            return true;
+        }
+        case Part::Data: {
+            const ZipEntry &e = plan_->entry(index_);
+            crc_ = (uint32_t)crc32(0L, Z_NULL, 0);
+            crc_running_ = part_off_ == 0;
+            read_ = part_off_;
+            if (S_ISREG(e.mode) && e.size > 0) {
+                file_fd_ = ::open(e.source.c_str(), O_RDONLY | O_CLOEXEC);
+                if (file_fd_ < 0) {
+                    vlog("[archive] Cannot open " + e.source + ": " + strerror(errno));
+                    return false;
+                }
+            }
+            if (e.method == 8) {
+                z_.reset(new Deflater(e.level));
+                if (!z_->ok) return false;
+            }
+            return true;
+        }
+        case Part::Descriptor: {
+            ZipEntry e;
+            if (!written_entry(index_, e)) return false;
+            lit_ = zip_data_descriptor(e);
+            return true;
+        }
+        case Part::Central: {
+            ZipEntry e;
+            if (!written_entry(index_, e)) return false;
+            lit_ = zip_central_header(e);
+            return true;
+        }
+        case Part::End: {
+            uint64_t cd_off = plan_->stored() ? plan_->cd_offset() : cd_offset_;
+            uint64_t cd_size = plan_->stored() ? plan_->cd_size() : pos_ - part_off_ - cd_offset_;
+            lit_ = zip_end_records(plan_->entry_count(), cd_off, cd_size);
+            return true;
+        }
+        case Part::Finished:
+            return true;
+    }
+    return false;
+}
+
+void ZipStream::advance() {
+    close_file();
+    z_.reset();
+    lit_.clear();
+    part_off_ = 0;
+    loaded_ = false;
+
+    size_t n = plan_->entry_count();
+    switch (part_) {
+        case Part::Local:
+            part_ = Part::Data;
+            break;
+        case Part::Data:
+            part_ = Part::Descriptor;
+            break;
+        case Part::Descriptor:
+            if (++index_ < n) {
+                part_ = Part::Local;
+            } else {
+                part_ = Part::Central;
+                index_ = 0;
+                cd_offset_ = pos_;
+            }
+            break;
+        case Part::Central:
+            if (++index_ >= n) part_ = Part::End;
+            break;
+        case Part::End:
+        case Part::Finished:
+            part_ = Part::Finished;
+            break;
+    }
+}
+
+void ZipStream::emit(const char *p, size_t n, const char *&data, size_t &len) {
+    if (remaining_ >= 0) n = (size_t)std::min<off_t>((off_t)n, remaining_);
+    data = p;
+    len = n;
+    pos_ += n;
+    part_off_ += n;
+    if (remaining_ >= 0) remaining_ -= (off_t)n;
+}
+
+bool ZipStream::next_data(const char *&data, size_t &len) {
+    const ZipEntry &e = plan_->entry(index_);
+    len = 0;
+
+    if (!z_) {
+        if (part_off_ < e.size) {
+            if (!e.link_target.empty()) {
+                crc_ = (uint32_t)crc32(crc_, (const Bytef *)e.link_target.data() + part_off_,
+                                       (uInt)(e.size - part_off_));
+                read_ = e.size;
+                emit(e.link_target.data() + part_off_, e.size - part_off_, data, len);
+                return true;
+            }
+
+            size_t want = (size_t)std::min<uint64_t>(in_.size(), e.size - part_off_);
+            if (remaining_ >= 0) want = (size_t)std::min<off_t>((off_t)want, remaining_);
+            ssize_t r;
+            do {
+                r = pread(file_fd_, in_.data(), want, (off_t)part_off_);
+            } while (r < 0 && errno == EINTR);
+            if (r <= 0) {
+                vlog("[archive] " + e.source + " changed while archiving");
+                return false;
+            }
+            crc_ = (uint32_t)crc32(crc_, (const Bytef *)in_.data(), (uInt)r);
+            read_ += (uint64_t)r;
+            emit(in_.data(), (size_t)r, data, len);
+            return true;
+        }
+
+        if (crc_running_) {
+            if (plan_->stored()) {
+                plan_->remember_crc(index_, crc_);
+            } else {
+                written_[index_].crc = crc_;
+                written_[index_].size = read_;
+                written_[index_].compressed_size = read_;
+            }
+        }
+        return true;
+    }
+
+    Deflater &z = *z_;
+    while (true) {
+        if (z.out_off < z.out_len) {
+            emit(out_.data() + z.out_off, z.out_len - z.out_off, data, len);
+            z.out_off += len;
+            return true;
+        }
+        if (z.finished) break;
+
+        if (z.zs.avail_in == 0 && !z.eof) {
+            ssize_t r;
+            do {
+                r = ::read(file_fd_, in_.data(), in_.size());
+            } while (r < 0 && errno == EINTR);
+            if (r < 0) {
+                vlog("[archive] Read failed for " + e.source + ": " + strerror(errno));
+                return false;
+            }
+            if (r == 0) {
+                z.eof = true;
+            } else {
+                crc_ = (uint32_t)crc32(crc_, (const Bytef *)in_.data(), (uInt)r);
+                read_ += (uint64_t)r;
+                z.zs.next_in = (Bytef *)in_.data();
+                z.zs.avail_in = (uInt)r;
+            }
+        }
+
+        z.zs.next_out = (Bytef *)out_.data();
+        z.zs.avail_out = (uInt)out_.size();
+        int rc = deflate(&z.zs, z.eof ? Z_FINISH : Z_NO_FLUSH);
+        if (rc == Z_STREAM_ERROR) return false;
+        z.out_off = 0;
+        z.out_len = out_.size() - z.zs.avail_out;
+        if (rc == Z_STREAM_END) z.finished = true;
+    }
+
+    written_[index_].crc = crc_;
+    written_[index_].size = read_;
+    written_[index_].compressed_size = part_off_;
+    return true;
+}
+
+bool ZipStream::next(const char *&data, size_t &len) {
+    len = 0;
+    while (remaining_ != 0 && part_ != Part::Finished) {
+        if (!loaded_) {
+            if (!load_part()) return false;
+            loaded_ = true;
+        }
+
+        if (part_ == Part::Data) {
+            if (!next_data(data, len)) return false;
+            if (len > 0) return true;
+            advance();
+            continue;
+        }
+
+        if (part_off_ < lit_.size()) {
+            emit(lit_.data() + part_off_, lit_.size() - part_off_, data, len);
+            return true;
+        }
+        advance();
+    }
+    return true;
+}
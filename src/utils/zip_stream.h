@@ -0,0 +1,151 @@
+#ifndef ZIP_STREAM_H
+#define ZIP_STREAM_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <ctime>
+#include <sys/types.h>
+
+// One archive member.
+struct ZipEntry {
+    std::string source;       // path on disk
+    std::string name;         // path inside the archive; directories end with '/'
+    std::string link_target;  // symlinks are stored with their target as data
+    uint64_t size = 0;        // uncompressed size
+    uint32_t mode = 0;        // st_mode
+    time_t mtime = 0;
+    uint16_t method = 0;      // 0 = store, 8 = deflate
+    int level = 0;            // deflate level
+
+    // Known once the entry has been written.
+    uint32_t crc = 0;
+    uint64_t compressed_size = 0;
+    uint64_t offset = 0;      // of the local header
+};
+
+// Zip64 record builders. Every entry gets a Zip64 extra field and a trailing
+// data descriptor, so an entry can be written before its CRC and compressed
+// size are known.
+std::string zip_local_header(const ZipEntry &e, bool sizes_known);
+std::string zip_data_descriptor(const ZipEntry &e);
+std::string zip_central_header(const ZipEntry &e);
+std::string zip_end_records(uint64_t entries, uint64_t cd_offset, uint64_t cd_size);
+
+uint64_t zip_local_header_size(const ZipEntry &e);
+uint64_t zip_central_header_size(const ZipEntry &e);
+extern const uint64_t ZIP_DATA_DESCRIPTOR_SIZE;
+extern const uint64_t ZIP_END_RECORDS_SIZE;
+
+// Compression level that lets zip_choose_method() decide per entry.
+const int ZIP_LEVEL_AUTO = -1;
+
+// Sets the method and level of `e` for the requested level: 0 stores,
+// 1-9 deflates, ZIP_LEVEL_AUTO stores media and already-compressed formats
+// (by extension, then by trial-compressing the first block) and deflates
+// the rest. Directories, symlinks and empty files are always stored.
+void zip_choose_method(ZipEntry &e, int level);
+
+// Fills `e` from lstat() of `path`; false for unreadable or special files.
+bool zip_make_entry(const std::string &path, const std::string &name, ZipEntry &e);
+
+// Lists `dir` recursively, with the directory itself as the top-level folder.
+bool zip_collect_dir(const std::string &dir, std::vector<ZipEntry> &out, std::string &root_name);
+
+// A directory archive served straight from the source files. When every
+// entry is stored the whole layout is fixed up front, so the exact size is
+// known and any byte range can be produced; with deflated entries the
+// archive can only be streamed from the start.
+class ZipPlan {
+public:
+    // `level` as for zip_choose_method().
+    bool scan(const std::string &dir, int level);
+
+    const std::string &name() const { return name_; }
+    bool stored() const { return store_; }
+    long long size() const { return store_ ? (long long)size_ : -1; }
+    time_t mtime() const { return mtime_; }
+
+    size_t entry_count() const { return entries_.size(); }
+    const ZipEntry &entry(size_t i) const { return entries_[i]; }
+    uint64_t cd_offset() const { return cd_offset_; }
+    uint64_t cd_size() const { return cd_size_; }
+    uint64_t central_offset(size_t i) const { return central_offsets_[i]; }
+
+    // Store mode: CRC of entry `i`, read from the file the first time it is
+    // needed unless a sequential pass has already recorded it.
+    bool crc(size_t i, uint32_t &out);
+    void remember_crc(size_t i, uint32_t crc);
+
+private:
+    std::string name_;
+    bool store_ = true;
+    time_t mtime_ = 0;
+    std::vector<ZipEntry> entries_;
+    std::vector<uint64_t> central_offsets_;
+    uint64_t cd_offset_ = 0;
+    uint64_t cd_size_ = 0;
+    uint64_t size_ = 0;
+
+    std::mutex crc_mutex_;
+    std::vector<char> crc_known_;
+};
+
+// Produces the bytes of a ZipPlan. Same contract as FileSource: seek() picks
+// the range, next() returns it chunk by chunk and len == 0 at the end.
+class ZipStream {
+public:
+    explicit ZipStream(std::shared_ptr<ZipPlan> plan);
+    ~ZipStream();
+
+    ZipStream(const ZipStream &) = delete;
+    ZipStream &operator=(const ZipStream &) = delete;
+
+    // `length` < 0 means up to the end of the archive. Deflate archives only
+    // support offset 0.
+    bool seek(off_t offset, off_t length);
+    bool next(const char *&data, size_t &len);
+
+private:
+    enum class Part { Local, Data, Descriptor, Central, End, Finished };
+
+    struct Written {
+        uint64_t offset = 0;
+        uint64_t compressed_size = 0;
+        uint64_t size = 0;
+        uint32_t crc = 0;
+    };
+
+    std::shared_ptr<ZipPlan> plan_;
+    Part part_ = Part::Local;
+    size_t index_ = 0;
+    uint64_t part_off_ = 0;
+    bool loaded_ = false;
+    uint64_t pos_ = 0;
+    off_t remaining_ = -1;
+
+    std::string lit_;
+    std::vector<Written> written_;
+    uint64_t cd_offset_ = 0;
+
+    int file_fd_ = -1;
+    uint32_t crc_ = 0;
+    bool crc_running_ = false;
+    uint64_t read_ = 0;
+    std::vector<char> in_;
+    std::vector<char> out_;
+
+    struct Deflater;
+    std::unique_ptr<Deflater> z_;
+
+    bool load_part();
+    void advance();
+    void close_file();
+    bool written_entry(size_t i, ZipEntry &out);
+    bool next_data(const char *&data, size_t &len);
+    void emit(const char *p, size_t n, const char *&data, size_t &len);
+};
+
+#endif